@@ -0,0 +1,721 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <ttie/ttie.h>
+
+using namespace ttie;
+
+template <typename F> static double time_ms(F &&fn, int iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() /
+           iterations;
+}
+
+// Счетчик промахов dTLB (perf_event_open). Если счетчик недоступен,
+// valid() == false
+struct DtlbMissCounter
+{
+    int fd = -1;
+
+    DtlbMissCounter()
+    {
+#if defined(__linux__)
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~DtlbMissCounter()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    bool valid() const { return fd >= 0; }
+
+    void start()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop()
+    {
+        long long count = 0;
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+            {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+};
+
+// GEMM на буферах с обычными страницами и с transparent huge pages
+static void bench_huge_pages()
+{
+    const size_t n = 512;
+
+    std::cout << "== GEMM " << n << "x" << n << ", 4 KiB pages vs huge pages\n";
+    std::cout << std::setw(12) << "pages" << std::setw(16) << "time, ms"
+              << std::setw(16) << "dTLB misses" << "\n";
+
+    for (bool huge : {false, true})
+    {
+        set_huge_pages(huge);
+        Tensor a, b;
+        a.shape = {n, n};
+        b.shape = {n, n};
+        a.resize();
+        b.resize();
+        for (size_t i = 0; i < a.data.size(); ++i)
+        {
+            a.data[i] = static_cast<float>(i % 13) * 0.1f;
+            b.data[i] = static_cast<float>(i % 7) * 0.1f;
+        }
+
+        DtlbMissCounter counter;
+        counter.start();
+        double ms = time_ms([&]() { Tensor c = matmul(a, b); }, 2);
+        long long misses = counter.stop();
+
+        std::cout << std::setw(12) << (huge ? "huge" : "4 KiB")
+                  << std::setw(16) << std::fixed << std::setprecision(1) << ms
+                  << std::setw(16)
+                  << (counter.valid() ? std::to_string(misses) : "n/a")
+                  << "\n";
+    }
+    set_huge_pages(false);
+}
+
+// Память активаций и время шага обучения для разных длин сегментов
+static void bench_checkpointing()
+{
+    const size_t width = 256, batch = 128, depth = 16;
+
+    std::cout << "== Gradient checkpointing: " << depth
+              << " x (Linear + ReLU), width " << width << ", batch " << batch
+              << "\n";
+    std::cout << std::setw(12) << "segment" << std::setw(20)
+              << "activations, KiB" << std::setw(16) << "step, ms" << "\n";
+
+    for (size_t k : {0, 2, 4, 8})
+    {
+        Model model;
+        for (size_t i = 0; i < depth; ++i)
+        {
+            model.add_layer(new Linear(width, width));
+            model.add_layer(new ReLU());
+        }
+        model.checkpoint_every(k);
+
+        Tensor input;
+        input.shape = {batch, width};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = static_cast<float>(i % 17) * 0.01f;
+        }
+
+        Tensor output;
+        size_t bytes = 0;
+        double ms = time_ms(
+            [&]() {
+                model.forward(input, output);
+                bytes = model.activation_bytes();
+                output.resize_grad();
+                std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+                model.backward(output, input);
+            },
+            3);
+
+        std::cout << std::setw(12) << (k ? std::to_string(k) : "off")
+                  << std::setw(20) << bytes / 1024 << std::setw(16)
+                  << std::fixed << std::setprecision(1) << ms << "\n";
+    }
+}
+
+// Пропускная способность шага обучения MLP в зависимости от числа реплик
+// DataParallel (потоков пула столько же, сколько реплик)
+static void bench_data_parallel()
+{
+    const size_t width = 512, batch = 256, depth = 4;
+
+    std::cout << "== DataParallel: " << depth << " x (Linear + ReLU), width "
+              << width << ", batch " << batch << "\n";
+    std::cout << std::setw(12) << "replicas" << std::setw(16) << "step, ms"
+              << std::setw(16) << "samples/s" << std::setw(12) << "speedup"
+              << "\n";
+
+    Model model;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        model.add_layer(new Linear(width, width));
+        model.add_layer(new ReLU());
+    }
+    Tensor input;
+    input.shape = {batch, width};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = static_cast<float>(i % 23) * 0.01f;
+    }
+
+    const size_t max_replicas =
+        std::max<size_t>(1, std::thread::hardware_concurrency());
+    double base_ms = 0.0;
+    for (size_t replicas = 1; replicas <= max_replicas; replicas *= 2)
+    {
+        set_num_threads(replicas);
+        DataParallel parallel(model, replicas);
+        Tensor output;
+        double ms = time_ms(
+            [&]() {
+                parallel.forward(input, output);
+                output.resize_grad();
+                std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+                parallel.backward(output, input);
+            },
+            3);
+        if (replicas == 1)
+        {
+            base_ms = ms;
+        }
+        std::cout << std::setw(12) << replicas << std::setw(16) << std::fixed
+                  << std::setprecision(1) << ms << std::setw(16)
+                  << std::setprecision(0) << batch * 1000.0 / ms
+                  << std::setw(12) << std::setprecision(2) << base_ms / ms
+                  << "\n";
+    }
+    set_num_threads(default_num_threads());
+}
+
+// Конвейер из 4 стадий: время forward и загрузка стадий в зависимости от
+// числа микробатчей
+static void bench_pipeline()
+{
+    const size_t width = 512, batch = 256, depth = 8, stages = 4;
+
+    std::cout << "== PipelineParallel: " << depth << " x (Linear + ReLU), width "
+              << width << ", batch " << batch << ", " << stages << " stages\n";
+
+    Model model;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        model.add_layer(new Linear(width, width));
+        model.add_layer(new ReLU());
+    }
+    model.eval();
+    Tensor input;
+    input.shape = {batch, width};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = static_cast<float>(i % 19) * 0.01f;
+    }
+
+    set_num_threads(1);
+    for (size_t micro_batches : {1, 4, 16})
+    {
+        PipelineParallel pipeline(model, stages, micro_batches);
+        Tensor output;
+        double ms = time_ms([&]() { pipeline.forward(input, output); }, 3);
+        std::cout << "micro-batches " << micro_batches << ": forward "
+                  << std::fixed << std::setprecision(1) << ms << " ms\n"
+                  << pipeline.stats_to_string();
+    }
+    set_num_threads(default_num_threads());
+}
+
+// Обновление параметров: цикл по тензорам против слитых шагов
+// оптимизаторов по общему буферу
+static void bench_optimizer()
+{
+    const size_t tensors = 64, size = 1 << 16;
+
+    std::cout << "== Optimizer step: " << tensors << " tensors x " << size
+              << " floats\n";
+
+    std::vector<Tensor> params(tensors);
+    std::vector<Tensor *> pointers;
+    for (Tensor &param : params)
+    {
+        param.shape = {size};
+        param.resize();
+        param.resize_grad();
+        std::fill(param.grad.begin(), param.grad.end(), 0.01f);
+        pointers.push_back(&param);
+    }
+
+    double naive_ms = time_ms(
+        [&]() {
+            for (Tensor *param : pointers)
+            {
+                for (size_t i = 0; i < param->data.size(); ++i)
+                {
+                    param->data[i] -= 0.01f * param->grad[i];
+                }
+                std::fill(param->grad.begin(), param->grad.end(), 0.0f);
+            }
+        },
+        5);
+    std::cout << std::setw(28) << "per-tensor SGD + zero_grad" << std::setw(12)
+              << std::fixed << std::setprecision(2) << naive_ms << " ms\n";
+
+    // Оптимизаторы проходят общий буфер параметров одним циклом
+    ParameterArena arena(pointers);
+    {
+        SGD sgd(pointers, 0.01f);
+        double ms = time_ms(
+            [&]() {
+                sgd.step();
+                sgd.zero_grad();
+            },
+            5);
+        std::cout << std::setw(28) << "fused SGD + zero_grad" << std::setw(12)
+                  << ms << " ms\n";
+    }
+    {
+        AdamW adam(pointers);
+        double ms = time_ms(
+            [&]() {
+                adam.clip_grad_norm(1.0f);
+                adam.step();
+                adam.zero_grad();
+            },
+            5);
+        std::cout << std::setw(28) << "fused clip + AdamW + zero" << std::setw(12)
+                  << ms << " ms\n";
+    }
+}
+
+static void bench_flat_params()
+{
+    const size_t layers = 512, width = 32;
+
+    std::cout << "== Flat parameters: " << layers << " x Linear(" << width
+              << ", " << width << ")\n";
+
+    Model model;
+    for (size_t i = 0; i < layers; ++i)
+    {
+        model.add_layer(new Linear(width, width));
+    }
+    for (Tensor *param : model.parameters())
+    {
+        param->resize_grad();
+    }
+
+    for (int flat = 0; flat < 2; ++flat)
+    {
+        if (flat)
+        {
+            model.flatten_parameters();
+        }
+        double zero_ms = time_ms([&]() { model.zero_grad(); }, 20);
+        double save_ms = time_ms(
+            [&]() {
+                std::stringstream stream;
+                model.save_parameters(stream);
+                model.load_parameters(stream);
+            },
+            20);
+        std::cout << std::setw(12) << (flat ? "flat" : "per-tensor")
+                  << "  zero_grad " << std::fixed << std::setprecision(3)
+                  << zero_ms << " ms, save+load " << save_ms << " ms\n";
+    }
+}
+
+static void bench_overlap()
+{
+    const size_t batch = 64, width = 512, depth = 6;
+
+    std::cout << "== Backward + AdamW: " << depth << " x Linear(" << width
+              << ", " << width << "), batch " << batch << "\n";
+
+    Model model;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        model.add_layer(new Linear(width, width));
+        model.add_layer(new Tanh());
+    }
+    model.flatten_parameters();
+    Tensor input;
+    input.shape = {batch, width};
+    input.resize();
+    std::fill(input.data.begin(), input.data.end(), 0.1f);
+    Tensor output;
+
+    AdamW adam(model.parameters());
+    auto train_step = [&]() {
+        adam.zero_grad();
+        model.forward(input, output);
+        output.resize_grad();
+        std::fill(output.grad.begin(), output.grad.end(), 0.01f);
+        model.backward(output, input);
+    };
+
+    double sequential_ms = time_ms(
+        [&]() {
+            train_step();
+            adam.step();
+        },
+        5);
+    std::cout << std::setw(24) << "backward, then step" << std::setw(12)
+              << std::fixed << std::setprecision(2) << sequential_ms << " ms\n";
+
+    OverlappedStep overlapped(model, adam);
+    double overlapped_ms = time_ms(
+        [&]() {
+            train_step();
+            overlapped.wait();
+        },
+        5);
+    std::cout << std::setw(24) << "overlapped step" << std::setw(12)
+              << overlapped_ms << " ms\n";
+}
+
+static void bench_mixed_precision()
+{
+    const size_t batch = 256, width = 512, depth = 4;
+
+    std::cout << "== Mixed precision: " << depth << " x Linear(" << width
+              << ", " << width << ") + Tanh, batch " << batch << "\n";
+
+    Tensor input;
+    input.shape = {batch, width};
+    input.resize();
+    std::fill(input.data.begin(), input.data.end(), 0.1f);
+
+    for (Precision precision :
+         {Precision::Float32, Precision::BFloat16, Precision::Float16})
+    {
+        Model model;
+        for (size_t i = 0; i < depth; ++i)
+        {
+            model.add_layer(new Linear(width, width));
+            model.add_layer(new Tanh());
+        }
+        model.set_precision(precision);
+        Tensor output;
+        size_t bytes = 0;
+        double train_ms = time_ms(
+            [&]() {
+                model.forward(input, output);
+                bytes = model.activation_bytes();
+                output.resize_grad();
+                std::fill(output.grad.begin(), output.grad.end(), 0.01f);
+                model.backward(output, input);
+            },
+            3);
+
+        model.eval();
+        NoGradGuard no_grad;
+        double eval_ms = time_ms([&]() { model.forward(input, output); }, 3);
+        std::cout << std::setw(6) << precision_name(precision)
+                  << "  activations " << std::setw(8) << bytes / 1024
+                  << " KiB, train step " << std::fixed << std::setprecision(2)
+                  << train_ms << " ms, eval forward " << eval_ms << " ms\n";
+    }
+}
+
+static void bench_dtype_matmul()
+{
+    const size_t n = 256;
+
+    std::cout << "== matmul " << n << "x" << n << " by dtype\n";
+
+    Tensor a, b;
+    a.shape = {n, n};
+    a.resize();
+    b.shape = {n, n};
+    b.resize();
+    for (size_t i = 0; i < a.data.size(); ++i)
+    {
+        a.data[i] = static_cast<float>(i % 7) - 3.0f;
+        b.data[i] = static_cast<float>(i % 5) - 2.0f;
+    }
+
+    const std::pair<DType, DType> cases[] = {
+        {DType::Float32, DType::Float32}, {DType::Float64, DType::Float64},
+        {DType::BFloat16, DType::Float32}, {DType::Float16, DType::Float16},
+        {DType::Int8, DType::Int8}};
+    for (const auto &c : cases)
+    {
+        Tensor ta = a.to(c.first);
+        Tensor tb = b.to(c.second);
+        Tensor result;
+        double ms = time_ms([&]() { result = matmul(ta, tb); }, 3);
+        std::cout << std::setw(9) << dtype_name(c.first) << " x "
+                  << std::setw(9) << dtype_name(c.second) << " -> "
+                  << std::setw(8) << dtype_name(result.dtype) << std::fixed
+                  << std::setprecision(2) << std::setw(10) << ms << " ms\n";
+    }
+}
+
+static void bench_int8()
+{
+    const size_t batch = 64, width = 512, depth = 4;
+
+    std::cout << "== int8 quantization: " << depth << " x Linear(" << width
+              << ", " << width << ") + ReLU, batch " << batch << "\n";
+
+    Model model;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        model.add_layer(new Linear(width, width));
+        model.add_layer(new ReLU());
+    }
+    Tensor input;
+    input.shape = {batch, width};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = static_cast<float>(i % 13) / 13.0f - 0.5f;
+    }
+
+    std::unique_ptr<Model> quantized;
+    {
+        Int8Quantizer quantizer(model, Calibration::Histogram);
+        quantizer.calibrate(input);
+        quantized = quantizer.quantized_model();
+    }
+    model.eval();
+
+    NoGradGuard no_grad;
+    Tensor output;
+    double float_ms = time_ms([&]() { model.forward(input, output); }, 3);
+    double int8_ms = time_ms([&]() { quantized->forward(input, output); }, 3);
+    QuantizationReport report = compare_models(model, *quantized, input);
+    std::cout << std::fixed << std::setprecision(2) << "float32 "
+              << std::setw(10) << float_ms << " ms\n"
+              << "int8    " << std::setw(10) << int8_ms << " ms\n"
+              << std::setprecision(6) << report.to_string() << "\n";
+}
+
+static void bench_int4()
+{
+    const size_t n = 2048;
+
+    std::cout << "== Linear(" << n << ", " << n << ") weights by format\n";
+
+    Linear linear(n, n);
+    linear.eval();
+    QuantizedLinear int8(linear, -1.0f, 1.0f);
+    std::vector<std::unique_ptr<Int4Linear>> int4;
+    for (size_t group_size : {32, 64, 128})
+    {
+        int4.emplace_back(new Int4Linear(linear, group_size));
+    }
+
+    NoGradGuard no_grad;
+    for (size_t batch : {1, 16})
+    {
+        Tensor input, output;
+        input.shape = {batch, n};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = static_cast<float>(i % 17) / 17.0f - 0.5f;
+        }
+
+        auto report = [&](const std::string &name, Layer &layer, size_t bytes) {
+            double ms = time_ms([&]() { layer.forward(input, output); }, 3);
+            std::cout << "batch " << std::setw(2) << batch << "  "
+                      << std::setw(14) << std::left << name << std::right
+                      << std::fixed << std::setprecision(2) << std::setw(8)
+                      << bytes / 1048576.0 << " MiB" << std::setw(10) << ms
+                      << " ms\n";
+        };
+        report("float32", linear, linear.weight.size() * sizeof(float));
+        report("int8", int8, int8.weight_bytes());
+        for (std::unique_ptr<Int4Linear> &layer : int4)
+        {
+            report("int4 g" + std::to_string(layer->group_size), *layer,
+                   layer->weight_bytes());
+        }
+    }
+}
+
+static void bench_binary()
+{
+    const size_t n = 2048;
+
+    std::cout << "== Linear(" << n << ", " << n
+              << ") with binary / ternary weights\n";
+
+    Linear linear(n, n);
+    linear.eval();
+    PackedBinaryLinear binary(BinaryLinear(linear, false));
+    PackedBinaryLinear ternary(BinaryLinear(linear, true));
+
+    NoGradGuard no_grad;
+    for (size_t batch : {1, 16})
+    {
+        Tensor input, output;
+        input.shape = {batch, n};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = static_cast<float>(i % 17) / 17.0f - 0.5f;
+        }
+
+        auto report = [&](const std::string &name, Layer &layer, size_t bytes) {
+            double ms = time_ms([&]() { layer.forward(input, output); }, 3);
+            std::cout << "batch " << std::setw(2) << batch << "  "
+                      << std::setw(9) << std::left << name << std::right
+                      << std::fixed << std::setprecision(2) << std::setw(8)
+                      << bytes / 1048576.0 << " MiB" << std::setw(10) << ms
+                      << " ms\n";
+        };
+        report("float32", linear, linear.weight.size() * sizeof(float));
+        report("binary", binary, binary.weight_bytes());
+        report("ternary", ternary, ternary.weight_bytes());
+    }
+}
+
+static void bench_sparse()
+{
+    const size_t n = 2048;
+
+    std::cout << "== Linear(" << n << ", " << n << ") after magnitude pruning\n";
+
+    Linear linear(n, n);
+    linear.eval();
+    std::vector<std::unique_ptr<SparseLinear>> sparse;
+    for (float sparsity : {0.8f, 0.9f, 0.95f})
+    {
+        Linear pruned = linear;
+        prune_by_magnitude(pruned, sparsity);
+        sparse.emplace_back(new SparseLinear(pruned));
+    }
+
+    for (size_t batch : {1, 16})
+    {
+        Tensor input, output;
+        input.shape = {batch, n};
+        input.resize();
+        input.requires_grad = true;
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = static_cast<float>(i % 17) / 17.0f - 0.5f;
+        }
+
+        auto report = [&](const std::string &name, Layer &layer) {
+            double forward_ms =
+                time_ms([&]() { layer.forward(input, output); }, 3);
+            output.resize_grad();
+            std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+            double backward_ms =
+                time_ms([&]() { layer.backward(output, input); }, 3);
+            std::cout << "batch " << std::setw(2) << batch << "  "
+                      << std::setw(12) << std::left << name << std::right
+                      << std::fixed << std::setprecision(2) << " forward "
+                      << std::setw(8) << forward_ms << " ms  backward "
+                      << std::setw(8) << backward_ms << " ms\n";
+        };
+        report("dense", linear);
+        for (std::unique_ptr<SparseLinear> &layer : sparse)
+        {
+            std::stringstream name;
+            name << "sparse " << std::setprecision(2) << layer->sparsity();
+            report(name.str(), *layer);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string only = argc > 1 ? argv[1] : "";
+    if (only.empty() || only == "checkpointing")
+    {
+        bench_checkpointing();
+    }
+    if (only.empty() || only == "huge_pages")
+    {
+        bench_huge_pages();
+    }
+    if (only.empty() || only == "data_parallel")
+    {
+        bench_data_parallel();
+    }
+    if (only.empty() || only == "pipeline")
+    {
+        bench_pipeline();
+    }
+    if (only.empty() || only == "optimizer")
+    {
+        bench_optimizer();
+    }
+    if (only.empty() || only == "flat_params")
+    {
+        bench_flat_params();
+    }
+    if (only.empty() || only == "overlap")
+    {
+        bench_overlap();
+    }
+    if (only.empty() || only == "mixed_precision")
+    {
+        bench_mixed_precision();
+    }
+    if (only.empty() || only == "dtype_matmul")
+    {
+        bench_dtype_matmul();
+    }
+    if (only.empty() || only == "int8")
+    {
+        bench_int8();
+    }
+    if (only.empty() || only == "int4")
+    {
+        bench_int4();
+    }
+    if (only.empty() || only == "binary")
+    {
+        bench_binary();
+    }
+    if (only.empty() || only == "sparse")
+    {
+        bench_sparse();
+    }
+    return 0;
+}
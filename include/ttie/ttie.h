@@ -2,19 +2,52 @@
 #define TTIE_H
 
 #include <cassert>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <exception>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
 #include <vector>
 #include <cmath>
 #include <numeric>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TTIE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
 
 namespace ttie
 {
-template <typename T>
-static std::string vector_to_string(const std::vector<T> &vec, size_t limit = 5)
+template <typename Container>
+static std::string vector_to_string(const Container &vec, size_t limit = 5)
 {
     std::stringstream ss;
     ss << "[";
@@ -31,623 +64,6629 @@ static std::string vector_to_string(const std::vector<T> &vec, size_t limit = 5)
     return ss.str();
 }
 
-struct Tensor
+// Число потоков по умолчанию: переменная окружения TTIE_NUM_THREADS или
+// число ядер
+inline size_t default_num_threads()
 {
-    std::vector<size_t> shape;
-
-    std::vector<float> data;
-    std::vector<float> grad;
-
-    bool validate_shape() const
+    if (const char *env = std::getenv("TTIE_NUM_THREADS"))
     {
-        if (shape.empty())
+        long n = std::strtol(env, nullptr, 10);
+        if (n > 0)
         {
-            return false;
+            return static_cast<size_t>(n);
         }
+    }
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
 
-        for (size_t dim : shape)
-        {
-            if (dim == 0)
-            {
-                return false;
-            }
-        }
+// Число потоков для параллельных ядер
+inline size_t &num_threads_ref()
+{
+    static size_t num_threads = default_num_threads();
+    return num_threads;
+}
 
-        return true;
-    }
-    size_t size() const
+// Разбирает список номеров в формате /sys, например "0-3,8,10-11"
+inline std::vector<size_t> parse_cpu_list(const std::string &list)
+{
+    std::vector<size_t> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
     {
-        if (!validate_shape())
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0])))
         {
-            throw std::invalid_argument("Invalid tensor shape");
+            continue;
         }
-        size_t total = 1;
-        for (size_t dim : shape)
+        const size_t dash = range.find('-');
+        const size_t first = std::stoul(range.substr(0, dash));
+        const size_t last = dash == std::string::npos
+                                ? first
+                                : std::stoul(range.substr(dash + 1));
+        for (size_t cpu = first; cpu <= last; ++cpu)
         {
-            total *= dim;
+            cpus.push_back(cpu);
         }
-        return total;
     }
+    return cpus;
+}
 
-    void resize() { data.resize(size()); }
-
-    void resize_grad() { grad.resize(size()); }
+// Топология NUMA: CPU каждого узла по /sys/devices/system/node. Без NUMA
+// (или не на Linux) - один узел со всеми CPU. Узлы без CPU пропускаются,
+// поэтому номера узлов здесь подряд
+struct NumaTopology
+{
+    std::vector<std::vector<size_t>> node_cpus;
+    std::vector<size_t> cpu_node;
 
-    void zero_grad() { std::fill(grad.begin(), grad.end(), 0.0f); }
+    size_t num_nodes() const { return node_cpus.size(); }
 
-    Tensor transpose(size_t dim1, size_t dim2) const
+    size_t node_of_cpu(size_t cpu) const
     {
-        if (dim1 >= shape.size() || dim2 >= shape.size())
-        {
-            throw std::invalid_argument("Invalid dimension index");
-        }
-
-        if (dim1 == dim2)
-        {
-            return *this;
-        }
-
-        // Создаем новую перестановку осей
-        std::vector<size_t> new_order(shape.size());
-        std::iota(new_order.begin(), new_order.end(), 0); // заполняем 0, 1, 2, ...
-
-        // Меняем местами выбранные оси
-        std::swap(new_order[dim1], new_order[dim2]);
-
-        // Новые размерности после транспонирования
-        std::vector<size_t> new_shape(shape.size());
-        for (size_t i = 0; i < shape.size(); ++i)
-        {
-            new_shape[i] = shape[new_order[i]];
-        }
+        return cpu < cpu_node.size() ? cpu_node[cpu] : 0;
+    }
 
-        // Вычисляем шаги для исходных размерностей
-        std::vector<size_t> strides(shape.size());
-        strides.back() = 1;
-        for (int i = shape.size() - 2; i >= 0; --i)
+    static NumaTopology detect()
+    {
+        NumaTopology topology;
+#if defined(__linux__)
+        const std::string root = "/sys/devices/system/node/";
+        std::ifstream online(root + "online");
+        std::string nodes;
+        if (online && std::getline(online, nodes))
         {
-            strides[i] = strides[i + 1] * shape[i + 1];
+            for (size_t node : parse_cpu_list(nodes))
+            {
+                std::ifstream file(root + "node" + std::to_string(node) +
+                                   "/cpulist");
+                std::string list;
+                if (file && std::getline(file, list))
+                {
+                    std::vector<size_t> cpus = parse_cpu_list(list);
+                    if (!cpus.empty())
+                    {
+                        topology.node_cpus.push_back(cpus);
+                    }
+                }
+            }
         }
-
-        // Вычисляем шаги для новых размерностей
-        std::vector<size_t> new_strides(new_shape.size());
-        new_strides.back() = 1;
-        for (int i = new_shape.size() - 2; i >= 0; --i)
+#endif
+        if (topology.node_cpus.empty())
         {
-            new_strides[i] = new_strides[i + 1] * new_shape[i + 1];
+            std::vector<size_t> cpus(
+                std::max<size_t>(1, std::thread::hardware_concurrency()));
+            std::iota(cpus.begin(), cpus.end(), 0);
+            topology.node_cpus.push_back(cpus);
         }
-
-        // Создаем результирующий тензор
-        Tensor result;
-        result.shape = new_shape;
-        result.resize();
-
-        // Вспомогательный вектор для индексации
-        std::vector<size_t> indices(shape.size(), 0);
-
-        // Перебираем все элементы и переставляем их
-        for (size_t flat_idx = 0; flat_idx < result.size(); ++flat_idx)
+        for (size_t node = 0; node < topology.num_nodes(); ++node)
         {
-            // Вычисляем многомерный индекс в исходном порядке
-            size_t remaining = flat_idx;
-            for (size_t i = 0; i < shape.size(); ++i)
+            for (size_t cpu : topology.node_cpus[node])
             {
-                indices[i] = remaining / strides[i];
-                remaining %= strides[i];
+                if (cpu >= topology.cpu_node.size())
+                {
+                    topology.cpu_node.resize(cpu + 1, 0);
+                }
+                topology.cpu_node[cpu] = node;
             }
+        }
+        return topology;
+    }
 
-            // Вычисляем новый плоский индекс
-            size_t new_flat_idx = 0;
-            for (size_t i = 0; i < new_order.size(); ++i)
-            {
-                new_flat_idx += indices[new_order[i]] * new_strides[i];
-            }
+    static const NumaTopology &instance()
+    {
+        static const NumaTopology topology = detect();
+        return topology;
+    }
 
-            result.data[new_flat_idx] = data[flat_idx];
-        }
-        
-        return result;
+    // CPU для потока с номером slot: потоки по очереди распределяются по
+    // узлам, внутри узла - по его CPU
+    size_t cpu_for_slot(size_t slot) const
+    {
+        const std::vector<size_t> &cpus = node_cpus[slot % num_nodes()];
+        return cpus[(slot / num_nodes()) % cpus.size()];
     }
+};
 
-    Tensor view(const std::vector<size_t>& new_shape) const
+// Привязывает текущий поток к заданным CPU. false, если не удалось
+inline bool pin_current_thread(const std::vector<size_t> &cpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t cpu : cpus)
     {
-        if (!validate_shape())
+        if (cpu < CPU_SETSIZE)
         {
-            throw std::invalid_argument("Invalid tensor shape");
+            CPU_SET(cpu, &set);
         }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
 
-        // Проверяем, что новая форма совместима по размеру
-        size_t new_size = 1;
-        for (size_t dim : new_shape)
+// Узел NUMA, на котором сейчас выполняется поток
+inline size_t current_numa_node()
+{
+#if defined(__linux__)
+    const int cpu = sched_getcpu();
+    if (cpu >= 0)
+    {
+        return NumaTopology::instance().node_of_cpu(static_cast<size_t>(cpu));
+    }
+#endif
+    return 0;
+}
+
+// Выполняет fn в потоке, привязанном к CPU узла node. Память, которую fn
+// выделяет и заполняет первой, размещается на этом узле (first touch)
+inline void run_on_numa_node(size_t node, const std::function<void()> &fn)
+{
+    std::exception_ptr error;
+    std::thread thread([&]() {
+        pin_current_thread(NumaTopology::instance().node_cpus.at(node));
+        try
         {
-            new_size *= dim;
+            fn();
         }
-
-        if (new_size != size())
+        catch (...)
         {
-            throw std::invalid_argument("Total size of new shape must match original tensor size");
+            error = std::current_exception();
         }
-
-        // Создаем новый тензор с новой формой
-        Tensor result;
-        result.shape = new_shape;
-        result.data = data;
-        result.grad = grad;
-
-        return result;
+    });
+    thread.join();
+    if (error)
+    {
+        std::rethrow_exception(error);
     }
+}
 
-    Tensor copy() const
+// Привязка рабочих потоков пула к CPU (по умолчанию выключена)
+inline std::atomic<bool> &thread_pinning_ref()
+{
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+// Общий для всей библиотеки пул потоков с перехватом задач (work
+// stealing). У каждого рабочего потока своя очередь, освободившийся поток
+// забирает задачи из чужих. Поток, вызвавший run, тоже выполняет задачи,
+// поэтому вложенные parallel_for не блокируют друг друга
+class ThreadPool
+{
+  public:
+    static ThreadPool &instance()
     {
-        Tensor result;
-        result.shape = shape;
-        result.data = data;
-        result.grad = grad;
-        return result;
+        static ThreadPool pool(num_threads_ref());
+        return pool;
     }
 
+    ~ThreadPool() { stop_workers(); }
 
-    friend std::ostream &operator<<(std::ostream &os, const Tensor &t)
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Число потоков вместе с вызывающим
+    size_t size() const { return workers.size() + 1; }
+
+    // Пересоздает рабочие потоки. Нельзя вызывать во время run
+    void resize(size_t threads)
     {
-        os << "Tensor@" << &t;
+        stop_workers();
+        start_workers(threads);
+    }
 
-        if (t.shape.empty())
+    // Выполняет fn(i) для i из [0, count) и ждет завершения. Первое
+    // исключение из задач пробрасывается вызывающему
+    void run(size_t count, const std::function<void(size_t)> &fn)
+    {
+        if (workers.empty())
         {
-            os << "(not initialized)";
-            return os;
+            for (size_t i = 0; i < count; ++i)
+            {
+                fn(i);
+            }
+            return;
         }
 
-        os << "(shape=" << vector_to_string(t.shape);
-
-        if (!t.data.empty())
+        Group group;
+        group.fn = &fn;
+        group.pending.store(count);
+        for (size_t i = 0; i < count; ++i)
         {
-            os << ", data=" << vector_to_string(t.data);
+            Queue &queue = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(Task{&group, i});
         }
-        else
+        queued.fetch_add(count);
         {
-            os << ", data=[no data]";
+            std::lock_guard<std::mutex> lock(sleep_mutex);
         }
+        wake.notify_all();
 
-        if (!t.grad.empty())
+        // Помогаем, пока есть задачи в очередях, затем спим до завершения
+        // задач группы, взятых другими потоками
+        Task task;
+        while (group.pending.load(std::memory_order_acquire) > 0 &&
+               try_pop(task))
         {
-            os << ", grad=" << vector_to_string(t.grad);
+            execute(task);
+        }
+        {
+            std::unique_lock<std::mutex> lock(group.done_mutex);
+            group.done_cv.wait(lock, [&group]() { return group.done; });
+        }
+        if (group.error)
+        {
+            std::rethrow_exception(group.error);
         }
-
-        os << ")";
-        return os;
     }
-};
 
-inline Tensor matmul(const Tensor &a, const Tensor &b)
-{
-    if (a.shape.size() < 2 || b.shape.size() < 2)
+  private:
+    struct Group
     {
-        throw std::invalid_argument("Tensors must have at least 2 dimensions");
-    }
+        const std::function<void(size_t)> *fn = nullptr;
+        std::atomic<size_t> pending{0};
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        // Выставляется последней задачей
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+    };
+
+    struct Task
+    {
+        Group *group = nullptr;
+        size_t index = 0;
+    };
 
-    // Проверяем совместимость последних двух осей
-    size_t a_cols = a.shape.back();
-    size_t b_rows = b.shape[b.shape.size()-2];
-    size_t b_cols = b.shape.back();
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
 
-    if (a_cols != b_rows)
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    explicit ThreadPool(size_t threads) { start_workers(threads); }
+
+    // Индекс очереди текущего рабочего потока (size_t(-1) вне пула)
+    static size_t &worker_index()
     {
-        throw std::invalid_argument("Incompatible matrix dimensions for multiplication");
+        thread_local size_t index = static_cast<size_t>(-1);
+        return index;
     }
 
-    // Проверяем, что все остальные размерности совпадают
-    if (a.shape.size() != b.shape.size())
+    void start_workers(size_t threads)
     {
-        throw std::invalid_argument("Tensors must have same number of dimensions");
+        const size_t count = std::max<size_t>(1, threads) - 1;
+        queues.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            queues.emplace_back(new Queue());
+        }
+        const bool pin = thread_pinning_ref().load();
+        for (size_t i = 0; i < count; ++i)
+        {
+            workers.emplace_back([this, i, pin]() {
+                // Слот 0 остается вызывающему потоку
+                if (pin)
+                {
+                    pin_current_thread(
+                        {NumaTopology::instance().cpu_for_slot(i + 1)});
+                }
+                worker_loop(i);
+            });
+        }
     }
 
-    for (size_t i = 0; i < a.shape.size()-2; ++i)
+    void stop_workers()
     {
-        if (a.shape[i] != b.shape[i])
         {
-            throw std::invalid_argument("Batch dimensions must match");
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
         }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+        stopping = false;
     }
 
-    // Создаем форму результата
-    std::vector<size_t> result_shape = a.shape;
-    result_shape.back() = b_cols; // Заменяем последнюю размерность
-    result_shape[result_shape.size()-2] = a.shape[a.shape.size()-2]; // Сохраняем предпоследнюю
-
-    Tensor result;
-    result.shape = result_shape;
-    result.resize();
-
-    // Вспомогательные переменные для индексации
-    size_t a_row_stride = a_cols;
-    size_t a_batch_stride = a.shape[a.shape.size()-2] * a_row_stride;
-    
-    size_t b_row_stride = b_cols;
-    size_t b_batch_stride = b_rows * b_row_stride;
-    
-    size_t result_row_stride = b_cols;
-    size_t result_batch_stride = a.shape[a.shape.size()-2] * result_row_stride;
-
-    // Общее количество "матриц" для перемножения
-    size_t total_matrices = 1;
-    for (size_t i = 0; i < a.shape.size()-2; ++i)
+    // Своя очередь берется с начала, чужие - с конца
+    bool try_pop(Task &task)
     {
-        total_matrices *= a.shape[i];
+        const size_t n = queues.size();
+        const size_t own = worker_index();
+        for (size_t k = 0; k < n; ++k)
+        {
+            const size_t q = own < n ? (own + k) % n : k;
+            Queue &queue = *queues[q];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+            {
+                continue;
+            }
+            if (q == own)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
     }
 
-    // Выполняем матричное умножение для каждого батча/головы
-    for (size_t matrix = 0; matrix < total_matrices; ++matrix)
+    static void execute(const Task &task)
     {
-        size_t a_offset = matrix * a_batch_stride;
-        size_t b_offset = matrix * b_batch_stride;
-        size_t result_offset = matrix * result_batch_stride;
-
-        for (size_t i = 0; i < a.shape[a.shape.size()-2]; ++i)
+        Group &group = *task.group;
+        if (!group.failed.load(std::memory_order_relaxed))
         {
-            for (size_t j = 0; j < b_cols; ++j)
+            try
+            {
+                (*group.fn)(task.index);
+            }
+            catch (...)
             {
-                float sum = 0.0f;
-                for (size_t k = 0; k < a_cols; ++k)
+                std::lock_guard<std::mutex> lock(group.error_mutex);
+                if (!group.error)
                 {
-                    size_t a_idx = a_offset + i * a_row_stride + k;
-                    size_t b_idx = b_offset + k * b_row_stride + j;
-                    sum += a.data[a_idx] * b.data[b_idx];
+                    group.error = std::current_exception();
                 }
-                size_t result_idx = result_offset + i * result_row_stride + j;
-                result.data[result_idx] = sum;
+                group.failed.store(true, std::memory_order_relaxed);
             }
         }
+        // Последняя задача будит вызывающий поток. Он ждет done под
+        // done_mutex, поэтому group уничтожается только после unlock
+        if (group.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> lock(group.done_mutex);
+            group.done = true;
+            group.done_cv.notify_all();
+        }
     }
 
-    return result;
+    void worker_loop(size_t index)
+    {
+        worker_index() = index;
+        while (true)
+        {
+            Task task;
+            if (try_pop(task))
+            {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock,
+                      [this]() { return stopping || queued.load() > 0; });
+            if (stopping)
+            {
+                return;
+            }
+        }
+    }
+};
+
+// Меняет число потоков пула. Нельзя вызывать во время параллельной работы
+inline void set_num_threads(size_t n)
+{
+    num_threads_ref() = std::max<size_t>(1, n);
+    ThreadPool::instance().resize(num_threads_ref());
 }
 
-struct Layer
+inline size_t get_num_threads() { return num_threads_ref(); }
+
+// Включает привязку рабочих потоков к CPU: потоки по очереди
+// распределяются по узлам NUMA. Пул пересоздается, поэтому нельзя
+// вызывать во время параллельной работы
+inline void set_thread_pinning(bool enabled)
 {
-    virtual void forward(const Tensor &input, Tensor &output) = 0;
-    virtual void backward(const Tensor &grad_output, Tensor &grad_input) = 0;
-    virtual std::string to_string() const = 0;
-    virtual std::vector<Tensor *> parameters() = 0;
-    virtual ~Layer() {}
-};
+    thread_pinning_ref() = enabled;
+    ThreadPool::instance().resize(num_threads_ref());
+}
 
-struct Linear : Layer
+inline bool thread_pinning_enabled() { return thread_pinning_ref(); }
+
+// Модель стоимости: минимальный объем работы (в простых операциях над
+// элементом) на одну задачу. Меньшие тензоры считаются в одном потоке
+constexpr size_t kParallelMinWork = 16384;
+
+// Относительная стоимость exp/tanh по сравнению со сложением
+constexpr size_t kTranscendentalCost = 8;
+
+// Задач на поток: с запасом, чтобы свободные потоки могли перехватывать
+// работу у занятых
+constexpr size_t kTasksPerThread = 4;
+
+// Минимальное число итераций на задачу, если одна итерация стоит
+// work_per_item операций
+inline size_t parallel_grain(size_t work_per_item)
 {
-    Tensor weight;
-    Tensor bias;
+    return std::max<size_t>(1, kParallelMinWork / std::max<size_t>(1, work_per_item));
+}
 
-    Linear(size_t in_features, size_t out_features)
+// Делит [begin, end) на непрерывные отрезки не короче grain и выполняет
+// fn(chunk_begin, chunk_end) на пуле потоков. Маленькие диапазоны
+// выполняются в вызывающем потоке
+inline void parallel_for(size_t begin, size_t end, size_t grain,
+                         const std::function<void(size_t, size_t)> &fn)
+{
+    if (begin >= end)
     {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_real_distribution<float> dis(-0.1f, 0.1f);
+        return;
+    }
+    const size_t range = end - begin;
+    grain = std::max<size_t>(1, grain);
+    const size_t threads = get_num_threads();
+    size_t tasks = std::min(threads * kTasksPerThread, (range + grain - 1) / grain);
+    if (threads <= 1 || tasks <= 1)
+    {
+        fn(begin, end);
+        return;
+    }
 
-        weight.shape = {in_features, out_features};
-        weight.resize();
-        for (size_t i = 0; i < in_features * out_features; ++i)
-        {
-            weight.data[i] = dis(gen);
-        }
+    const size_t chunk = (range + tasks - 1) / tasks;
+    tasks = (range + chunk - 1) / chunk;
+    ThreadPool::instance().run(tasks, [&](size_t t) {
+        const size_t b = begin + t * chunk;
+        fn(b, std::min(end, b + chunk));
+    });
+}
 
-        bias.shape = {out_features};
-        bias.resize();
-        for (size_t i = 0; i < out_features; ++i)
-        {
-            bias.data[i] = dis(gen);
-        }
+// Буферы от kFirstTouchBytes заполняются на пуле с тем же разбиением, что
+// и поэлементные ядра: страницы попадают на узлы NUMA потоков, которые
+// затем их обрабатывают (first touch)
+constexpr size_t kFirstTouchBytes = size_t(1) << 20;
+
+template <typename T> void first_touch_fill(T *ptr, size_t n, const T &value)
+{
+    if (n * sizeof(T) < kFirstTouchBytes)
+    {
+        std::fill(ptr, ptr + n, value);
+        return;
     }
+    parallel_for(0, n, parallel_grain(1), [&](size_t first, size_t last) {
+        std::fill(ptr + first, ptr + last, value);
+    });
+}
 
-    std::vector<Tensor *> parameters() override { return {&weight, &bias}; }
+// Верхняя граница числа частичных результатов parallel_reduce
+constexpr size_t kMaxReduceChunks = 256;
 
-    void forward(const Tensor &input, Tensor &output) override
+// Параллельная свертка [begin, end): map(b, e) возвращает результат
+// отрезка, combine объединяет два результата. Границы отрезков зависят
+// только от диапазона и grain, а результаты объединяются попарно в
+// фиксированном порядке, поэтому ответ не зависит от числа потоков
+template <typename T, typename Map, typename Combine>
+T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, Map map,
+                  Combine combine)
+{
+    if (begin >= end)
     {
-        size_t in_features = weight.shape[0];
-        size_t out_features = weight.shape[1];
-        output.shape = {input.shape[0], out_features};
-        output.resize();
-
-        for (size_t i = 0; i < input.shape[0]; ++i)
+        return identity;
+    }
+    const size_t range = end - begin;
+    const size_t chunk =
+        std::max({grain, size_t(1),
+                  (range + kMaxReduceChunks - 1) / kMaxReduceChunks});
+    const size_t count = (range + chunk - 1) / chunk;
+    std::vector<T> parts(count, identity);
+    parallel_for(0, count, 1, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i)
         {
-            for (size_t j = 0; j < out_features; ++j)
-            {
-                output.data[i * out_features + j] = bias.data[j];
-                for (size_t k = 0; k < in_features; ++k)
-                {
-                    output.data[i * out_features + j] +=
-                        input.data[i * in_features + k] *
-                        weight.data[k * out_features + j];
-                }
-            }
+            const size_t b = begin + i * chunk;
+            parts[i] = map(b, std::min(end, b + chunk));
         }
-    }
-
-    void backward(const Tensor &output, Tensor &input) override
+    });
+    for (size_t stride = 1; stride < count; stride *= 2)
     {
-        size_t in_features = weight.shape[0];
-        size_t out_features = weight.shape[1];
-        size_t batch_size = output.shape[0];
-
-        input.resize_grad();
-        weight.resize_grad();
-        bias.resize_grad();
-
-        for (size_t i = 0; i < batch_size; ++i)
+        for (size_t i = 0; i + stride < count; i += 2 * stride)
         {
-            for (size_t j = 0; j < in_features; ++j)
-            {
-                input.grad[i * in_features + j] = 0;
-                for (size_t k = 0; k < out_features; ++k)
-                {
-                    input.grad[i * in_features + j] +=
-                        output.grad[i * out_features + k] *
-                        weight.data[j * out_features + k];
-                    weight.grad[j * out_features + k] +=
-                        output.grad[i * out_features + k] *
-                        input.data[i * in_features + j];
-                }
-            }
+            parts[i] = combine(parts[i], parts[i + stride]);
         }
+    }
+    return parts[0];
+}
 
-        for (size_t i = 0; i < batch_size; ++i)
+// Попарное (древовидное) суммирование count векторов длины width, лежащих
+// подряд в parts. Результат в parts[0..width). Порядок сложений
+// фиксирован, поэтому сумма детерминирована
+inline void tree_reduce(float *parts, size_t count, size_t width)
+{
+    for (size_t stride = 1; stride < count; stride *= 2)
+    {
+        for (size_t i = 0; i + stride < count; i += 2 * stride)
         {
-            for (size_t k = 0; k < out_features; ++k)
+            float *dst = parts + i * width;
+            const float *src = parts + (i + stride) * width;
+            for (size_t j = 0; j < width; ++j)
             {
-                bias.grad[k] += output.grad[i * out_features + k];
+                dst[j] += src[j];
             }
         }
     }
+}
 
-    std::string to_string() const override
+// Очередь без блокировок для одного производителя и одного потребителя.
+// Емкость округляется вверх до степени двойки
+template <typename T> class SpscQueue
+{
+  public:
+    explicit SpscQueue(size_t capacity = 64)
     {
-        std::stringstream ss;
-        ss << "Linear(in_features=" << weight.shape[0]
-           << ", out_features=" << weight.shape[1] << ")";
-        return ss.str();
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        buffer.resize(size);
     }
-};
-
-struct ReLU : Layer
-{
-    std::vector<Tensor *> parameters() override { return {}; }
 
-    void forward(const Tensor &input, Tensor &output) override
+    bool try_push(const T &value)
     {
-        output.shape = input.shape;
-        output.resize();
-        for (size_t i = 0; i < input.data.size(); ++i)
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == buffer.size())
         {
-            output.data[i] = std::max(0.0f, input.data[i]);
+            return false;
         }
+        buffer[tail & (buffer.size() - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
     }
 
-    void backward(const Tensor &output, Tensor &input) override
+    bool try_pop(T &value)
     {
-        input.resize_grad();
-        for (size_t i = 0; i < output.data.size(); ++i)
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
         {
-            input.grad[i] = (output.data[i] > 0) ? output.grad[i] : 0;
+            return false;
         }
+        value = buffer[head & (buffer.size() - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
     }
 
-    std::string to_string() const override { return "ReLU()"; }
-};
-
-struct Sigmoid : Layer
-{
-    std::vector<Tensor *> parameters() override { return {}; }
-
-    void forward(const Tensor &input, Tensor &output) override
+    // Ожидающие версии уступают процессор, пока очередь полна или пуста
+    void push(const T &value)
     {
-        output.shape = input.shape;
-        output.resize();
-        for (size_t i = 0; i < input.data.size(); ++i)
+        while (!try_push(value))
         {
-            output.data[i] = 1.0f / (1.0f + std::exp(-input.data[i]));
+            std::this_thread::yield();
         }
     }
 
-    void backward(const Tensor &output, Tensor &input) override
+    T pop()
     {
-        input.resize_grad();
-        for (size_t i = 0; i < output.data.size(); ++i)
+        T value;
+        while (!try_pop(value))
         {
-            float s = output.data[i];
-            input.grad[i] = output.grad[i] * s *
-                            (1 - s); // Производная Sigmoid: σ(x)*(1-σ(x))
+            std::this_thread::yield();
         }
+        return value;
     }
 
-    std::string to_string() const override { return "Sigmoid()"; }
+  private:
+    std::vector<T> buffer;
+    // Индексы на разных строках кеша, чтобы потоки не мешали друг другу
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
 };
 
-struct Tanh : Layer
+// Данные тензоров выравниваются на 64 байта (строка кеша, регистр AVX-512)
+constexpr size_t kTensorAlignment = 64;
+
+// Буферы от kHugePageSize байт при включенных huge pages выравниваются на
+// 2 МиБ и помечаются madvise(MADV_HUGEPAGE) (только Linux)
+constexpr size_t kHugePageSize = size_t(2) << 20;
+
+inline std::atomic<bool> &huge_pages_ref()
 {
-    std::vector<Tensor *> parameters() override { return {}; }
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
 
-    void forward(const Tensor &input, Tensor &output) override
+inline void set_huge_pages(bool enabled) { huge_pages_ref() = enabled; }
+
+inline bool huge_pages_enabled() { return huge_pages_ref(); }
+
+// Выровненное выделение, освобождается aligned_deallocate
+inline void *aligned_allocate(size_t bytes)
+{
+    size_t alignment = kTensorAlignment;
+    const bool huge = huge_pages_enabled() && bytes >= kHugePageSize;
+    if (huge)
     {
-        output.shape = input.shape;
-        output.resize();
-        for (size_t i = 0; i < input.data.size(); ++i)
-        {
-            output.data[i] = std::tanh(input.data[i]);
-        }
+        alignment = kHugePageSize;
+        bytes = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
     }
+    bytes = (bytes + kTensorAlignment - 1) / kTensorAlignment * kTensorAlignment;
 
-    void backward(const Tensor &output, Tensor &input) override
+#if defined(_WIN32)
+    void *ptr = _aligned_malloc(bytes, alignment);
+    if (!ptr)
     {
-        input.resize_grad();
-        for (size_t i = 0; i < output.data.size(); ++i)
-        {
-            float t = output.data[i];
-            input.grad[i] =
-                output.grad[i] * (1 - t * t); // Производная Tanh: 1 - tanh²(x)
-        }
+        throw std::bad_alloc();
+    }
+#else
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, bytes) != 0)
+    {
+        throw std::bad_alloc();
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge)
+    {
+        madvise(ptr, bytes, MADV_HUGEPAGE);
     }
+#endif
+#endif
+    return ptr;
+}
 
-    std::string to_string() const override { return "Tanh()"; }
+inline void aligned_deallocate(void *ptr)
+{
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Распределитель памяти для данных тензоров
+struct Allocator
+{
+    virtual void *allocate(size_t bytes) = 0;
+    virtual void deallocate(void *ptr, size_t bytes) = 0;
+    virtual ~Allocator() {}
 };
 
-struct Model
+// Каждый запрос идет в системный распределитель
+struct SystemAllocator : Allocator
 {
-    std::vector<Layer *> layers;
-    std::vector<Tensor> activations;
+    void *allocate(size_t bytes) override { return aligned_allocate(bytes); }
+    void deallocate(void *ptr, size_t) override { aligned_deallocate(ptr); }
+};
 
-    void add_layer(Layer *layer) { layers.push_back(layer); }
+// Кеширующий распределитель: размеры округляются до классов (четыре
+// класса на каждую степень двойки, потери не больше 25%), освобожденные
+// блоки попадают в списки свободных блоков потока и переиспользуются.
+// После прогрева шаг обучения не обращается к системному распределителю
+class CachingAllocator : public Allocator
+{
+  public:
+    static constexpr size_t kMinBytes = 64;
+    static constexpr size_t kMaxCachedBytes = size_t(1) << 30;
+    static constexpr size_t kNumClasses = 1 + (30 - 6) * 4;
 
-    void forward(const Tensor &input, Tensor &output)
+    struct Stats
     {
-        activations.resize(layers.size() - 1);
+        size_t hits = 0;         // запросы, обслуженные из кеша
+        size_t misses = 0;       // запросы к системному распределителю
+        size_t bytes_cached = 0; // байты в списках свободных блоков
+    };
 
-        const Tensor *current = &input;
-        for (size_t i = 0; i < layers.size(); ++i)
+    // Номер класса для запроса в bytes байт (bytes <= kMaxCachedBytes)
+    static size_t size_class(size_t bytes)
+    {
+        if (bytes <= kMinBytes)
         {
-            Tensor *next = (i == layers.size() - 1) ? &output : &activations[i];
-            layers[i]->forward(*current, *next);
-            current = next;
+            return 0;
         }
+        size_t k = 0;
+        while ((size_t(2) << k) < bytes)
+        {
+            ++k;
+        }
+        // 2^k < bytes <= 2^(k+1), классы 5/4, 6/4, 7/4, 8/4 от 2^k
+        const size_t step = size_t(1) << (k - 2);
+        const size_t m = (bytes + step - 1) / step;
+        return 1 + (k - 6) * 4 + (m - 5);
     }
 
-    void backward(const Tensor &output, Tensor &input)
+    static size_t class_bytes(size_t cls)
     {
-        if (activations.size() != layers.size() - 1)
+        if (cls == 0)
         {
-            throw std::runtime_error(
-                "Forward pass must be called before backward pass");
+            return kMinBytes;
         }
+        const size_t k = 6 + (cls - 1) / 4;
+        const size_t m = 5 + (cls - 1) % 4;
+        return m << (k - 2);
+    }
 
-        const Tensor *current = &output;
-        for (int i = layers.size() - 1; i >= 0; --i)
+    void *allocate(size_t bytes) override
+    {
+        if (bytes > kMaxCachedBytes)
         {
-            Tensor *prev = (i > 0) ? &activations[i - 1] : &input;
-            layers[i]->backward(*current, *prev);
-            current = prev;
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return aligned_allocate(bytes);
         }
+        const size_t cls = size_class(bytes);
+        ThreadCache *cache = thread_cache();
+        if (cache && !cache->lists[cls].empty())
+        {
+            void *ptr = cache->lists[cls].back();
+            cache->lists[cls].pop_back();
+            hits.fetch_add(1, std::memory_order_relaxed);
+            bytes_cached.fetch_sub(class_bytes(cls), std::memory_order_relaxed);
+            return ptr;
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return aligned_allocate(class_bytes(cls));
     }
 
-    std::vector<Tensor *> parameters()
+    void deallocate(void *ptr, size_t bytes) override
     {
-        std::vector<Tensor *> params;
-        for (Layer *layer : layers)
+        ThreadCache *cache = thread_cache();
+        if (bytes > kMaxCachedBytes || !cache)
         {
-            auto layer_params = layer->parameters();
-            params.insert(params.end(), layer_params.begin(),
-                          layer_params.end());
+            aligned_deallocate(ptr);
+            return;
         }
-        return params;
+        const size_t cls = size_class(bytes);
+        cache->lists[cls].push_back(ptr);
+        bytes_cached.fetch_add(class_bytes(cls), std::memory_order_relaxed);
     }
 
-    std::string to_string() const
+    Stats stats() const
     {
-        std::stringstream ss;
-        for (Layer *layer : layers)
-        {
-            ss << layer->to_string() << "\n";
-        }
-        return ss.str();
+        Stats result;
+        result.hits = hits.load(std::memory_order_relaxed);
+        result.misses = misses.load(std::memory_order_relaxed);
+        result.bytes_cached = bytes_cached.load(std::memory_order_relaxed);
+        return result;
     }
 
-    ~Model()
+    void reset_stats()
     {
-        for (Layer *layer : layers)
+        hits = 0;
+        misses = 0;
+    }
+
+    // Возвращает системе блоки из кеша текущего потока
+    void release_cached()
+    {
+        if (ThreadCache *cache = thread_cache())
         {
-            delete layer;
+            cache->release();
         }
     }
-};
 
-static Tensor softmax_for_mha(const Tensor &attention_score)
-{
-    // Применяем softmax по последнему измерению
-    Tensor attention;
-    attention.shape = attention_score.shape;
-    attention.resize();
+    // Общий экземпляр, см. set_allocator()
+    static CachingAllocator &instance()
+    {
+        static CachingAllocator allocator;
+        return allocator;
+    }
 
-    const size_t last_dim = attention.shape.back();
-    const size_t num_elements = attention.data.size();
+  private:
+    CachingAllocator() = default;
 
-    for (size_t i = 0; i < num_elements; i += last_dim)
+    struct ThreadCache
     {
-        // Находим максимум для численной стабильности
-        float max_val = attention_score.data[i];
-        for (size_t j = 1; j < last_dim; ++j)
+        std::vector<void *> lists[kNumClasses];
+
+        void release()
+        {
+            for (size_t cls = 0; cls < kNumClasses; ++cls)
+            {
+                for (void *ptr : lists[cls])
+                {
+                    aligned_deallocate(ptr);
+                }
+                instance().bytes_cached.fetch_sub(
+                    lists[cls].size() * class_bytes(cls),
+                    std::memory_order_relaxed);
+                lists[cls].clear();
+            }
+        }
+
+        ~ThreadCache()
         {
-            max_val = std::max(max_val, attention_score.data[i + j]);
+            release();
+            destroyed() = true;
         }
 
-        // Вычисляем экспоненты и их сумму
-        float sum_exp = 0.0f;
-        for (size_t j = 0; j < last_dim; ++j)
+        static bool &destroyed()
         {
-            attention.data[i + j] = std::exp(attention_score.data[i + j] - max_val);
-            sum_exp += attention.data[i + j];
+            thread_local bool flag = false;
+            return flag;
         }
+    };
 
-        // Нормализуем для получения вероятностей
-        for (size_t j = 0; j < last_dim; ++j)
+    // nullptr, если кеш потока уже разрушен (завершение потока)
+    static ThreadCache *thread_cache()
+    {
+        if (ThreadCache::destroyed())
         {
-            attention.data[i + j] /= sum_exp;
+            return nullptr;
         }
+        thread_local ThreadCache cache;
+        return &cache;
     }
-    return attention;
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    std::atomic<size_t> bytes_cached{0};
+};
+
+inline SystemAllocator &system_allocator()
+{
+    static SystemAllocator allocator;
+    return allocator;
 }
 
-struct ScaledDotProductAttention
+inline std::atomic<Allocator *> &allocator_ref()
 {
-    Tensor saved_q, saved_k, saved_v;
-    Tensor attn_scores, attention;
-    float scale = 0.0f;
+    static std::atomic<Allocator *> allocator{&system_allocator()};
+    return allocator;
+}
 
-    void forward(const Tensor &q, const Tensor &k, const Tensor &v, Tensor &values)
-    {
-        if (q.shape.size() != k.shape.size() || q.shape.size() != v.shape.size())
-        {
-            throw std::runtime_error("All input tensors must have the same number of dimensions");
-        }
-        saved_q = q.copy();
-        saved_k = k.copy();
-        saved_v = v.copy();
+// Распределитель для новых буферов тензоров. Уже выделенные буферы
+// освобождаются тем распределителем, которым были выделены
+inline Allocator *get_allocator() { return allocator_ref().load(); }
 
-        const size_t d_k = k.shape.back();
+inline void set_allocator(Allocator *allocator)
+{
+    allocator_ref().store(allocator ? allocator : &system_allocator());
+}
 
-        attn_scores.shape = q.shape;
-        attn_scores.shape.back() = k.shape[k.shape.size() - 2];
-        attn_scores.resize();
+// Непрерывный буфер элементов с интерфейсом std::vector. Может владеть
+// памятью или быть представлением (view) чужого буфера, например арены
+// Model. Представление сохраняет привязку, пока не меняется размер:
+// копирование и assign того же размера пишут элементы в буфер, изменение
+// размера переводит Storage на собственную память. Перемещение всегда
+// забирает буфер источника (или его привязку), rebind привязывает к
+// другому буферу. Собственная память выделяется текущим распределителем
+// и выровнена на kTensorAlignment
+template <typename T>
+class Storage
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Storage supports trivially copyable types only");
 
-        attn_scores = matmul(q, k.transpose(k.shape.size() - 2, k.shape.size() - 1));
+  public:
+    using value_type = T;
+    using size_type = size_t;
+    using reference = T &;
+    using const_reference = const T &;
+    using iterator = T *;
+    using const_iterator = const T *;
 
-        scale = 1.0f / std::sqrt(static_cast<float>(d_k));
-        for (size_t i = 0; i < attn_scores.data.size(); ++i)
+    Storage() = default;
+
+    explicit Storage(size_t n, const T &value = T()) { assign(n, value); }
+
+    Storage(std::initializer_list<T> init) { assign(init.begin(), init.end()); }
+
+    Storage(const std::vector<T> &vec) { assign(vec.begin(), vec.end()); }
+
+    Storage(const Storage &other) { assign(other.begin(), other.end()); }
+
+    Storage(Storage &&other) noexcept { steal(other); }
+
+    ~Storage() { release(); }
+
+    Storage &operator=(const Storage &other)
+    {
+        if (this != &other)
         {
-            attn_scores.data[i] *= scale;
+            assign(other.begin(), other.end());
+        }
+        return *this;
+    }
+
+    Storage &operator=(Storage &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            steal(other);
         }
+        return *this;
+    }
 
-        attention = softmax_for_mha(attn_scores);
+    Storage &operator=(std::initializer_list<T> init)
+    {
+        assign(init.begin(), init.end());
+        return *this;
+    }
 
-        values = matmul(attention, v);
+    Storage &operator=(const std::vector<T> &vec)
+    {
+        assign(vec.begin(), vec.end());
+        return *this;
     }
 
-    void backward(const Tensor &grad_output, Tensor &dq, Tensor &dk, Tensor &dv)
+    // Невладеющее представление n элементов по адресу ptr
+    static Storage view(T *ptr, size_t n)
     {
+        Storage result;
+        result.rebind(ptr, n);
+        return result;
+    }
 
-        // Инициализация градиентов
-        dq.resize_grad();
-        dk.resize_grad();
-        dv.resize_grad();
+    // Делает Storage представлением n элементов по адресу ptr, освобождая
+    // собственную память
+    void rebind(T *ptr, size_t n)
+    {
+        release();
+        ptr_ = ptr;
+        size_ = n;
+        capacity_ = n;
+        owned_ = false;
+    }
 
-        // Вычисление градиента для dv (dV = Attention^T * grad_output)
-        Tensor attention_T = attention.transpose(attention.shape.size() - 2, attention.shape.size() - 1);
-        attention_T.resize_grad();
-        dv = matmul(attention_T, grad_output);
-        dv.resize_grad();
-        for (size_t i = 0; i < dv.grad.size(); ++i)
+    bool is_view() const { return !owned_; }
+
+    template <typename It> void assign(It first, It last)
+    {
+        const size_t n = static_cast<size_t>(std::distance(first, last));
+        if (!(is_view() && n == size_))
         {
-            dv.grad[i] += grad_output.grad[i]; // Накопление градиентов
+            reallocate(n);
         }
+        std::copy(first, last, ptr_);
+        size_ = n;
+    }
 
-        // Вычисление градиента для attention (dAttention = grad_output * V^T)
-        Tensor v_T = saved_v.transpose(saved_v.shape.size() - 2, saved_v.shape.size() - 1);
-        v_T.resize_grad();
+    void assign(size_t n, const T &value)
+    {
+        if (!(is_view() && n == size_))
+        {
+            reallocate(n);
+        }
+        first_touch_fill(ptr_, n, value);
+        size_ = n;
+    }
+
+    void resize(size_t n, const T &value = T())
+    {
+        const size_t old_size = size_;
+        if (n == old_size)
+        {
+            return;
+        }
+        if (n > capacity_ || is_view())
+        {
+            Storage grown;
+            grown.reallocate(n);
+            std::copy(ptr_, ptr_ + std::min(n, old_size), grown.ptr_);
+            release();
+            steal(grown);
+        }
+        if (n > old_size)
+        {
+            first_touch_fill(ptr_ + old_size, n - old_size, value);
+        }
+        size_ = n;
+    }
+
+    void clear()
+    {
+        if (is_view())
+        {
+            release();
+        }
+        size_ = 0;
+    }
+
+    void shrink_to_fit()
+    {
+        if (!is_view() && capacity_ > size_)
+        {
+            Storage fitted;
+            fitted.assign(begin(), end());
+            release();
+            steal(fitted);
+        }
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+
+    T *data() { return ptr_; }
+    const T *data() const { return ptr_; }
+
+    T &operator[](size_t i) { return ptr_[i]; }
+    const T &operator[](size_t i) const { return ptr_[i]; }
+
+    T &front() { return ptr_[0]; }
+    const T &front() const { return ptr_[0]; }
+    T &back() { return ptr_[size_ - 1]; }
+    const T &back() const { return ptr_[size_ - 1]; }
+
+    iterator begin() { return ptr_; }
+    iterator end() { return ptr_ + size_; }
+    const_iterator begin() const { return ptr_; }
+    const_iterator end() const { return ptr_ + size_; }
+
+    // Совместимость с кодом, ожидающим std::vector
+    operator std::vector<T>() const { return std::vector<T>(begin(), end()); }
+
+    friend bool operator==(const Storage &a, const Storage &b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator!=(const Storage &a, const Storage &b)
+    {
+        return !(a == b);
+    }
+    friend bool operator==(const Storage &a, const std::vector<T> &b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator==(const std::vector<T> &a, const Storage &b)
+    {
+        return b == a;
+    }
+    friend bool operator!=(const Storage &a, const std::vector<T> &b)
+    {
+        return !(a == b);
+    }
+    friend bool operator!=(const std::vector<T> &a, const Storage &b)
+    {
+        return !(b == a);
+    }
+
+  private:
+    // Собственный буфер не меньше n элементов (содержимое не сохраняется)
+    void reallocate(size_t n)
+    {
+        if (!is_view() && n <= capacity_)
+        {
+            return;
+        }
+        release();
+        if (n)
+        {
+            allocator_ = get_allocator();
+            ptr_ = static_cast<T *>(allocator_->allocate(n * sizeof(T)));
+        }
+        capacity_ = n;
+    }
+
+    void release()
+    {
+        if (owned_ && ptr_)
+        {
+            allocator_->deallocate(ptr_, capacity_ * sizeof(T));
+        }
+        ptr_ = nullptr;
+        allocator_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+        owned_ = true;
+    }
+
+    void steal(Storage &other)
+    {
+        ptr_ = other.ptr_;
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        owned_ = other.owned_;
+        allocator_ = other.allocator_;
+        other.ptr_ = nullptr;
+        other.allocator_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+        other.owned_ = true;
+    }
+
+    T *ptr_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    bool owned_ = true;
+    Allocator *allocator_ = nullptr;
+};
+
+// Точность хранения весов и активаций. Вычисления и накопление всегда
+// выполняются во float, в bf16/fp16 только хранятся данные
+enum class Precision
+{
+    Float32,
+    BFloat16,
+    Float16
+};
+
+inline const char *precision_name(Precision precision)
+{
+    switch (precision)
+    {
+    case Precision::BFloat16:
+        return "bf16";
+    case Precision::Float16:
+        return "fp16";
+    default:
+        return "fp32";
+    }
+}
+
+inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float bits_to_float(uint32_t bits)
+{
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Округление к ближайшему четному, NaN остается NaN
+inline uint16_t float_to_bf16(float value)
+{
+    uint32_t bits = float_bits(value);
+    if ((bits & 0x7fffffffu) > 0x7f800000u)
+    {
+        return static_cast<uint16_t>((bits >> 16) | 0x40u);
+    }
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bf16_to_float(uint16_t value)
+{
+    return bits_to_float(static_cast<uint32_t>(value) << 16);
+}
+
+// Округление к ближайшему четному с денормалами, переполнение дает inf
+inline uint16_t float_to_fp16(float value)
+{
+    const uint32_t f32_infinity = 255u << 23;
+    const uint32_t f16_overflow = (127u + 16u) << 23;
+    const uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t bits = float_bits(value);
+    const uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint32_t result;
+    if (bits >= f16_overflow)
+    {
+        result = bits > f32_infinity ? 0x7e00u : 0x7c00u;
+    }
+    else if (bits < (113u << 23))
+    {
+        // Денормал: сложение с magic выполняет сдвиг с округлением
+        result = float_bits(bits_to_float(bits) + bits_to_float(denorm_magic)) -
+                 denorm_magic;
+    }
+    else
+    {
+        const uint32_t mantissa_odd = (bits >> 13) & 1u;
+        bits += ((15u - 127u) << 23) + 0xfffu + mantissa_odd;
+        result = bits >> 13;
+    }
+    return static_cast<uint16_t>(result | (sign >> 16));
+}
+
+inline float fp16_to_float(uint16_t value)
+{
+    const uint32_t shifted_exponent = 0x7c00u << 13;
+    uint32_t bits = (static_cast<uint32_t>(value) & 0x7fffu) << 13;
+    const uint32_t exponent = bits & shifted_exponent;
+    bits += (127u - 15u) << 23;
+    if (exponent == shifted_exponent)
+    {
+        bits += (128u - 16u) << 23; // inf / NaN
+    }
+    else if (exponent == 0)
+    {
+        bits += 1u << 23; // денормал
+        bits = float_bits(bits_to_float(bits) - bits_to_float(113u << 23));
+    }
+    return bits_to_float(bits | (static_cast<uint32_t>(value) & 0x8000u) << 16);
+}
+
+#if defined(TTIE_X86_KERNELS)
+// Ядра преобразования для F16C и AVX512-BF16. Собираются без флагов
+// -m..., выбираются по cpuid во время выполнения
+
+__attribute__((target("avx,f16c"))) inline void
+float_to_fp16_f16c(const float *src, uint16_t *dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                             _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), half);
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = float_to_fp16(src[i]);
+    }
+}
+
+__attribute__((target("avx,f16c"))) inline void
+fp16_to_float_f16c(const uint16_t *src, float *dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i half =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(half));
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = fp16_to_float(src[i]);
+    }
+}
+
+__attribute__((target("avx512f,avx512bf16"))) inline void
+float_to_bf16_avx512(const float *src, uint16_t *dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256bh half = _mm512_cvtneps_pbh(_mm512_loadu_ps(src + i));
+        std::memcpy(dst + i, &half, sizeof(half));
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+inline bool cpu_has_f16c()
+{
+    static const bool supported =
+        __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+inline bool cpu_has_avx512_bf16()
+{
+    static const bool supported = __builtin_cpu_supports("avx512f") &&
+                                  __builtin_cpu_supports("avx512bf16");
+    return supported;
+}
+#endif
+
+// float -> bf16/fp16 для n элементов
+inline void convert_to_half(const float *src, uint16_t *dst, size_t n,
+                            Precision precision)
+{
+    if (precision == Precision::Float16)
+    {
+#if defined(TTIE_X86_KERNELS)
+        if (cpu_has_f16c())
+        {
+            float_to_fp16_f16c(src, dst, n);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = float_to_fp16(src[i]);
+        }
+        return;
+    }
+#if defined(TTIE_X86_KERNELS)
+    if (cpu_has_avx512_bf16())
+    {
+        float_to_bf16_avx512(src, dst, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i)
+    {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+// bf16/fp16 -> float для n элементов. bf16 -> float - сдвиг, который
+// компилятор векторизует сам
+inline void convert_from_half(const uint16_t *src, float *dst, size_t n,
+                              Precision precision)
+{
+    if (precision == Precision::Float16)
+    {
+#if defined(TTIE_X86_KERNELS)
+        if (cpu_has_f16c())
+        {
+            fp16_to_float_f16c(src, dst, n);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = fp16_to_float(src[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+// Значения bf16 и fp16 для типизированных тензоров. Арифметики нет:
+// значения преобразуются во float
+struct bfloat16
+{
+    uint16_t bits = 0;
+
+    bfloat16() = default;
+    explicit bfloat16(float value) : bits(float_to_bf16(value)) {}
+    explicit operator float() const { return bf16_to_float(bits); }
+};
+
+struct float16
+{
+    uint16_t bits = 0;
+
+    float16() = default;
+    explicit float16(float value) : bits(float_to_fp16(value)) {}
+    explicit operator float() const { return fp16_to_float(bits); }
+};
+
+// Тип элементов тензора
+enum class DType
+{
+    Float32,
+    Float64,
+    BFloat16,
+    Float16,
+    Int8,
+    Int32
+};
+
+template <typename T> struct DTypeOf;
+template <> struct DTypeOf<float>
+{
+    static constexpr DType value = DType::Float32;
+};
+template <> struct DTypeOf<double>
+{
+    static constexpr DType value = DType::Float64;
+};
+template <> struct DTypeOf<bfloat16>
+{
+    static constexpr DType value = DType::BFloat16;
+};
+template <> struct DTypeOf<float16>
+{
+    static constexpr DType value = DType::Float16;
+};
+template <> struct DTypeOf<int8_t>
+{
+    static constexpr DType value = DType::Int8;
+};
+template <> struct DTypeOf<int32_t>
+{
+    static constexpr DType value = DType::Int32;
+};
+
+// Вызывает fn(T()) для C++-типа элементов dtype
+template <typename Fn> void dispatch_dtype(DType dtype, Fn &&fn)
+{
+    switch (dtype)
+    {
+    case DType::Float32:
+        fn(float());
+        break;
+    case DType::Float64:
+        fn(double());
+        break;
+    case DType::BFloat16:
+        fn(bfloat16());
+        break;
+    case DType::Float16:
+        fn(float16());
+        break;
+    case DType::Int8:
+        fn(int8_t());
+        break;
+    case DType::Int32:
+        fn(int32_t());
+        break;
+    }
+}
+
+inline size_t dtype_size(DType dtype)
+{
+    size_t size = 0;
+    dispatch_dtype(dtype, [&](auto tag) { size = sizeof(tag); });
+    return size;
+}
+
+inline const char *dtype_name(DType dtype)
+{
+    switch (dtype)
+    {
+    case DType::Float64:
+        return "float64";
+    case DType::BFloat16:
+        return "bfloat16";
+    case DType::Float16:
+        return "float16";
+    case DType::Int8:
+        return "int8";
+    case DType::Int32:
+        return "int32";
+    default:
+        return "float32";
+    }
+}
+
+template <typename T> struct is_half_type
+    : std::integral_constant<bool, std::is_same<T, bfloat16>::value ||
+                                       std::is_same<T, float16>::value>
+{
+};
+
+// Преобразование элемента. В целые типы - с округлением к ближайшему и
+// насыщением, NaN дает 0
+template <typename To, typename From> To dtype_cast(From value)
+{
+    if constexpr (std::is_same<To, From>::value)
+    {
+        return value;
+    }
+    else if constexpr (is_half_type<From>::value)
+    {
+        return dtype_cast<To>(static_cast<float>(value));
+    }
+    else if constexpr (is_half_type<To>::value)
+    {
+        return To(static_cast<float>(value));
+    }
+    else if constexpr (std::is_integral<To>::value &&
+                       std::is_floating_point<From>::value)
+    {
+        if (std::isnan(value))
+        {
+            return To(0);
+        }
+        const double x = std::nearbyint(static_cast<double>(value));
+        return static_cast<To>(
+            std::min<double>(std::max<double>(x, std::numeric_limits<To>::min()),
+                             std::numeric_limits<To>::max()));
+    }
+    else if constexpr (std::is_integral<To>::value && sizeof(To) < sizeof(From))
+    {
+        return static_cast<To>(std::min<From>(
+            std::max<From>(value, std::numeric_limits<To>::min()),
+            std::numeric_limits<To>::max()));
+    }
+    else
+    {
+        return static_cast<To>(value);
+    }
+}
+
+// Порядок хранения данных. shape всегда логический ([N, C, H, W] или
+// [N, C, D, H, W]), ChannelsLast означает хранение NHWC / NDHWC
+enum class MemoryFormat
+{
+    Contiguous,
+    ChannelsLast
+};
+
+// Режим вычисления градиентов (для текущего потока). Без градиентов
+// слои и Model не сохраняют состояние для backward
+inline bool &grad_enabled_ref()
+{
+    thread_local bool enabled = true;
+    return enabled;
+}
+
+inline bool is_grad_enabled() { return grad_enabled_ref(); }
+
+inline void set_grad_enabled(bool enabled) { grad_enabled_ref() = enabled; }
+
+// Отключает градиенты в своей области видимости:
+//     {
+//         NoGradGuard no_grad;
+//         model.forward(input, output);
+//     }
+struct NoGradGuard
+{
+    bool previous;
+
+    NoGradGuard() : previous(is_grad_enabled()) { set_grad_enabled(false); }
+    ~NoGradGuard() { set_grad_enabled(previous); }
+
+    NoGradGuard(const NoGradGuard &) = delete;
+    NoGradGuard &operator=(const NoGradGuard &) = delete;
+};
+
+// Задает режим градиентов в своей области видимости (например, в потоке
+// пула, выполняющем работу вызывающего потока)
+struct GradModeGuard
+{
+    bool previous;
+
+    explicit GradModeGuard(bool enabled) : previous(is_grad_enabled())
+    {
+        set_grad_enabled(enabled);
+    }
+    ~GradModeGuard() { set_grad_enabled(previous); }
+
+    GradModeGuard(const GradModeGuard &) = delete;
+    GradModeGuard &operator=(const GradModeGuard &) = delete;
+};
+
+struct Tensor
+{
+    std::vector<size_t> shape;
+    MemoryFormat memory_format = MemoryFormat::Contiguous;
+
+    // Данные тензоров float. Тензоры других типов (dtype) хранят данные в
+    // bytes, доступ к ним - через data_as<T>()
+    DType dtype = DType::Float32;
+    Storage<float> data;
+    Storage<uint8_t> bytes;
+    // Градиент выделяется лениво (resize_grad) и только для тензоров с
+    // requires_grad; view() и copy() его не копируют
+    Storage<float> grad;
+    bool requires_grad = false;
+
+    bool validate_shape() const
+    {
+        if (shape.empty())
+        {
+            return false;
+        }
+
+        for (size_t dim : shape)
+        {
+            if (dim == 0)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+    size_t size() const
+    {
+        if (!validate_shape())
+        {
+            throw std::invalid_argument("Invalid tensor shape");
+        }
+        size_t total = 1;
+        for (size_t dim : shape)
+        {
+            total *= dim;
+        }
+        return total;
+    }
+
+    void resize()
+    {
+        if (dtype == DType::Float32)
+        {
+            data.resize(size());
+        }
+        else
+        {
+            bytes.resize(size() * dtype_size(dtype));
+        }
+    }
+
+    // Тензор формы shape с элементами типа dtype
+    static Tensor empty(const std::vector<size_t> &shape, DType dtype)
+    {
+        Tensor result;
+        result.shape = shape;
+        result.dtype = dtype;
+        result.resize();
+        return result;
+    }
+
+    template <typename T> T *data_as()
+    {
+        return const_cast<T *>(
+            static_cast<const Tensor *>(this)->template data_as<T>());
+    }
+
+    template <typename T> const T *data_as() const
+    {
+        if (DTypeOf<T>::value != dtype)
+        {
+            throw std::invalid_argument(std::string("Tensor has dtype ") +
+                                        dtype_name(dtype) + ", not " +
+                                        dtype_name(DTypeOf<T>::value));
+        }
+        if constexpr (std::is_same<T, float>::value)
+        {
+            return data.data();
+        }
+        else
+        {
+            return reinterpret_cast<const T *>(bytes.data());
+        }
+    }
+
+    // Копия с элементами типа target (градиент не копируется)
+    Tensor to(DType target) const
+    {
+        if (target == dtype)
+        {
+            return copy();
+        }
+        Tensor result = empty(shape, target);
+        result.memory_format = memory_format;
+        const size_t n = size();
+        // float <-> bf16/fp16 - векторными ядрами convert_*_half
+        auto half_precision = [](DType half) {
+            return half == DType::BFloat16 ? Precision::BFloat16
+                                           : Precision::Float16;
+        };
+        if (dtype == DType::Float32 &&
+            (target == DType::BFloat16 || target == DType::Float16))
+        {
+            convert_to_half(data.data(),
+                            reinterpret_cast<uint16_t *>(result.bytes.data()), n,
+                            half_precision(target));
+            return result;
+        }
+        if (target == DType::Float32 &&
+            (dtype == DType::BFloat16 || dtype == DType::Float16))
+        {
+            convert_from_half(reinterpret_cast<const uint16_t *>(bytes.data()),
+                              result.data.data(), n, half_precision(dtype));
+            return result;
+        }
+        dispatch_dtype(dtype, [&](auto src_tag) {
+            using Src = decltype(src_tag);
+            const Src *src = data_as<Src>();
+            dispatch_dtype(target, [&](auto dst_tag) {
+                using Dst = decltype(dst_tag);
+                Dst *dst = result.data_as<Dst>();
+                parallel_for(0, n, parallel_grain(2), [&](size_t first, size_t last) {
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        dst[i] = dtype_cast<Dst>(src[i]);
+                    }
+                });
+            });
+        });
+        return result;
+    }
+
+    void resize_grad() { grad.resize(size()); }
+
+    void zero_grad() { std::fill(grad.begin(), grad.end(), 0.0f); }
+
+    Tensor transpose(size_t dim1, size_t dim2) const
+    {
+        if (dim1 >= shape.size() || dim2 >= shape.size())
+        {
+            throw std::invalid_argument("Invalid dimension index");
+        }
+        if (memory_format != MemoryFormat::Contiguous)
+        {
+            throw std::invalid_argument(
+                "transpose requires contiguous memory format");
+        }
+        if (dtype != DType::Float32)
+        {
+            throw std::invalid_argument("transpose supports float32 tensors only");
+        }
+
+        if (dim1 == dim2)
+        {
+            return *this;
+        }
+
+        // Создаем новую перестановку осей
+        std::vector<size_t> new_order(shape.size());
+        std::iota(new_order.begin(), new_order.end(), 0); // заполняем 0, 1, 2, ...
+
+        // Меняем местами выбранные оси
+        std::swap(new_order[dim1], new_order[dim2]);
+
+        // Новые размерности после транспонирования
+        std::vector<size_t> new_shape(shape.size());
+        for (size_t i = 0; i < shape.size(); ++i)
+        {
+            new_shape[i] = shape[new_order[i]];
+        }
+
+        // Вычисляем шаги для исходных размерностей
+        std::vector<size_t> strides(shape.size());
+        strides.back() = 1;
+        for (int i = shape.size() - 2; i >= 0; --i)
+        {
+            strides[i] = strides[i + 1] * shape[i + 1];
+        }
+
+        // Вычисляем шаги для новых размерностей
+        std::vector<size_t> new_strides(new_shape.size());
+        new_strides.back() = 1;
+        for (int i = new_shape.size() - 2; i >= 0; --i)
+        {
+            new_strides[i] = new_strides[i + 1] * new_shape[i + 1];
+        }
+
+        // Создаем результирующий тензор
+        Tensor result;
+        result.shape = new_shape;
+        result.resize();
+
+        // Вспомогательный вектор для индексации
+        std::vector<size_t> indices(shape.size(), 0);
+
+        // Перебираем все элементы и переставляем их
+        for (size_t flat_idx = 0; flat_idx < result.size(); ++flat_idx)
+        {
+            // Вычисляем многомерный индекс в исходном порядке
+            size_t remaining = flat_idx;
+            for (size_t i = 0; i < shape.size(); ++i)
+            {
+                indices[i] = remaining / strides[i];
+                remaining %= strides[i];
+            }
+
+            // Вычисляем новый плоский индекс
+            size_t new_flat_idx = 0;
+            for (size_t i = 0; i < new_order.size(); ++i)
+            {
+                new_flat_idx += indices[new_order[i]] * new_strides[i];
+            }
+
+            result.data[new_flat_idx] = data[flat_idx];
+        }
+        
+        return result;
+    }
+
+    Tensor view(const std::vector<size_t>& new_shape) const
+    {
+        if (!validate_shape())
+        {
+            throw std::invalid_argument("Invalid tensor shape");
+        }
+        if (memory_format != MemoryFormat::Contiguous)
+        {
+            throw std::invalid_argument(
+                "view requires contiguous memory format");
+        }
+
+        // Проверяем, что новая форма совместима по размеру
+        size_t new_size = 1;
+        for (size_t dim : new_shape)
+        {
+            new_size *= dim;
+        }
+
+        if (new_size != size())
+        {
+            throw std::invalid_argument("Total size of new shape must match original tensor size");
+        }
+
+        // Создаем новый тензор с новой формой
+        Tensor result;
+        result.shape = new_shape;
+        result.dtype = dtype;
+        result.data = data;
+        result.bytes = bytes;
+        result.requires_grad = requires_grad;
+
+        return result;
+    }
+
+    Tensor copy() const
+    {
+        Tensor result;
+        result.shape = shape;
+        result.memory_format = memory_format;
+        result.dtype = dtype;
+        result.data = data;
+        result.bytes = bytes;
+        result.requires_grad = requires_grad;
+        return result;
+    }
+
+    // Переставляет данные (и градиенты) в заданный порядок хранения
+    Tensor to_memory_format(MemoryFormat format) const
+    {
+        if (format == memory_format)
+        {
+            return copy();
+        }
+        if (shape.size() < 3)
+        {
+            throw std::invalid_argument(
+                "Channels-last format requires at least 3 dimensions");
+        }
+        if (dtype != DType::Float32)
+        {
+            throw std::invalid_argument(
+                "to_memory_format supports float32 tensors only");
+        }
+
+        const size_t N = shape[0];
+        const size_t C = shape[1];
+        const size_t S = size() / (N * C);
+        const bool to_channels_last = format == MemoryFormat::ChannelsLast;
+
+        auto permute = [&](const Storage<float> &src, Storage<float> &dst) {
+            dst.resize(src.size());
+            for (size_t n = 0; n < N; ++n)
+            {
+                for (size_t c = 0; c < C; ++c)
+                {
+                    for (size_t s = 0; s < S; ++s)
+                    {
+                        size_t nchw = (n * C + c) * S + s;
+                        size_t nhwc = (n * S + s) * C + c;
+                        if (to_channels_last)
+                        {
+                            dst[nhwc] = src[nchw];
+                        }
+                        else
+                        {
+                            dst[nchw] = src[nhwc];
+                        }
+                    }
+                }
+            }
+        };
+
+        Tensor result;
+        result.shape = shape;
+        result.memory_format = format;
+        result.requires_grad = requires_grad;
+        if (!data.empty())
+        {
+            permute(data, result.data);
+        }
+        if (!grad.empty())
+        {
+            permute(grad, result.grad);
+        }
+        return result;
+    }
+
+    Tensor contiguous() const
+    {
+        return to_memory_format(MemoryFormat::Contiguous);
+    }
+
+
+    friend std::ostream &operator<<(std::ostream &os, const Tensor &t)
+    {
+        os << "Tensor@" << &t;
+
+        if (t.shape.empty())
+        {
+            os << "(not initialized)";
+            return os;
+        }
+
+        os << "(shape=" << vector_to_string(t.shape);
+
+        if (t.dtype != DType::Float32)
+        {
+            os << ", dtype=" << dtype_name(t.dtype);
+            if (!t.bytes.empty())
+            {
+                os << ", data=" << vector_to_string(t.to(DType::Float32).data);
+            }
+        }
+        else if (!t.data.empty())
+        {
+            os << ", data=" << vector_to_string(t.data);
+        }
+        else
+        {
+            os << ", data=[no data]";
+        }
+
+        if (!t.grad.empty())
+        {
+            os << ", grad=" << vector_to_string(t.grad);
+        }
+
+        os << ")";
+        return os;
+    }
+};
+
+// Ядро matmul для типизированных тензоров: элементы приводятся к Acc,
+// накопление в Acc, результат приводится к Out. Строки всех матриц
+// делятся между потоками
+template <typename A, typename B, typename Acc, typename Out>
+void matmul_kernel(const A *a, const B *b, Out *out, size_t matrices,
+                   size_t rows, size_t inner, size_t cols)
+{
+    parallel_for(0, matrices * rows, parallel_grain(inner * cols),
+                 [&](size_t first, size_t last) {
+        std::vector<Acc> acc(cols);
+        for (size_t row = first; row < last; ++row)
+        {
+            const A *a_row = a + row * inner;
+            const B *b_matrix = b + (row / rows) * inner * cols;
+            std::fill(acc.begin(), acc.end(), Acc(0));
+            for (size_t k = 0; k < inner; ++k)
+            {
+                const Acc a_value = dtype_cast<Acc>(a_row[k]);
+                const B *b_row = b_matrix + k * cols;
+                for (size_t j = 0; j < cols; ++j)
+                {
+                    acc[j] += a_value * dtype_cast<Acc>(b_row[j]);
+                }
+            }
+            for (size_t j = 0; j < cols; ++j)
+            {
+                out[row * cols + j] = dtype_cast<Out>(acc[j]);
+            }
+        }
+    });
+}
+
+// Сочетания типов matmul:
+//   int8 x int8 -> int32 (накопление в int32),
+//   float64 x float64 -> float64,
+//   {float32, bf16, fp16} x {float32, bf16, fp16} -> float32
+inline Tensor matmul_typed(const Tensor &a, const Tensor &b,
+                           const std::vector<size_t> &result_shape)
+{
+    const size_t rows = a.shape[a.shape.size() - 2];
+    const size_t inner = a.shape.back();
+    const size_t cols = b.shape.back();
+    const size_t matrices = a.size() / (rows * inner);
+
+    auto is_float_like = [](DType dtype) {
+        return dtype == DType::Float32 || dtype == DType::BFloat16 ||
+               dtype == DType::Float16;
+    };
+
+    Tensor result;
+    if (a.dtype == DType::Int8 && b.dtype == DType::Int8)
+    {
+        result = Tensor::empty(result_shape, DType::Int32);
+        matmul_kernel<int8_t, int8_t, int32_t, int32_t>(
+            a.data_as<int8_t>(), b.data_as<int8_t>(), result.data_as<int32_t>(),
+            matrices, rows, inner, cols);
+    }
+    else if (a.dtype == DType::Float64 && b.dtype == DType::Float64)
+    {
+        result = Tensor::empty(result_shape, DType::Float64);
+        matmul_kernel<double, double, double, double>(
+            a.data_as<double>(), b.data_as<double>(), result.data_as<double>(),
+            matrices, rows, inner, cols);
+    }
+    else if (is_float_like(a.dtype) && is_float_like(b.dtype))
+    {
+        // Матрица b читается rows раз: bf16/fp16 один раз переводится во
+        // float векторными ядрами
+        if (b.dtype != DType::Float32)
+        {
+            return matmul_typed(a, b.to(DType::Float32), result_shape);
+        }
+        result = Tensor::empty(result_shape, DType::Float32);
+        dispatch_dtype(a.dtype, [&](auto a_tag) {
+            using A = decltype(a_tag);
+            dispatch_dtype(b.dtype, [&](auto b_tag) {
+                using B = decltype(b_tag);
+                if constexpr ((std::is_same<A, float>::value ||
+                               std::is_same<A, bfloat16>::value ||
+                               std::is_same<A, float16>::value) &&
+                              (std::is_same<B, float>::value ||
+                               std::is_same<B, bfloat16>::value ||
+                               std::is_same<B, float16>::value))
+                {
+                    matmul_kernel<A, B, float, float>(
+                        a.data_as<A>(), b.data_as<B>(), result.data.data(),
+                        matrices, rows, inner, cols);
+                }
+            });
+        });
+    }
+    else
+    {
+        throw std::invalid_argument(std::string("matmul does not support ") +
+                                    dtype_name(a.dtype) + " x " +
+                                    dtype_name(b.dtype));
+    }
+    return result;
+}
+
+inline Tensor matmul(const Tensor &a, const Tensor &b)
+{
+    if (a.shape.size() < 2 || b.shape.size() < 2)
+    {
+        throw std::invalid_argument("Tensors must have at least 2 dimensions");
+    }
+
+    // Проверяем совместимость последних двух осей
+    size_t a_cols = a.shape.back();
+    size_t b_rows = b.shape[b.shape.size()-2];
+    size_t b_cols = b.shape.back();
+
+    if (a_cols != b_rows)
+    {
+        throw std::invalid_argument("Incompatible matrix dimensions for multiplication");
+    }
+
+    // Проверяем, что все остальные размерности совпадают
+    if (a.shape.size() != b.shape.size())
+    {
+        throw std::invalid_argument("Tensors must have same number of dimensions");
+    }
+
+    for (size_t i = 0; i < a.shape.size()-2; ++i)
+    {
+        if (a.shape[i] != b.shape[i])
+        {
+            throw std::invalid_argument("Batch dimensions must match");
+        }
+    }
+
+    // Создаем форму результата
+    std::vector<size_t> result_shape = a.shape;
+    result_shape.back() = b_cols; // Заменяем последнюю размерность
+    result_shape[result_shape.size()-2] = a.shape[a.shape.size()-2]; // Сохраняем предпоследнюю
+
+    return matmul_typed(a, b, result_shape);
+}
+
+struct Layer
+{
+    // Режим обучения (train) или инференса (eval)
+    bool training = true;
+
+    virtual void train(bool mode = true) { training = mode; }
+    void eval() { train(false); }
+
+    virtual void forward(const Tensor &input, Tensor &output) = 0;
+    virtual void backward(const Tensor &grad_output, Tensor &grad_input) = 0;
+    virtual std::string to_string() const = 0;
+    virtual std::vector<Tensor *> parameters() = 0;
+
+    // Форма выхода для входа формы input_shape (для планирования памяти).
+    // По умолчанию слой поэлементный и форма не меняется
+    virtual std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const
+    {
+        return input_shape;
+    }
+
+    // Встраивает слой в предыдущий для инференса. Возвращает true, если
+    // слой можно удалить из модели
+    virtual bool fuse_into(Layer &) { return false; }
+
+    // Оценка числа операций forward для входа формы input_shape (для
+    // разбиения модели на стадии). По умолчанию одна операция на элемент
+    virtual size_t cost(const std::vector<size_t> &input_shape) const
+    {
+        size_t elements = 1;
+        for (size_t dim : input_shape)
+        {
+            elements *= dim;
+        }
+        return elements;
+    }
+
+    // Размещает копии весов на каждом узле NUMA. Копии используются
+    // только в режиме eval и сбрасываются при переходе в train
+    virtual void replicate_for_numa() {}
+
+    // Точность хранения весов, читаемых forward. Параметры (основные
+    // веса для оптимизатора) остаются во float
+    virtual void set_precision(Precision) {}
+
+    // Вызывается после изменения параметров на месте вне оптимизатора
+    // (загрузка, прунинг, встраивание слоя): слой сбрасывает копии весов
+    virtual void parameters_changed() {}
+
+    // Копия слоя с теми же параметрами и состоянием (для реплик
+    // DataParallel). nullptr - слой не поддерживает копирование
+    virtual Layer *clone() const { return nullptr; }
+
+    virtual ~Layer() {}
+};
+
+struct Linear : Layer
+{
+    Tensor weight;
+    Tensor bias;
+
+    // Копии weight по узлам NUMA (replicate_for_numa), пусто - без копий
+    std::vector<Tensor> weight_replicas;
+
+    // Копия weight в bf16/fp16 для forward (set_precision). В train
+    // обновляется каждым forward, в eval создается один раз
+    Precision weight_precision = Precision::Float32;
+    Storage<uint16_t> weight_half;
+
+    // Элементов weight, преобразуемых во float за раз (32 КиБ)
+    static constexpr size_t kHalfTileSize = 8192;
+
+    Linear(size_t in_features, size_t out_features)
+    {
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_real_distribution<float> dis(-0.1f, 0.1f);
+
+        weight.shape = {in_features, out_features};
+        weight.requires_grad = true;
+        weight.resize();
+        for (size_t i = 0; i < in_features * out_features; ++i)
+        {
+            weight.data[i] = dis(gen);
+        }
+
+        bias.shape = {out_features};
+        bias.requires_grad = true;
+        bias.resize();
+        for (size_t i = 0; i < out_features; ++i)
+        {
+            bias.data[i] = dis(gen);
+        }
+    }
+
+    std::vector<Tensor *> parameters() override { return {&weight, &bias}; }
+
+    // Веса, на которые умножают forward и backward по входу. Градиент
+    // всегда накапливается в weight
+    virtual const float *forward_weight() const { return weight.data.data(); }
+
+    void train(bool mode = true) override
+    {
+        // В train веса меняются: кэш weight_half, созданный до смены
+        // режима, устарел
+        if (mode != training)
+        {
+            weight_half.clear();
+        }
+        Layer::train(mode);
+        if (mode)
+        {
+            weight_replicas.clear();
+        }
+    }
+
+    void set_precision(Precision precision) override
+    {
+        weight_precision = precision;
+        weight_half.clear();
+    }
+
+    void parameters_changed() override
+    {
+        weight_replicas.clear();
+        weight_half.clear();
+    }
+
+    void replicate_for_numa() override
+    {
+        const NumaTopology &topology = NumaTopology::instance();
+        weight_replicas.clear();
+        if (training || topology.num_nodes() < 2)
+        {
+            return;
+        }
+        weight_replicas.resize(topology.num_nodes());
+        for (size_t node = 0; node < topology.num_nodes(); ++node)
+        {
+            run_on_numa_node(node, [&]() { weight_replicas[node] = weight.copy(); });
+        }
+    }
+
+    std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const override
+    {
+        if (input_shape.size() != 2 || input_shape[1] != weight.shape[0])
+        {
+            throw std::invalid_argument("Linear expects [batch, in_features]");
+        }
+        return {input_shape[0], weight.shape[1]};
+    }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            // Вход другого типа приводится к float, накопление во float
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        size_t in_features = weight.shape[0];
+        size_t out_features = weight.shape[1];
+        output.shape = {input.shape[0], out_features};
+        output.resize();
+        if (weight_precision != Precision::Float32)
+        {
+            forward_half(input, output);
+            return;
+        }
+
+        const bool replicated = !training && !weight_replicas.empty();
+        parallel_for(0, input.shape[0], parallel_grain(in_features * out_features),
+                     [&](size_t first, size_t last) {
+            // Веса читаются с узла NUMA текущего потока
+            const float *w = replicated
+                                 ? weight_replicas[current_numa_node()].data.data()
+                                 : forward_weight();
+            for (size_t i = first; i < last; ++i)
+            {
+                for (size_t j = 0; j < out_features; ++j)
+                {
+                    output.data[i * out_features + j] = bias.data[j];
+                    for (size_t k = 0; k < in_features; ++k)
+                    {
+                        output.data[i * out_features + j] +=
+                            input.data[i * in_features + k] *
+                            w[k * out_features + j];
+                    }
+                }
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            throw std::invalid_argument("Linear backward requires float32 input");
+        }
+        size_t in_features = weight.shape[0];
+        size_t out_features = weight.shape[1];
+        size_t batch_size = output.shape[0];
+
+        // Каждый поток пишет свои строки input.grad и weight.grad, порядок
+        // суммирования по батчу не зависит от числа потоков
+        if (input.requires_grad)
+        {
+            input.resize_grad();
+            const float *w = forward_weight();
+            parallel_for(0, batch_size, parallel_grain(in_features * out_features),
+                         [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i)
+                {
+                    for (size_t j = 0; j < in_features; ++j)
+                    {
+                        input.grad[i * in_features + j] = 0;
+                        for (size_t k = 0; k < out_features; ++k)
+                        {
+                            input.grad[i * in_features + j] +=
+                                output.grad[i * out_features + k] *
+                                w[j * out_features + k];
+                        }
+                    }
+                }
+            });
+        }
+
+        if (weight.requires_grad)
+        {
+            weight.resize_grad();
+            parallel_for(0, in_features, parallel_grain(batch_size * out_features),
+                         [&](size_t first, size_t last) {
+                for (size_t i = 0; i < batch_size; ++i)
+                {
+                    for (size_t j = first; j < last; ++j)
+                    {
+                        for (size_t k = 0; k < out_features; ++k)
+                        {
+                            weight.grad[j * out_features + k] +=
+                                output.grad[i * out_features + k] *
+                                input.data[i * in_features + j];
+                        }
+                    }
+                }
+            });
+        }
+
+        if (bias.requires_grad)
+        {
+            bias.resize_grad();
+            for (size_t i = 0; i < batch_size; ++i)
+            {
+                for (size_t k = 0; k < out_features; ++k)
+                {
+                    bias.grad[k] += output.grad[i * out_features + k];
+                }
+            }
+        }
+    }
+
+    Layer *clone() const override { return new Linear(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return input_shape[0] * weight.shape[0] * weight.shape[1];
+    }
+
+    // Forward по весам bf16/fp16: блоки строк weight преобразуются во
+    // float и сразу используются для строк входа потока. Порядок
+    // суммирования тот же, что у forward во float
+    void forward_half(const Tensor &input, Tensor &output)
+    {
+        const size_t in_features = weight.shape[0];
+        const size_t out_features = weight.shape[1];
+        if (training || weight_half.size() != weight.data.size())
+        {
+            weight_half.resize(weight.data.size());
+            convert_to_half(weight.data.data(), weight_half.data(),
+                            weight.data.size(), weight_precision);
+        }
+        const size_t tile_rows = std::max<size_t>(1, kHalfTileSize / out_features);
+
+        parallel_for(0, input.shape[0], parallel_grain(in_features * out_features),
+                     [&](size_t first, size_t last) {
+            Storage<float> tile(tile_rows * out_features);
+            for (size_t i = first; i < last; ++i)
+            {
+                std::copy(bias.data.begin(), bias.data.end(),
+                          output.data.begin() + i * out_features);
+            }
+            for (size_t k0 = 0; k0 < in_features; k0 += tile_rows)
+            {
+                const size_t k1 = std::min(in_features, k0 + tile_rows);
+                convert_from_half(weight_half.data() + k0 * out_features,
+                                  tile.data(), (k1 - k0) * out_features,
+                                  weight_precision);
+                for (size_t i = first; i < last; ++i)
+                {
+                    float *out = output.data.data() + i * out_features;
+                    for (size_t k = k0; k < k1; ++k)
+                    {
+                        const float a = input.data[i * in_features + k];
+                        const float *w = tile.data() + (k - k0) * out_features;
+                        for (size_t j = 0; j < out_features; ++j)
+                        {
+                            out[j] += a * w[j];
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "Linear(in_features=" << weight.shape[0]
+           << ", out_features=" << weight.shape[1] << ")";
+        return ss.str();
+    }
+};
+
+struct ReLU : Layer
+{
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        output.shape = input.shape;
+        output.memory_format = input.memory_format;
+        output.resize();
+        parallel_for(0, input.data.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                output.data[i] = std::max(0.0f, input.data[i]);
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        if (!input.requires_grad)
+        {
+            return;
+        }
+        input.resize_grad();
+        parallel_for(0, output.data.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                input.grad[i] = (output.data[i] > 0) ? output.grad[i] : 0;
+            }
+        });
+    }
+
+    Layer *clone() const override { return new ReLU(*this); }
+
+    std::string to_string() const override { return "ReLU()"; }
+};
+
+struct Sigmoid : Layer
+{
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        output.shape = input.shape;
+        output.memory_format = input.memory_format;
+        output.resize();
+        parallel_for(0, input.data.size(), parallel_grain(kTranscendentalCost),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                output.data[i] = 1.0f / (1.0f + std::exp(-input.data[i]));
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        if (!input.requires_grad)
+        {
+            return;
+        }
+        input.resize_grad();
+        parallel_for(0, output.data.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                float s = output.data[i];
+                input.grad[i] = output.grad[i] * s *
+                                (1 - s); // Производная Sigmoid: σ(x)*(1-σ(x))
+            }
+        });
+    }
+
+    Layer *clone() const override { return new Sigmoid(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return Layer::cost(input_shape) * kTranscendentalCost;
+    }
+
+    std::string to_string() const override { return "Sigmoid()"; }
+};
+
+struct Tanh : Layer
+{
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        output.shape = input.shape;
+        output.memory_format = input.memory_format;
+        output.resize();
+        parallel_for(0, input.data.size(), parallel_grain(kTranscendentalCost),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                output.data[i] = std::tanh(input.data[i]);
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        if (!input.requires_grad)
+        {
+            return;
+        }
+        input.resize_grad();
+        parallel_for(0, output.data.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                float t = output.data[i];
+                input.grad[i] = output.grad[i] *
+                                (1 - t * t); // Производная Tanh: 1 - tanh²(x)
+            }
+        });
+    }
+
+    Layer *clone() const override { return new Tanh(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return Layer::cost(input_shape) * kTranscendentalCost;
+    }
+
+    std::string to_string() const override { return "Tanh()"; }
+};
+
+// Наблюдатель диапазона значений для калибровки квантизации
+struct Observer
+{
+    virtual void observe(const float *data, size_t n) = 0;
+    // Диапазон [min, max] для выбора параметров квантизации
+    virtual std::pair<float, float> range() const = 0;
+    virtual ~Observer() {}
+};
+
+// Глобальные минимум и максимум всех наблюдавшихся значений
+struct MinMaxObserver : Observer
+{
+    float min_value = std::numeric_limits<float>::infinity();
+    float max_value = -std::numeric_limits<float>::infinity();
+
+    void observe(const float *data, size_t n) override
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            min_value = std::min(min_value, data[i]);
+            max_value = std::max(max_value, data[i]);
+        }
+    }
+
+    std::pair<float, float> range() const override
+    {
+        if (min_value > max_value)
+        {
+            return {0.0f, 0.0f};
+        }
+        return {min_value, max_value};
+    }
+};
+
+// Гистограмма значений. Диапазон отсекает по доле tail значений с каждой
+// стороны, так что редкие выбросы не растягивают шаг квантизации.
+// При расширении диапазона старые корзины переносятся в новые по центрам
+struct HistogramObserver : Observer
+{
+    size_t bins;
+    double tail;
+    std::vector<double> counts;
+    double total = 0;
+    float low = 0;
+    float high = 0;
+
+    explicit HistogramObserver(size_t bins = 2048, double tail = 1e-4)
+        : bins(bins), tail(tail), counts(bins, 0.0)
+    {
+    }
+
+    void observe(const float *data, size_t n) override
+    {
+        if (n == 0)
+        {
+            return;
+        }
+        float batch_low = *std::min_element(data, data + n);
+        float batch_high = *std::max_element(data, data + n);
+        if (total == 0)
+        {
+            low = batch_low;
+            high = std::max(batch_high, batch_low + 1e-6f);
+        }
+        else if (batch_low < low || batch_high > high)
+        {
+            rebin(std::min(low, batch_low), std::max(high, batch_high));
+        }
+        const double width = (high - low) / static_cast<double>(bins);
+        for (size_t i = 0; i < n; ++i)
+        {
+            counts[bin_index(data[i], width)] += 1;
+        }
+        total += static_cast<double>(n);
+    }
+
+    std::pair<float, float> range() const override
+    {
+        if (total == 0)
+        {
+            return {0.0f, 0.0f};
+        }
+        const double width = (high - low) / static_cast<double>(bins);
+        const double cut = total * tail;
+        size_t first = 0;
+        for (double sum = counts[0]; first + 1 < bins && sum <= cut;)
+        {
+            sum += counts[++first];
+        }
+        size_t last = bins - 1;
+        for (double sum = counts[last]; last > first && sum <= cut;)
+        {
+            sum += counts[--last];
+        }
+        return {static_cast<float>(low + first * width),
+                static_cast<float>(low + (last + 1) * width)};
+    }
+
+  private:
+    size_t bin_index(double value, double width) const
+    {
+        const double index = std::floor((value - low) / width);
+        return static_cast<size_t>(
+            std::min(std::max(index, 0.0), static_cast<double>(bins - 1)));
+    }
+
+    void rebin(float new_low, float new_high)
+    {
+        const double old_width = (high - low) / static_cast<double>(bins);
+        const float old_low = low;
+        std::vector<double> old_counts(bins, 0.0);
+        old_counts.swap(counts);
+        low = new_low;
+        high = new_high;
+        const double width = (high - low) / static_cast<double>(bins);
+        for (size_t b = 0; b < bins; ++b)
+        {
+            if (old_counts[b] != 0)
+            {
+                counts[bin_index(old_low + (b + 0.5) * old_width, width)] +=
+                    old_counts[b];
+            }
+        }
+    }
+};
+
+// Аффинная квантизация: x ~ scale * (q - zero_point)
+struct QuantParams
+{
+    float scale = 1.0f;
+    int32_t zero_point = 0;
+};
+
+// Параметры для диапазона [min_value, max_value] и целых [qmin, qmax].
+// Диапазон расширяется до нуля, чтобы 0 представлялся точно
+inline QuantParams choose_qparams(float min_value, float max_value,
+                                  int32_t qmin, int32_t qmax)
+{
+    min_value = std::min(min_value, 0.0f);
+    max_value = std::max(max_value, 0.0f);
+    QuantParams params;
+    if (max_value - min_value < std::numeric_limits<float>::min())
+    {
+        return params;
+    }
+    params.scale = (max_value - min_value) / static_cast<float>(qmax - qmin);
+    const float zero = qmin - min_value / params.scale;
+    params.zero_point = static_cast<int32_t>(std::min<float>(
+        std::max<float>(std::nearbyint(zero), qmin), qmax));
+    return params;
+}
+
+// Симметричные шкалы int8 по выходным каналам (столбцам) весов
+// [in_features, out_features]: max|w| / 127
+inline std::vector<float> channel_scales(const float *weight,
+                                         size_t in_features,
+                                         size_t out_features)
+{
+    std::vector<float> max_abs(out_features, 0.0f);
+    for (size_t k = 0; k < in_features; ++k)
+    {
+        for (size_t j = 0; j < out_features; ++j)
+        {
+            max_abs[j] = std::max(max_abs[j],
+                                  std::fabs(weight[k * out_features + j]));
+        }
+    }
+    std::vector<float> scales(out_features, 1.0f);
+    for (size_t j = 0; j < out_features; ++j)
+    {
+        if (max_abs[j] > 0)
+        {
+            scales[j] = max_abs[j] / 127.0f;
+        }
+    }
+    return scales;
+}
+
+// -128 не используется: шкала симметрична
+inline int8_t quantize_symmetric(float value, float scale)
+{
+    return std::max<int8_t>(-127, dtype_cast<int8_t>(value / scale));
+}
+
+// Linear для инференса в int8: веса int8 с симметричной шкалой на каждый
+// выходной канал, вход квантуется асимметрично в uint8 (неотрицательный
+// калибровочный диапазон, например после ReLU) или int8. Произведение
+// накапливается в int32 и переводится во float с bias:
+//   y[j] = s_x * s_w[j] * (sum_k q_x[k] * q_w[k][j] - zp_x * sum_k q_w[k][j])
+//          + bias[j]
+struct QuantizedLinear : Layer
+{
+    Tensor weight; // int8, [in_features, out_features]
+    Tensor bias;
+    std::vector<float> weight_scale;
+    std::vector<int32_t> weight_sum;
+
+    QuantParams input_params;
+    bool unsigned_input = false;
+
+    // Вход квантуется в uint8, если калибровочный минимум неотрицателен
+    QuantizedLinear(const Linear &linear, float input_min, float input_max)
+        : QuantizedLinear(linear,
+                          input_min >= 0
+                              ? choose_qparams(input_min, input_max, 0, 255)
+                              : choose_qparams(input_min, input_max, -128, 127),
+                          input_min >= 0)
+    {
+    }
+
+    QuantizedLinear(const Linear &linear, QuantParams input_params,
+                    bool unsigned_input)
+        : input_params(input_params), unsigned_input(unsigned_input)
+    {
+        const size_t in_features = linear.weight.shape[0];
+        const size_t out_features = linear.weight.shape[1];
+        const float *w = linear.weight.data.data();
+        weight = Tensor::empty({in_features, out_features}, DType::Int8);
+        int8_t *q = weight.data_as<int8_t>();
+        weight_scale = channel_scales(w, in_features, out_features);
+        weight_sum.assign(out_features, 0);
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            for (size_t j = 0; j < out_features; ++j)
+            {
+                q[k * out_features + j] =
+                    quantize_symmetric(w[k * out_features + j], weight_scale[j]);
+                weight_sum[j] += q[k * out_features + j];
+            }
+        }
+        bias = linear.bias.copy();
+        bias.requires_grad = false;
+    }
+
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const override
+    {
+        if (input_shape.size() != 2 || input_shape[1] != weight.shape[0])
+        {
+            throw std::invalid_argument(
+                "QuantizedLinear expects [batch, in_features]");
+        }
+        return {input_shape[0], weight.shape[1]};
+    }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        output.shape = output_shape(input.shape);
+        output.resize();
+        if (unsigned_input)
+        {
+            forward_quantized<uint8_t>(input, output);
+        }
+        else
+        {
+            forward_quantized<int8_t>(input, output);
+        }
+    }
+
+    void backward(const Tensor &, Tensor &) override
+    {
+        throw std::logic_error("QuantizedLinear does not support backward");
+    }
+
+    Layer *clone() const override { return new QuantizedLinear(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return input_shape[0] * weight.shape[0] * weight.shape[1];
+    }
+
+    // Байт на веса и bias
+    size_t weight_bytes() const
+    {
+        return weight.size() + bias.size() * sizeof(float) +
+               weight_scale.size() * sizeof(float) +
+               weight_sum.size() * sizeof(int32_t);
+    }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "QuantizedLinear(in_features=" << weight.shape[0]
+           << ", out_features=" << weight.shape[1]
+           << ", input=" << (unsigned_input ? "uint8" : "int8") << ")";
+        return ss.str();
+    }
+
+  private:
+    template <typename T>
+    void forward_quantized(const Tensor &input, Tensor &output)
+    {
+        const size_t batch = input.shape[0];
+        const size_t in_features = weight.shape[0];
+        const size_t out_features = weight.shape[1];
+        const float inv_scale = 1.0f / input_params.scale;
+        const float zero_point = static_cast<float>(input_params.zero_point);
+
+        Storage<T> q(input.data.size());
+        parallel_for(0, q.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                q[i] = dtype_cast<T>(input.data[i] * inv_scale + zero_point);
+            }
+        });
+        Storage<int32_t> acc(batch * out_features);
+        matmul_kernel<T, int8_t, int32_t, int32_t>(
+            q.data(), weight.data_as<int8_t>(), acc.data(), 1, batch,
+            in_features, out_features);
+
+        parallel_for(0, batch, parallel_grain(out_features),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                for (size_t j = 0; j < out_features; ++j)
+                {
+                    const int32_t value =
+                        acc[i * out_features + j] -
+                        input_params.zero_point * weight_sum[j];
+                    output.data[i * out_features + j] =
+                        input_params.scale * weight_scale[j] *
+                            static_cast<float>(value) +
+                        bias.data[j];
+                }
+            }
+        });
+    }
+};
+
+// Фиктивная квантизация активаций для обучения с учетом квантизации
+// (QAT): forward округляет вход до сетки int8/uint8 и возвращает его во
+// float, backward пропускает градиент без изменений внутри диапазона
+// сетки и обнуляет его за пределами (straight-through estimator).
+// Диапазон отслеживается экспоненциальным средним min/max по батчам в
+// train. С learnable_scale шкала - параметр, обучаемый по LSQ (шкала
+// инициализируется по первому батчу, нулевая точка далее не меняется)
+struct FakeQuantize : Layer
+{
+    // Вес нового батча в экспоненциальном среднем
+    float averaging = 0.01f;
+    // false - диапазон заморожен (обычно на последних эпохах QAT)
+    bool observer_enabled = true;
+    bool learnable_scale = false;
+
+    float min_value = 0;
+    float max_value = 0;
+    bool initialized = false;
+
+    // Сетка uint8 при неотрицательном диапазоне, иначе int8
+    QuantParams params;
+    bool unsigned_range = false;
+
+    Tensor scale; // [1], параметр при learnable_scale
+
+    explicit FakeQuantize(bool learnable_scale = false)
+        : learnable_scale(learnable_scale)
+    {
+        scale.shape = {1};
+        scale.requires_grad = learnable_scale;
+        scale.resize();
+        scale.data[0] = 1.0f;
+    }
+
+    std::vector<Tensor *> parameters() override
+    {
+        if (learnable_scale)
+        {
+            return {&scale};
+        }
+        return {};
+    }
+
+    int32_t qmin() const { return unsigned_range ? 0 : -128; }
+    int32_t qmax() const { return unsigned_range ? 255 : 127; }
+
+    // Текущая сетка: с learnable_scale шкала берется из параметра
+    QuantParams quant_params() const
+    {
+        QuantParams result = params;
+        if (learnable_scale)
+        {
+            result.scale = std::max(scale.data[0], 1e-8f);
+        }
+        return result;
+    }
+
+    // Диапазон, представимый сеткой
+    std::pair<float, float> range() const
+    {
+        QuantParams current = quant_params();
+        return {current.scale * (qmin() - current.zero_point),
+                current.scale * (qmax() - current.zero_point)};
+    }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        if (training && (observer_enabled || !initialized))
+        {
+            observe(input);
+        }
+        params = quant_params();
+
+        output.shape = input.shape;
+        output.memory_format = input.memory_format;
+        output.resize();
+        const float inv_scale = 1.0f / params.scale;
+        const float low = static_cast<float>(qmin());
+        const float high = static_cast<float>(qmax());
+        const float zero_point = static_cast<float>(params.zero_point);
+        parallel_for(0, input.data.size(), parallel_grain(1),
+                     [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                const float q = std::min(
+                    std::max(std::nearbyint(input.data[i] * inv_scale) +
+                                 zero_point,
+                             low),
+                    high);
+                output.data[i] = params.scale * (q - zero_point);
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        const float inv_scale = 1.0f / params.scale;
+        const float low = static_cast<float>(qmin());
+        const float high = static_cast<float>(qmax());
+        const float zero_point = static_cast<float>(params.zero_point);
+        if (input.requires_grad)
+        {
+            input.resize_grad();
+            parallel_for(0, input.data.size(), parallel_grain(1),
+                         [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i)
+                {
+                    const float q =
+                        std::nearbyint(input.data[i] * inv_scale) + zero_point;
+                    input.grad[i] = (q >= low && q <= high) ? output.grad[i] : 0;
+                }
+            });
+        }
+        if (learnable_scale && scale.requires_grad)
+        {
+            // d out / d scale по LSQ, градиент масштабируется на
+            // 1 / sqrt(n * qmax)
+            double sum = 0;
+            for (size_t i = 0; i < input.data.size(); ++i)
+            {
+                const float x = input.data[i] * inv_scale;
+                const float q = std::nearbyint(x) + zero_point;
+                float derivative = std::nearbyint(x) - x;
+                if (q < low)
+                {
+                    derivative = low - zero_point;
+                }
+                else if (q > high)
+                {
+                    derivative = high - zero_point;
+                }
+                sum += static_cast<double>(output.grad[i]) * derivative;
+            }
+            scale.resize_grad();
+            scale.grad[0] += static_cast<float>(
+                sum / std::sqrt(static_cast<double>(input.data.size()) * high));
+        }
+    }
+
+    Layer *clone() const override { return new FakeQuantize(*this); }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "FakeQuantize(" << (unsigned_range ? "uint8" : "int8")
+           << ", scale=" << params.scale
+           << ", zero_point=" << params.zero_point << ")";
+        return ss.str();
+    }
+
+  private:
+    void observe(const Tensor &input)
+    {
+        if (input.data.size() == 0)
+        {
+            return;
+        }
+        const float batch_min =
+            *std::min_element(input.data.begin(), input.data.end());
+        const float batch_max =
+            *std::max_element(input.data.begin(), input.data.end());
+        if (!initialized)
+        {
+            min_value = batch_min;
+            max_value = batch_max;
+        }
+        else if (learnable_scale)
+        {
+            return;
+        }
+        else
+        {
+            min_value += averaging * (batch_min - min_value);
+            max_value += averaging * (batch_max - max_value);
+        }
+        unsigned_range = min_value >= 0;
+        params = choose_qparams(min_value, max_value, qmin(), qmax());
+        if (!initialized)
+        {
+            scale.data[0] = params.scale;
+            initialized = true;
+        }
+    }
+};
+
+// Linear для QAT: forward и backward по входу используют веса, округленные
+// до той же сетки int8 по каналам, что и QuantizedLinear. Градиент
+// проходит в float-веса без изменений (straight-through estimator):
+// симметричная шкала по max|w| не отсекает ни одного веса
+struct QATLinear : Linear
+{
+    Storage<float> weight_fake;
+
+    QATLinear(size_t in_features, size_t out_features)
+        : Linear(in_features, out_features)
+    {
+    }
+
+    explicit QATLinear(const Linear &linear) : Linear(linear) {}
+
+    const float *forward_weight() const override { return weight_fake.data(); }
+
+    // Копии весов по NUMA и bf16/fp16 обошли бы квантизацию
+    void replicate_for_numa() override {}
+    void set_precision(Precision) override {}
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        const size_t in_features = weight.shape[0];
+        const size_t out_features = weight.shape[1];
+        const float *w = weight.data.data();
+        std::vector<float> scales = channel_scales(w, in_features, out_features);
+        weight_fake.resize(weight.data.size());
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            for (size_t j = 0; j < out_features; ++j)
+            {
+                weight_fake[k * out_features + j] =
+                    scales[j] *
+                    quantize_symmetric(w[k * out_features + j], scales[j]);
+            }
+        }
+        Linear::forward(input, output);
+    }
+
+    Layer *clone() const override { return new QATLinear(*this); }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "QATLinear(in_features=" << weight.shape[0]
+           << ", out_features=" << weight.shape[1] << ")";
+        return ss.str();
+    }
+};
+
+// Linear с весами в 4 битах для инференса, когда узкое место - чтение
+// весов (GEMV при декодировании). Веса [in_features, out_features] делятся
+// по входной оси на группы по group_size строк; у каждой группы каждого
+// выходного канала своя шкала и нулевая точка (0..15):
+//   w[k][j] ~ scale[g][j] * (q[k][j] - zero[g][j]), g = k / group_size
+// Строка весов делится на блоки по kColumnBlock столбцов; байт p блока
+// хранит столбец p (младшая тетрада) и столбец p + половина блока
+// (старшая), так что обе половины распаковываются непрерывными векторами.
+// Ядро распаковывает тетрады прямо в цикле умножения: внутри группы
+// накапливается sum_k x[k] * q[k][j], шкала и нулевая точка применяются
+// один раз на группу
+struct Int4Linear : Layer
+{
+    size_t in_features = 0;
+    size_t out_features = 0;
+    size_t group_size = 0;
+
+    Storage<uint8_t> weight_packed; // [in_features, (out_features + 1) / 2]
+    std::vector<float> scales;      // [groups, out_features]
+    std::vector<uint8_t> zero_points;
+    Tensor bias;
+
+    // Столбцов на поток в forward (кратно 2)
+    static constexpr size_t kColumnBlock = 64;
+
+    Int4Linear(const Linear &linear, size_t group_size = 64)
+        : in_features(linear.weight.shape[0]),
+          out_features(linear.weight.shape[1]), group_size(group_size)
+    {
+        if (group_size == 0)
+        {
+            throw std::invalid_argument("Int4Linear group_size must be positive");
+        }
+        const float *w = linear.weight.data.data();
+        const size_t row_bytes = packed_row_bytes();
+        weight_packed.resize(in_features * row_bytes);
+        std::fill(weight_packed.begin(), weight_packed.end(), uint8_t(0));
+        scales.assign(num_groups() * out_features, 1.0f);
+        zero_points.assign(num_groups() * out_features, 0);
+
+        for (size_t g = 0; g < num_groups(); ++g)
+        {
+            const size_t k0 = g * group_size;
+            const size_t k1 = std::min(in_features, k0 + group_size);
+            for (size_t j = 0; j < out_features; ++j)
+            {
+                float low = w[k0 * out_features + j];
+                float high = low;
+                for (size_t k = k0 + 1; k < k1; ++k)
+                {
+                    low = std::min(low, w[k * out_features + j]);
+                    high = std::max(high, w[k * out_features + j]);
+                }
+                const QuantParams params = choose_qparams(low, high, 0, 15);
+                scales[g * out_features + j] = params.scale;
+                zero_points[g * out_features + j] =
+                    static_cast<uint8_t>(params.zero_point);
+                for (size_t k = k0; k < k1; ++k)
+                {
+                    const float q = std::nearbyint(w[k * out_features + j] /
+                                                   params.scale) +
+                                    params.zero_point;
+                    const uint8_t nibble = static_cast<uint8_t>(
+                        std::min(std::max(q, 0.0f), 15.0f));
+                    weight_packed[k * row_bytes + packed_byte(j)] |=
+                        high_nibble(j) ? static_cast<uint8_t>(nibble << 4)
+                                       : nibble;
+                }
+            }
+        }
+        bias = linear.bias.copy();
+        bias.requires_grad = false;
+    }
+
+    size_t num_groups() const
+    {
+        return (in_features + group_size - 1) / group_size;
+    }
+
+    size_t packed_row_bytes() const { return (out_features + 1) / 2; }
+
+    // Половина блока столбцов, в который входит столбец j
+    size_t block_half(size_t j) const
+    {
+        const size_t j0 = j / kColumnBlock * kColumnBlock;
+        return (std::min(kColumnBlock, out_features - j0) + 1) / 2;
+    }
+
+    size_t packed_byte(size_t j) const
+    {
+        const size_t j0 = j / kColumnBlock * kColumnBlock;
+        return j0 / 2 + (j - j0) % block_half(j);
+    }
+
+    bool high_nibble(size_t j) const
+    {
+        return j % kColumnBlock >= block_half(j);
+    }
+
+    // Веса, восстановленные во float (для проверки точности)
+    Tensor dequantized_weight() const
+    {
+        Tensor result;
+        result.shape = {in_features, out_features};
+        result.resize();
+        const size_t row_bytes = packed_row_bytes();
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            const size_t g = k / group_size;
+            for (size_t j = 0; j < out_features; ++j)
+            {
+                const uint8_t byte = weight_packed[k * row_bytes + packed_byte(j)];
+                const int q = high_nibble(j) ? (byte >> 4) : (byte & 0x0F);
+                result.data[k * out_features + j] =
+                    scales[g * out_features + j] *
+                    static_cast<float>(q - zero_points[g * out_features + j]);
+            }
+        }
+        return result;
+    }
+
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const override
+    {
+        if (input_shape.size() != 2 || input_shape[1] != in_features)
+        {
+            throw std::invalid_argument("Int4Linear expects [batch, in_features]");
+        }
+        return {input_shape[0], out_features};
+    }
+
+    // Потоки делят выходные столбцы, а не строки батча: при batch = 1
+    // (GEMV) работа все равно распределяется. Блок весов группы
+    // (group_size x kColumnBlock тетрад) переиспользуется всеми строками
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        output.shape = output_shape(input.shape);
+        output.resize();
+        const size_t batch = input.shape[0];
+        const size_t row_bytes = packed_row_bytes();
+        const size_t blocks = (out_features + kColumnBlock - 1) / kColumnBlock;
+
+        // Суммы входа по группам: множитель нулевой точки
+        std::vector<float> input_sums(batch * num_groups(), 0.0f);
+        for (size_t i = 0; i < batch; ++i)
+        {
+            for (size_t k = 0; k < in_features; ++k)
+            {
+                input_sums[i * num_groups() + k / group_size] +=
+                    input.data[i * in_features + k];
+            }
+        }
+
+        parallel_for(0, blocks, parallel_grain(batch * in_features * kColumnBlock),
+                     [&](size_t first, size_t last) {
+            float partial[kColumnBlock];
+            for (size_t block = first; block < last; ++block)
+            {
+                const size_t j0 = block * kColumnBlock;
+                const size_t j1 = std::min(out_features, j0 + kColumnBlock);
+                const size_t half = (j1 - j0 + 1) / 2;
+                for (size_t i = 0; i < batch; ++i)
+                {
+                    std::copy(bias.data.begin() + j0, bias.data.begin() + j1,
+                              output.data.begin() + i * out_features + j0);
+                }
+                for (size_t g = 0; g < num_groups(); ++g)
+                {
+                    const size_t k0 = g * group_size;
+                    const size_t k1 = std::min(in_features, k0 + group_size);
+                    const float *group_scales = scales.data() + g * out_features;
+                    const uint8_t *group_zeros =
+                        zero_points.data() + g * out_features;
+                    for (size_t i = 0; i < batch; ++i)
+                    {
+                        std::fill(partial, partial + 2 * half, 0.0f);
+                        const float *x = input.data.data() + i * in_features;
+                        const uint8_t *packed =
+                            weight_packed.data() + k0 * row_bytes + j0 / 2;
+                        if (half == kColumnBlock / 2)
+                        {
+                            // Полный блок: длина известна при компиляции,
+                            // partial остается в векторных регистрах
+                            accumulate_nibbles<kColumnBlock / 2>(
+                                x + k0, k1 - k0, packed, row_bytes, partial);
+                        }
+                        else
+                        {
+                            accumulate_nibbles(x + k0, k1 - k0, packed,
+                                               row_bytes, partial, half);
+                        }
+                        float *out = output.data.data() + i * out_features;
+                        const float sum = input_sums[i * num_groups() + g];
+                        for (size_t j = j0; j < j1; ++j)
+                        {
+                            out[j] += group_scales[j] *
+                                      (partial[j - j0] - group_zeros[j] * sum);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    void backward(const Tensor &, Tensor &) override
+    {
+        throw std::logic_error("Int4Linear does not support backward");
+    }
+
+    // partial[p] += x[k] * q[k][p], partial[half + p] += x[k] * q[k][half + p]
+    // по строкам k группы
+    template <size_t FixedHalf = 0>
+    static void accumulate_nibbles(const float *x, size_t rows,
+                                   const uint8_t *packed, size_t row_bytes,
+                                   float *partial, size_t half = FixedHalf)
+    {
+        if (FixedHalf != 0)
+        {
+            half = FixedHalf;
+        }
+        for (size_t k = 0; k < rows; ++k)
+        {
+            const uint8_t *row = packed + k * row_bytes;
+            const float a = x[k];
+            for (size_t p = 0; p < half; ++p)
+            {
+                partial[p] += a * (row[p] & 0x0F);
+                partial[half + p] += a * (row[p] >> 4);
+            }
+        }
+    }
+
+    Layer *clone() const override { return new Int4Linear(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return input_shape[0] * in_features * out_features;
+    }
+
+    // Байт на веса, шкалы, нулевые точки и bias
+    size_t weight_bytes() const
+    {
+        return weight_packed.size() + scales.size() * sizeof(float) +
+               zero_points.size() + bias.size() * sizeof(float);
+    }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "Int4Linear(in_features=" << in_features
+           << ", out_features=" << out_features
+           << ", group_size=" << group_size << ")";
+        return ss.str();
+    }
+};
+
+// Бинарные и тернарные веса. Значения w[k][j] в {-1, +1} ({-1, 0, +1}
+// для тернарных) со шкалой на выходной канал:
+//   бинарные: scale = mean_k |w|, значение - знак w;
+//   тернарные: порог 0.7 * mean_k |w|, веса по модулю не больше порога
+//   обнуляются, scale = среднее |w| оставшихся
+inline void binarize_weights(const float *weight, size_t in_features,
+                             size_t out_features, bool ternary,
+                             std::vector<float> &scales,
+                             std::vector<int8_t> &values)
+{
+    scales.assign(out_features, 0.0f);
+    values.assign(in_features * out_features, 0);
+    for (size_t j = 0; j < out_features; ++j)
+    {
+        double sum = 0;
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            sum += std::fabs(weight[k * out_features + j]);
+        }
+        const float mean = static_cast<float>(sum / in_features);
+        const float threshold = ternary ? 0.7f * mean : -1.0f;
+        double kept_sum = 0;
+        size_t kept = 0;
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            const float w = weight[k * out_features + j];
+            if (std::fabs(w) > threshold)
+            {
+                values[k * out_features + j] = w >= 0 ? 1 : -1;
+                kept_sum += std::fabs(w);
+                ++kept;
+            }
+        }
+        scales[j] = kept ? static_cast<float>(kept_sum / kept) : 0.0f;
+    }
+}
+
+// Бинаризация входа по строкам: x[i][k] ~ scale[i] * sign(x[i][k]),
+// scale[i] = mean_k |x[i][k]|
+inline void binarize_rows(const float *input, size_t rows, size_t cols,
+                          float *scales, float *values)
+{
+    for (size_t i = 0; i < rows; ++i)
+    {
+        double sum = 0;
+        for (size_t k = 0; k < cols; ++k)
+        {
+            sum += std::fabs(input[i * cols + k]);
+        }
+        scales[i] = static_cast<float>(sum / cols);
+        for (size_t k = 0; k < cols; ++k)
+        {
+            values[i * cols + k] = input[i * cols + k] >= 0 ? 1.0f : -1.0f;
+        }
+    }
+}
+
+// Число единичных битов x. __popcnt64 в MSVC - всегда инструкция popcnt
+// без проверки процессора, поэтому вне GCC/Clang - std::bitset
+inline int popcount64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    return static_cast<int>(std::bitset<64>(x).count());
+#endif
+}
+
+// Число несовпадений знаков x[i] и w[j] в битовых плоскостях по
+// words слов: popcount(x ^ w), для тернарных весов - только в позициях
+// mask[j] (mask == nullptr - все позиции). Для столбцов [first, last)
+template <bool Masked>
+inline void popcount_mismatches(const uint64_t *x, const uint64_t *w,
+                                const uint64_t *mask, int32_t *counts,
+                                size_t rows, size_t cols, size_t first,
+                                size_t last, size_t words)
+{
+    for (size_t i = 0; i < rows; ++i)
+    {
+        const uint64_t *x_row = x + i * words;
+        for (size_t j = first; j < last; ++j)
+        {
+            const uint64_t *w_col = w + j * words;
+            int32_t count = 0;
+            for (size_t t = 0; t < words; ++t)
+            {
+                uint64_t diff = x_row[t] ^ w_col[t];
+                if (Masked)
+                {
+                    diff &= mask[j * words + t];
+                }
+                count += popcount64(diff);
+            }
+            counts[i * cols + j] = count;
+        }
+    }
+}
+
+#if defined(TTIE_X86_KERNELS)
+// То же с инструкцией popcnt (без -mpopcnt popcount64 - вызов
+// библиотечной функции)
+template <bool Masked>
+__attribute__((target("popcnt"), flatten)) inline void
+popcount_mismatches_popcnt(const uint64_t *x, const uint64_t *w,
+                           const uint64_t *mask, int32_t *counts, size_t rows,
+                           size_t cols, size_t first, size_t last, size_t words)
+{
+    popcount_mismatches<Masked>(x, w, mask, counts, rows, cols, first, last,
+                                words);
+}
+
+inline bool cpu_has_popcnt()
+{
+    static const bool supported = __builtin_cpu_supports("popcnt");
+    return supported;
+}
+#endif
+
+// Linear с бинарными (тернарными) весами и бинарным входом для обучения.
+// Forward умножает знаки входа со шкалой строки на веса
+// binarize_weights; backward - Linear::backward по этим значениям с
+// straight-through estimator: градиент проходит во float-веса без
+// изменений, во вход - там, где |x| <= 1
+struct BinaryLinear : Linear
+{
+    bool ternary = false;
+    Storage<float> weight_fake;
+
+    BinaryLinear(size_t in_features, size_t out_features, bool ternary = false)
+        : Linear(in_features, out_features), ternary(ternary)
+    {
+    }
+
+    explicit BinaryLinear(const Linear &linear, bool ternary = false)
+        : Linear(linear), ternary(ternary)
+    {
+    }
+
+    const float *forward_weight() const override { return weight_fake.data(); }
+
+    // Копии весов по NUMA и bf16/fp16 обошли бы бинаризацию
+    void replicate_for_numa() override {}
+    void set_precision(Precision) override {}
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        const size_t in_features = weight.shape[0];
+        const size_t out_features = weight.shape[1];
+        std::vector<float> scales;
+        std::vector<int8_t> values;
+        binarize_weights(weight.data.data(), in_features, out_features, ternary,
+                         scales, values);
+        weight_fake.resize(weight.data.size());
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            for (size_t j = 0; j < out_features; ++j)
+            {
+                weight_fake[k * out_features + j] =
+                    scales[j] * values[k * out_features + j];
+            }
+        }
+        Linear::forward(binarized_input(input), output);
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        Tensor binarized = binarized_input(input);
+        binarized.requires_grad = input.requires_grad;
+        Linear::backward(output, binarized);
+        if (!input.requires_grad)
+        {
+            return;
+        }
+        input.resize_grad();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.grad[i] =
+                std::fabs(input.data[i]) <= 1.0f ? binarized.grad[i] : 0.0f;
+        }
+    }
+
+    // Вход в виде scale[i] * sign(x)
+    Tensor binarized_input(const Tensor &input) const
+    {
+        const size_t rows = input.shape[0];
+        const size_t cols = input.data.size() / std::max<size_t>(1, rows);
+        Tensor result;
+        result.shape = input.shape;
+        result.resize();
+        std::vector<float> scales(rows);
+        binarize_rows(input.data.data(), rows, cols, scales.data(),
+                      result.data.data());
+        for (size_t i = 0; i < rows; ++i)
+        {
+            for (size_t k = 0; k < cols; ++k)
+            {
+                result.data[i * cols + k] *= scales[i];
+            }
+        }
+        return result;
+    }
+
+    Layer *clone() const override { return new BinaryLinear(*this); }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "BinaryLinear(in_features=" << weight.shape[0]
+           << ", out_features=" << weight.shape[1]
+           << (ternary ? ", ternary" : "") << ")";
+        return ss.str();
+    }
+};
+
+// Инференс BinaryLinear на битовых плоскостях: знаки весов столбца j
+// упакованы в слова по 64 входа (бит 1 - плюс), у тернарных весов
+// вторая плоскость - маска ненулевых. Вход бинаризуется по строкам так
+// же, скалярное произведение знаков равно
+//   n_j - 2 * popcount((x ^ w_j) & mask_j),
+// где n_j - число ненулевых весов столбца. Хвост последнего слова нулевой
+// у входа, весов и маски, поэтому совпадает и не учитывается
+struct PackedBinaryLinear : Layer
+{
+    size_t in_features = 0;
+    size_t out_features = 0;
+    size_t words = 0;
+    bool ternary = false;
+
+    Storage<uint64_t> weight_sign; // [out_features, words]
+    Storage<uint64_t> weight_mask; // [out_features, words], только ternary
+    std::vector<float> scales;
+    std::vector<int32_t> nonzero;
+    Tensor bias;
+
+    // Столбцов на задачу parallel_for
+    static constexpr size_t kColumnBlock = 64;
+
+    explicit PackedBinaryLinear(const BinaryLinear &linear)
+        : in_features(linear.weight.shape[0]),
+          out_features(linear.weight.shape[1]),
+          words((in_features + 63) / 64), ternary(linear.ternary)
+    {
+        std::vector<int8_t> values;
+        binarize_weights(linear.weight.data.data(), in_features, out_features,
+                         ternary, scales, values);
+        weight_sign.resize(out_features * words);
+        std::fill(weight_sign.begin(), weight_sign.end(), uint64_t(0));
+        if (ternary)
+        {
+            weight_mask.resize(out_features * words);
+            std::fill(weight_mask.begin(), weight_mask.end(), uint64_t(0));
+        }
+        nonzero.assign(out_features, 0);
+        for (size_t j = 0; j < out_features; ++j)
+        {
+            for (size_t k = 0; k < in_features; ++k)
+            {
+                const int8_t value = values[k * out_features + j];
+                const uint64_t bit = uint64_t(1) << (k % 64);
+                if (value > 0)
+                {
+                    weight_sign[j * words + k / 64] |= bit;
+                }
+                if (value != 0)
+                {
+                    ++nonzero[j];
+                    if (ternary)
+                    {
+                        weight_mask[j * words + k / 64] |= bit;
+                    }
+                }
+            }
+        }
+        bias = linear.bias.copy();
+        bias.requires_grad = false;
+    }
+
+    std::vector<Tensor *> parameters() override { return {}; }
+
+    std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const override
+    {
+        if (input_shape.size() != 2 || input_shape[1] != in_features)
+        {
+            throw std::invalid_argument(
+                "PackedBinaryLinear expects [batch, in_features]");
+        }
+        return {input_shape[0], out_features};
+    }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        output.shape = output_shape(input.shape);
+        output.resize();
+        const size_t batch = input.shape[0];
+
+        // Знаки и шкалы строк входа
+        Storage<uint64_t> input_bits(batch * words);
+        std::fill(input_bits.begin(), input_bits.end(), uint64_t(0));
+        std::vector<float> input_scales(batch, 0.0f);
+        for (size_t i = 0; i < batch; ++i)
+        {
+            const float *x = input.data.data() + i * in_features;
+            double sum = 0;
+            for (size_t k = 0; k < in_features; ++k)
+            {
+                sum += std::fabs(x[k]);
+                if (x[k] >= 0)
+                {
+                    input_bits[i * words + k / 64] |= uint64_t(1) << (k % 64);
+                }
+            }
+            input_scales[i] = static_cast<float>(sum / in_features);
+        }
+
+        Storage<int32_t> counts(batch * out_features);
+        const size_t blocks = (out_features + kColumnBlock - 1) / kColumnBlock;
+        parallel_for(0, blocks, parallel_grain(batch * words * kColumnBlock),
+                     [&](size_t first, size_t last) {
+            const size_t j0 = first * kColumnBlock;
+            const size_t j1 = std::min(out_features, last * kColumnBlock);
+            mismatches(input_bits.data(), counts.data(), batch, j0, j1);
+            for (size_t i = 0; i < batch; ++i)
+            {
+                for (size_t j = j0; j < j1; ++j)
+                {
+                    const int32_t dot =
+                        nonzero[j] - 2 * counts[i * out_features + j];
+                    output.data[i * out_features + j] =
+                        input_scales[i] * scales[j] * static_cast<float>(dot) +
+                        bias.data[j];
+                }
+            }
+        });
+    }
+
+    void backward(const Tensor &, Tensor &) override
+    {
+        throw std::logic_error("PackedBinaryLinear does not support backward");
+    }
+
+    Layer *clone() const override { return new PackedBinaryLinear(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return input_shape[0] * words * out_features;
+    }
+
+    // Байт на битовые плоскости, шкалы и bias
+    size_t weight_bytes() const
+    {
+        return (weight_sign.size() + weight_mask.size()) * sizeof(uint64_t) +
+               scales.size() * sizeof(float) +
+               nonzero.size() * sizeof(int32_t) + bias.size() * sizeof(float);
+    }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "PackedBinaryLinear(in_features=" << in_features
+           << ", out_features=" << out_features
+           << (ternary ? ", ternary" : "") << ")";
+        return ss.str();
+    }
+
+  private:
+    void mismatches(const uint64_t *x, int32_t *counts, size_t rows,
+                    size_t first, size_t last) const
+    {
+        const uint64_t *w = weight_sign.data();
+        const uint64_t *mask = weight_mask.data();
+#if defined(TTIE_X86_KERNELS)
+        if (cpu_has_popcnt())
+        {
+            if (ternary)
+            {
+                popcount_mismatches_popcnt<true>(x, w, mask, counts, rows,
+                                                 out_features, first, last,
+                                                 words);
+            }
+            else
+            {
+                popcount_mismatches_popcnt<false>(x, w, mask, counts, rows,
+                                                  out_features, first, last,
+                                                  words);
+            }
+            return;
+        }
+#endif
+        if (ternary)
+        {
+            popcount_mismatches<true>(x, w, mask, counts, rows, out_features,
+                                      first, last, words);
+        }
+        else
+        {
+            popcount_mismatches<false>(x, w, mask, counts, rows, out_features,
+                                       first, last, words);
+        }
+    }
+};
+
+// Скалярное произведение разреженного вектора (values по индексам
+// indices) на плотный dense
+inline float sparse_dot(const float *values, const uint32_t *indices,
+                        size_t n, const float *dense)
+{
+    float sum = 0;
+    for (size_t p = 0; p < n; ++p)
+    {
+        sum += values[p] * dense[indices[p]];
+    }
+    return sum;
+}
+
+// out[p] += alpha * dense[indices[p]] для p < n
+inline void sparse_gather_axpy(float alpha, const uint32_t *indices, size_t n,
+                               const float *dense, float *out)
+{
+    for (size_t p = 0; p < n; ++p)
+    {
+        out[p] += alpha * dense[indices[p]];
+    }
+}
+
+#if defined(TTIE_X86_KERNELS)
+// sparse_dot и sparse_gather_axpy на AVX2: 8 элементов dense за раз
+// собираются gather
+__attribute__((target("avx2,fma"))) inline float
+sparse_dot_avx2(const float *values, const uint32_t *indices, size_t n,
+                const float *dense)
+{
+    __m256 acc = _mm256_setzero_ps();
+    size_t p = 0;
+    for (; p + 8 <= n; p += 8)
+    {
+        const __m256i index =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + p));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(values + p),
+                              _mm256_i32gather_ps(dense, index, 4), acc);
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc),
+                             _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    float sum = _mm_cvtss_f32(half);
+    for (; p < n; ++p)
+    {
+        sum += values[p] * dense[indices[p]];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) inline void
+sparse_gather_axpy_avx2(float alpha, const uint32_t *indices, size_t n,
+                        const float *dense, float *out)
+{
+    const __m256 scale = _mm256_set1_ps(alpha);
+    size_t p = 0;
+    for (; p + 8 <= n; p += 8)
+    {
+        const __m256i index =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + p));
+        _mm256_storeu_ps(out + p,
+                         _mm256_fmadd_ps(scale,
+                                         _mm256_i32gather_ps(dense, index, 4),
+                                         _mm256_loadu_ps(out + p)));
+    }
+    for (; p < n; ++p)
+    {
+        out[p] += alpha * dense[indices[p]];
+    }
+}
+
+inline bool cpu_has_avx2()
+{
+    static const bool supported =
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+}
+#endif
+
+// Linear с разреженными весами (после прунинга). Ненулевые веса хранятся
+// в CSR по выходным каналам: строка j - пары (k, w[k][j]), значения -
+// обучаемый параметр values, нули остаются нулями. Forward и градиент по
+// входу - разреженные скалярные произведения (sparse_dot); для градиента
+// по входу тот же шаблон хранится и по входным каналам. Градиент values
+// накапливается sparse_gather_axpy по строкам батча
+struct SparseLinear : Layer
+{
+    size_t in_features = 0;
+    size_t out_features = 0;
+
+    std::vector<size_t> row_offsets; // [out_features + 1]
+    std::vector<uint32_t> columns;   // входной канал k
+    Tensor values;                   // [nnz]
+    Tensor bias;
+
+    // Шаблон по входным каналам: для k - выходные каналы и позиции в values
+    std::vector<size_t> input_offsets; // [in_features + 1]
+    std::vector<uint32_t> input_columns;
+    std::vector<size_t> input_order;
+    Storage<float> input_values;
+
+    // Сохраняет веса с |w| > threshold
+    explicit SparseLinear(const Linear &linear, float threshold = 0.0f)
+        : in_features(linear.weight.shape[0]),
+          out_features(linear.weight.shape[1])
+    {
+        const float *w = linear.weight.data.data();
+        std::vector<float> kept;
+        row_offsets.assign(out_features + 1, 0);
+        input_offsets.assign(in_features + 1, 0);
+        for (size_t j = 0; j < out_features; ++j)
+        {
+            for (size_t k = 0; k < in_features; ++k)
+            {
+                if (std::fabs(w[k * out_features + j]) > threshold)
+                {
+                    columns.push_back(static_cast<uint32_t>(k));
+                    kept.push_back(w[k * out_features + j]);
+                    ++input_offsets[k + 1];
+                }
+            }
+            row_offsets[j + 1] = columns.size();
+        }
+
+        std::partial_sum(input_offsets.begin(), input_offsets.end(),
+                         input_offsets.begin());
+        input_columns.resize(columns.size());
+        input_order.resize(columns.size());
+        std::vector<size_t> fill(input_offsets.begin(), input_offsets.end() - 1);
+        for (size_t j = 0; j < out_features; ++j)
+        {
+            for (size_t p = row_offsets[j]; p < row_offsets[j + 1]; ++p)
+            {
+                const size_t q = fill[columns[p]]++;
+                input_columns[q] = static_cast<uint32_t>(j);
+                input_order[q] = p;
+            }
+        }
+
+        values.shape = {kept.size()};
+        values.requires_grad = linear.weight.requires_grad;
+        values.data = kept;
+        bias = linear.bias.copy();
+    }
+
+    size_t nnz() const { return columns.size(); }
+
+    // Доля нулевых весов
+    float sparsity() const
+    {
+        return 1.0f - static_cast<float>(nnz()) /
+                          static_cast<float>(in_features * out_features);
+    }
+
+    // Плотные веса [in_features, out_features]
+    Tensor dense_weight() const
+    {
+        Tensor result;
+        result.shape = {in_features, out_features};
+        result.resize();
+        std::fill(result.data.begin(), result.data.end(), 0.0f);
+        for (size_t j = 0; j < out_features; ++j)
+        {
+            for (size_t p = row_offsets[j]; p < row_offsets[j + 1]; ++p)
+            {
+                result.data[columns[p] * out_features + j] = values.data[p];
+            }
+        }
+        return result;
+    }
+
+    std::vector<Tensor *> parameters() override { return {&values, &bias}; }
+
+    std::vector<size_t>
+    output_shape(const std::vector<size_t> &input_shape) const override
+    {
+        if (input_shape.size() != 2 || input_shape[1] != in_features)
+        {
+            throw std::invalid_argument("SparseLinear expects [batch, in_features]");
+        }
+        return {input_shape[0], out_features};
+    }
+
+    // Выходы (i, j) независимы: потоки делят все batch * out_features
+    // выходов, так что при batch = 1 работа тоже распределяется
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            forward(input.to(DType::Float32), output);
+            return;
+        }
+        output.shape = output_shape(input.shape);
+        output.resize();
+        const size_t batch = input.shape[0];
+        parallel_for(0, batch * out_features,
+                     parallel_grain(std::max<size_t>(1, nnz() / out_features)),
+                     [&](size_t first, size_t last) {
+            for (size_t t = first; t < last; ++t)
+            {
+                const size_t i = t / out_features;
+                const size_t j = t % out_features;
+                const size_t begin = row_offsets[j];
+                output.data[t] =
+                    bias.data[j] +
+                    dot(values.data.data() + begin, columns.data() + begin,
+                        row_offsets[j + 1] - begin,
+                        input.data.data() + i * in_features);
+            }
+        });
+    }
+
+    void backward(const Tensor &output, Tensor &input) override
+    {
+        if (input.dtype != DType::Float32)
+        {
+            throw std::invalid_argument(
+                "SparseLinear backward requires float32 input");
+        }
+        const size_t batch = output.shape[0];
+
+        if (input.requires_grad)
+        {
+            input_values.resize(nnz());
+            for (size_t q = 0; q < nnz(); ++q)
+            {
+                input_values[q] = values.data[input_order[q]];
+            }
+            input.resize_grad();
+            parallel_for(0, batch * in_features,
+                         parallel_grain(std::max<size_t>(1, nnz() / in_features)),
+                         [&](size_t first, size_t last) {
+                for (size_t t = first; t < last; ++t)
+                {
+                    const size_t i = t / in_features;
+                    const size_t k = t % in_features;
+                    const size_t begin = input_offsets[k];
+                    input.grad[t] =
+                        dot(input_values.data() + begin,
+                            input_columns.data() + begin,
+                            input_offsets[k + 1] - begin,
+                            output.grad.data() + i * out_features);
+                }
+            });
+        }
+
+        // Каждая позиция values принадлежит одному выходному каналу: потоки
+        // делят каналы, порядок суммирования по батчу фиксирован
+        if (values.requires_grad)
+        {
+            values.resize_grad();
+            parallel_for(0, out_features,
+                         parallel_grain(batch *
+                                        std::max<size_t>(1, nnz() / out_features)),
+                         [&](size_t first, size_t last) {
+                for (size_t j = first; j < last; ++j)
+                {
+                    const size_t begin = row_offsets[j];
+                    for (size_t i = 0; i < batch; ++i)
+                    {
+                        axpy(output.grad[i * out_features + j],
+                             columns.data() + begin, row_offsets[j + 1] - begin,
+                             input.data.data() + i * in_features,
+                             values.grad.data() + begin);
+                    }
+                }
+            });
+        }
+
+        if (bias.requires_grad)
+        {
+            bias.resize_grad();
+            for (size_t i = 0; i < batch; ++i)
+            {
+                for (size_t j = 0; j < out_features; ++j)
+                {
+                    bias.grad[j] += output.grad[i * out_features + j];
+                }
+            }
+        }
+    }
+
+    Layer *clone() const override { return new SparseLinear(*this); }
+
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return input_shape[0] * std::max<size_t>(1, nnz());
+    }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "SparseLinear(in_features=" << in_features
+           << ", out_features=" << out_features << ", nnz=" << nnz() << ")";
+        return ss.str();
+    }
+
+  private:
+    static float dot(const float *values, const uint32_t *indices, size_t n,
+                     const float *dense)
+    {
+#if defined(TTIE_X86_KERNELS)
+        if (cpu_has_avx2())
+        {
+            return sparse_dot_avx2(values, indices, n, dense);
+        }
+#endif
+        return sparse_dot(values, indices, n, dense);
+    }
+
+    static void axpy(float alpha, const uint32_t *indices, size_t n,
+                     const float *dense, float *out)
+    {
+#if defined(TTIE_X86_KERNELS)
+        if (cpu_has_avx2())
+        {
+            sparse_gather_axpy_avx2(alpha, indices, n, dense, out);
+            return;
+        }
+#endif
+        sparse_gather_axpy(alpha, indices, n, dense, out);
+    }
+};
+
+// Обнуляет долю sparsity весов Linear с наименьшими |w|. Возвращает
+// число обнуленных весов
+inline size_t prune_by_magnitude(Linear &linear, float sparsity)
+{
+    Storage<float> &w = linear.weight.data;
+    const size_t count = std::min(
+        w.size(), static_cast<size_t>(std::nearbyint(sparsity * w.size())));
+    std::vector<size_t> order(w.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::nth_element(order.begin(), order.begin() + count, order.end(),
+                     [&](size_t a, size_t b) {
+                         return std::fabs(w[a]) < std::fabs(w[b]);
+                     });
+    for (size_t i = 0; i < count; ++i)
+    {
+        w[order[i]] = 0.0f;
+    }
+    linear.parameters_changed();
+    return count;
+}
+
+// План размещения промежуточных активаций Model в одной арене.
+// Активация i - выход слоя i, живет с шага i по шаг i + 1
+struct MemoryPlan
+{
+    // Смещения выравниваются на 16 float (64 байта)
+    static constexpr size_t kAlignment = 16;
+
+    std::vector<size_t> input_shape;
+    std::vector<std::vector<size_t>> shapes;
+    std::vector<size_t> sizes;
+    std::vector<size_t> first_use;
+    std::vector<size_t> last_use;
+    std::vector<size_t> offsets;
+    size_t arena_size = 0; // элементов в арене (пиковое потребление)
+    size_t naive_size = 0; // сумма размеров всех активаций
+
+    size_t peak_bytes() const { return arena_size * sizeof(float); }
+    size_t naive_bytes() const { return naive_size * sizeof(float); }
+
+    // Жадное размещение: буферы по убыванию размера ставятся в первый
+    // подходящий промежуток среди пересекающихся по времени жизни
+    void assign_offsets()
+    {
+        std::vector<size_t> order(sizes.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+        offsets.assign(sizes.size(), 0);
+        arena_size = 0;
+        std::vector<size_t> placed;
+        for (size_t b : order)
+        {
+            std::vector<size_t> live;
+            for (size_t p : placed)
+            {
+                if (first_use[p] <= last_use[b] && first_use[b] <= last_use[p])
+                {
+                    live.push_back(p);
+                }
+            }
+            std::sort(live.begin(), live.end(),
+                      [&](size_t x, size_t y) { return offsets[x] < offsets[y]; });
+
+            size_t offset = 0;
+            for (size_t p : live)
+            {
+                if (offset + sizes[b] <= offsets[p])
+                {
+                    break;
+                }
+                size_t end = offsets[p] + sizes[p];
+                end = (end + kAlignment - 1) / kAlignment * kAlignment;
+                offset = std::max(offset, end);
+            }
+            offsets[b] = offset;
+            arena_size = std::max(arena_size, offset + sizes[b]);
+            placed.push_back(b);
+        }
+    }
+
+    std::string to_string() const
+    {
+        std::stringstream ss;
+        ss << "MemoryPlan(activations=" << sizes.size()
+           << ", peak_bytes=" << peak_bytes()
+           << ", naive_bytes=" << naive_bytes() << ")";
+        return ss.str();
+    }
+};
+
+// Общая память параметров: данные и градиенты списка тензоров переносятся
+// в два непрерывных буфера в порядке списка, тензоры становятся их
+// представлениями. Градиенты выделяются сразу и заполняются нулями.
+// Тензоры, которые при уничтожении арены все еще указывают в ее буферы,
+// снова получают собственную память
+class ParameterArena
+{
+  public:
+    // include_data = false - в арену переносятся только градиенты
+    explicit ParameterArena(const std::vector<Tensor *> &parameters,
+                            bool include_data = true)
+        : params(parameters), with_data(include_data)
+    {
+        size_t total = 0;
+        for (Tensor *param : params)
+        {
+            offsets.push_back(total);
+            total += param->data.size();
+        }
+        if (with_data)
+        {
+            data_.resize(total);
+        }
+        grad_.resize(total);
+
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            Tensor *param = params[k];
+            const size_t n = param->data.size();
+            if (with_data)
+            {
+                std::copy(param->data.begin(), param->data.end(),
+                          data_.begin() + offsets[k]);
+                param->data.rebind(data_.data() + offsets[k], n);
+            }
+            if (param->grad.size() == n)
+            {
+                std::copy(param->grad.begin(), param->grad.end(),
+                          grad_.begin() + offsets[k]);
+            }
+            param->grad.rebind(grad_.data() + offsets[k], n);
+        }
+    }
+
+    ~ParameterArena()
+    {
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            Tensor *param = params[k];
+            if (with_data && param->data.data() == data_.data() + offsets[k])
+            {
+                param->data = Storage<float>(param->data);
+            }
+            if (param->grad.data() == grad_.data() + offsets[k])
+            {
+                param->grad = Storage<float>(param->grad);
+            }
+        }
+    }
+
+    ParameterArena(const ParameterArena &) = delete;
+    ParameterArena &operator=(const ParameterArena &) = delete;
+
+    // Забывает тензоры (например, перед их удалением): деструктор их не
+    // трогает
+    void detach() { params.clear(); }
+
+    const std::vector<Tensor *> &parameters() const { return params; }
+
+    // Пусто при include_data = false
+    Storage<float> &data() { return data_; }
+    Storage<float> &grad() { return grad_; }
+
+    size_t size() const { return grad_.size(); }
+
+    // Данные и градиенты параметров уже лежат подряд в порядке списка
+    // (например, в арене Model)
+    static bool is_contiguous(const std::vector<Tensor *> &parameters)
+    {
+        if (parameters.empty())
+        {
+            return false;
+        }
+        const float *data = parameters[0]->data.data();
+        const float *grad = parameters[0]->grad.data();
+        for (Tensor *param : parameters)
+        {
+            if (param->grad.size() != param->data.size() ||
+                param->data.data() != data || param->grad.data() != grad)
+            {
+                return false;
+            }
+            data += param->data.size();
+            grad += param->grad.size();
+        }
+        return true;
+    }
+
+  private:
+    std::vector<Tensor *> params;
+    std::vector<size_t> offsets;
+    bool with_data;
+    Storage<float> data_;
+    Storage<float> grad_;
+};
+
+struct Model
+{
+    std::vector<Layer *> layers;
+    std::vector<Tensor> activations;
+
+    // Активный план инференса: activations - представления арены
+    MemoryPlan plan;
+    Storage<float> arena;
+    bool planned = false;
+
+    // activations заполнены forward с градиентами и пригодны для backward
+    bool activations_saved = false;
+
+    // Два буфера, по очереди используемые forward без градиентов
+    Tensor ping_pong[2];
+
+    // Gradient checkpointing: индексы слоев, выходы которых сохраняются
+    // (границы сегментов). Остальные активации пересчитываются по
+    // сегментам во время backward. Пустой список - checkpointing выключен.
+    // Слои с running-статистиками (BatchNorm) обновляют их и при пересчете
+    std::vector<size_t> checkpoints;
+    bool checkpointed_forward = false;
+
+    // Смешанная точность: сохраненные для backward активации хранятся в
+    // bf16/fp16 (packed_activations), во float они восстанавливаются
+    // только на время backward соседних слоев. Действует для обычного
+    // forward с градиентами
+    Precision activation_precision = Precision::Float32;
+    std::vector<Storage<uint16_t>> packed_activations;
+
+    // Общая арена параметров (flatten_parameters), пусто - каждый параметр
+    // в своей памяти
+    std::unique_ptr<ParameterArena> param_arena;
+
+    // Хуки после backward слоя: вызываются с индексом слоя, как только
+    // градиенты его параметров окончательны
+    using BackwardHook = std::function<void(size_t)>;
+    std::vector<std::pair<size_t, BackwardHook>> backward_hooks;
+
+    // Хуки после forward слоя: индекс слоя, его вход и выход. Пересчет
+    // forward при checkpointing их не вызывает
+    using ForwardHook =
+        std::function<void(size_t, const Tensor &, const Tensor &)>;
+    std::vector<std::pair<size_t, ForwardHook>> forward_hooks;
+    size_t next_hook_id = 0;
+
+    void add_layer(Layer *layer)
+    {
+        layers.push_back(layer);
+        if (param_arena)
+        {
+            flatten_parameters();
+        }
+    }
+
+    // Переносит данные и градиенты всех параметров в две непрерывные арены
+    // в порядке parameters(). Optimizer, zero_grad, all-reduce DataParallel
+    // и save/load_parameters работают с аренами одним проходом. Параметры
+    // слоев, добавленных позже, тоже попадают в арену. Повторный вызов
+    // переносит параметры в новую арену: представления старой (кроме
+    // самих параметров) становятся недействительны, созданные ранее
+    // оптимизаторы находят новую память сами
+    void flatten_parameters()
+    {
+        std::vector<Tensor *> params = parameters();
+        param_arena.reset();
+        param_arena.reset(new ParameterArena(params));
+    }
+
+    // Возвращает параметрам собственную память
+    void unflatten_parameters() { param_arena.reset(); }
+
+    bool has_flat_parameters() const { return param_arena != nullptr; }
+
+    // Возвращает идентификатор для remove_backward_hook
+    size_t add_backward_hook(BackwardHook hook)
+    {
+        backward_hooks.emplace_back(next_hook_id, std::move(hook));
+        return next_hook_id++;
+    }
+
+    void remove_backward_hook(size_t id)
+    {
+        backward_hooks.erase(
+            std::remove_if(backward_hooks.begin(), backward_hooks.end(),
+                           [id](const std::pair<size_t, BackwardHook> &hook) {
+                               return hook.first == id;
+                           }),
+            backward_hooks.end());
+    }
+
+    void run_backward_hooks(size_t layer)
+    {
+        for (const std::pair<size_t, BackwardHook> &hook : backward_hooks)
+        {
+            hook.second(layer);
+        }
+    }
+
+    // Возвращает идентификатор для remove_forward_hook
+    size_t add_forward_hook(ForwardHook hook)
+    {
+        forward_hooks.emplace_back(next_hook_id, std::move(hook));
+        return next_hook_id++;
+    }
+
+    void remove_forward_hook(size_t id)
+    {
+        forward_hooks.erase(
+            std::remove_if(forward_hooks.begin(), forward_hooks.end(),
+                           [id](const std::pair<size_t, ForwardHook> &hook) {
+                               return hook.first == id;
+                           }),
+            forward_hooks.end());
+    }
+
+    void run_forward_hooks(size_t layer, const Tensor &input,
+                           const Tensor &output)
+    {
+        for (const std::pair<size_t, ForwardHook> &hook : forward_hooks)
+        {
+            hook.second(layer, input, output);
+        }
+    }
+
+    void zero_grad()
+    {
+        if (param_arena)
+        {
+            Storage<float> &grad = param_arena->grad();
+            std::fill(grad.begin(), grad.end(), 0.0f);
+            return;
+        }
+        for (Tensor *param : parameters())
+        {
+            param->zero_grad();
+        }
+    }
+
+    void train(bool mode = true)
+    {
+        if (mode)
+        {
+            release_plan();
+        }
+        for (Layer *layer : layers)
+        {
+            layer->train(mode);
+        }
+    }
+
+    void eval() { train(false); }
+
+    // Точность хранения активаций и весов слоев (set_precision слоев).
+    // Основные веса для оптимизатора остаются во float
+    void set_precision(Precision precision)
+    {
+        activation_precision = precision;
+        for (Layer *layer : layers)
+        {
+            layer->set_precision(precision);
+        }
+    }
+
+    // Переводит модель в eval и размещает копии весов слоев на каждом узле
+    // NUMA. На машине с одним узлом ничего не делает
+    void replicate_for_numa()
+    {
+        eval();
+        for (Layer *layer : layers)
+        {
+            layer->replicate_for_numa();
+        }
+    }
+
+    // Выводит формы активаций для входа формы input_shape, их времена
+    // жизни и размещение в арене
+    MemoryPlan plan_memory(const std::vector<size_t> &input_shape) const
+    {
+        MemoryPlan result;
+        result.input_shape = input_shape;
+        std::vector<size_t> shape = input_shape;
+        for (size_t i = 0; i + 1 < layers.size(); ++i)
+        {
+            shape = layers[i]->output_shape(shape);
+            size_t size = 1;
+            for (size_t dim : shape)
+            {
+                size *= dim;
+            }
+            result.shapes.push_back(shape);
+            result.sizes.push_back(size);
+            result.first_use.push_back(i);
+            result.last_use.push_back(i + 1);
+            result.naive_size += size;
+        }
+        result.assign_offsets();
+        return result;
+    }
+
+    // Переводит модель в eval и размещает активации в одной арене по
+    // плану для входа формы input_shape. План действует, пока форма входа
+    // не изменится или модель не вернется в train()
+    const MemoryPlan &plan_inference(const std::vector<size_t> &input_shape)
+    {
+        eval();
+        plan = plan_memory(input_shape);
+        arena = Storage<float>(plan.arena_size);
+        activations.assign(plan.sizes.size(), Tensor());
+        for (size_t i = 0; i < plan.sizes.size(); ++i)
+        {
+            activations[i].shape = plan.shapes[i];
+            activations[i].data.rebind(arena.data() + plan.offsets[i],
+                                       plan.sizes[i]);
+        }
+        planned = true;
+        return plan;
+    }
+
+    void release_plan()
+    {
+        if (!planned)
+        {
+            return;
+        }
+        planned = false;
+        activations_saved = false;
+        activations.clear();
+        packed_activations.clear();
+        arena = Storage<float>();
+        plan = MemoryPlan();
+    }
+
+    void forward(const Tensor &input, Tensor &output)
+    {
+        if (planned && input.shape != plan.input_shape)
+        {
+            release_plan();
+        }
+        if (!planned && !is_grad_enabled())
+        {
+            forward_no_grad(input, output);
+            return;
+        }
+        if (!planned && !checkpoints.empty())
+        {
+            forward_checkpointed(input, output);
+            return;
+        }
+        checkpointed_forward = false;
+        activations_saved = !planned;
+        activations.resize(layers.size() - 1);
+        packed_activations.assign(activations.size(), Storage<uint16_t>());
+        const bool pack =
+            activations_saved && activation_precision != Precision::Float32;
+
+        const Tensor *current = &input;
+        for (size_t i = 0; i < layers.size(); ++i)
+        {
+            Tensor *next = (i == layers.size() - 1) ? &output : &activations[i];
+            layers[i]->forward(*current, *next);
+            run_forward_hooks(i, *current, *next);
+            // Вход слоя i больше не нужен forward
+            if (pack && i > 0)
+            {
+                pack_activation(i - 1);
+            }
+            current = next;
+        }
+        // Градиент нужен только промежуточным выходам обучаемого прохода
+        for (Tensor &activation : activations)
+        {
+            activation.requires_grad = activations_saved;
+        }
+    }
+
+    // Forward без градиентов: промежуточные выходы не сохраняются, слои
+    // пишут попеременно в два буфера, память которых переиспользуется
+    void forward_no_grad(const Tensor &input, Tensor &output)
+    {
+        activations.clear();
+        packed_activations.clear();
+        activations_saved = false;
+
+        const Tensor *current = &input;
+        for (size_t i = 0; i < layers.size(); ++i)
+        {
+            Tensor *next = (i == layers.size() - 1) ? &output : &ping_pong[i % 2];
+            layers[i]->forward(*current, *next);
+            run_forward_hooks(i, *current, *next);
+            current = next;
+        }
+    }
+
+    // Сохраняет выходы слоев с заданными индексами (последний слой не
+    // учитывается). Пустой список выключает checkpointing
+    void set_checkpoints(std::vector<size_t> layer_indices)
+    {
+        std::sort(layer_indices.begin(), layer_indices.end());
+        layer_indices.erase(
+            std::unique(layer_indices.begin(), layer_indices.end()),
+            layer_indices.end());
+        while (!layer_indices.empty() &&
+               layer_indices.back() + 1 >= layers.size())
+        {
+            layer_indices.pop_back();
+        }
+        checkpoints = layer_indices;
+    }
+
+    // Сегменты по k слоев: сохраняются выходы слоев k-1, 2k-1, ...
+    void checkpoint_every(size_t k)
+    {
+        std::vector<size_t> indices;
+        for (size_t i = k; k > 0 && i < layers.size(); i += k)
+        {
+            indices.push_back(i - 1);
+        }
+        set_checkpoints(indices);
+    }
+
+    // Байты, удерживаемые activations после forward
+    size_t activation_bytes() const
+    {
+        size_t bytes = 0;
+        for (const Tensor &activation : activations)
+        {
+            bytes += activation.data.size() * sizeof(float);
+        }
+        for (const Storage<uint16_t> &packed : packed_activations)
+        {
+            bytes += packed.size() * sizeof(uint16_t);
+        }
+        return bytes;
+    }
+
+    void pack_activation(size_t i)
+    {
+        Tensor &activation = activations[i];
+        packed_activations[i].resize(activation.data.size());
+        convert_to_half(activation.data.data(), packed_activations[i].data(),
+                        activation.data.size(), activation_precision);
+        activation.data = Storage<float>();
+    }
+
+    // Восстанавливает данные активации во float (упакованная копия
+    // остается для повторного backward)
+    void unpack_activation(size_t i)
+    {
+        Tensor &activation = activations[i];
+        const Storage<uint16_t> &packed = packed_activations[i];
+        if (packed.empty() || activation.data.size() == packed.size())
+        {
+            return;
+        }
+        activation.data.resize(packed.size());
+        convert_from_half(packed.data(), activation.data.data(), packed.size(),
+                          activation_precision);
+    }
+
+    void backward(const Tensor &output, Tensor &input)
+    {
+        if (planned)
+        {
+            throw std::runtime_error(
+                "Backward is not available in planned inference mode");
+        }
+        if (!activations_saved || activations.size() != layers.size() - 1)
+        {
+            throw std::runtime_error(
+                "Forward pass must be called before backward pass");
+        }
+        if (checkpointed_forward)
+        {
+            backward_checkpointed(output, input);
+            return;
+        }
+
+        const Tensor *current = &output;
+        for (int i = layers.size() - 1; i >= 0; --i)
+        {
+            Tensor *prev = (i > 0) ? &activations[i - 1] : &input;
+            if (i > 0)
+            {
+                unpack_activation(i - 1);
+            }
+            layers[i]->backward(*current, *prev);
+            run_backward_hooks(i);
+            // Выход слоя i больше не нужен backward
+            if (i + 1 < static_cast<int>(layers.size()) &&
+                !packed_activations[i].empty())
+            {
+                activations[i].data = Storage<float>();
+            }
+            current = prev;
+        }
+    }
+
+    bool is_checkpoint(size_t i) const
+    {
+        return std::binary_search(checkpoints.begin(), checkpoints.end(), i);
+    }
+
+    // Forward без сохранения состояния слоев: хранятся только выходы на
+    // границах сегментов, остальные пишутся в ping_pong
+    void forward_checkpointed(const Tensor &input, Tensor &output)
+    {
+        packed_activations.clear();
+        activations.resize(layers.size() - 1);
+        for (size_t i = 0; i + 1 < layers.size(); ++i)
+        {
+            if (!is_checkpoint(i))
+            {
+                activations[i] = Tensor();
+            }
+            activations[i].requires_grad = true;
+        }
+
+        {
+            NoGradGuard no_grad;
+            const Tensor *current = &input;
+            for (size_t i = 0; i < layers.size(); ++i)
+            {
+                Tensor *next = &output;
+                if (i + 1 < layers.size())
+                {
+                    next = is_checkpoint(i) ? &activations[i] : &ping_pong[i % 2];
+                }
+                layers[i]->forward(*current, *next);
+                run_forward_hooks(i, *current, *next);
+                current = next;
+            }
+        }
+        ping_pong[0] = Tensor();
+        ping_pong[1] = Tensor();
+        activations_saved = true;
+        checkpointed_forward = true;
+    }
+
+    // Backward по сегментам с конца: сегмент пересчитывается от своей
+    // входной границы с сохранением состояния слоев, затем по нему
+    // выполняется обычный backward
+    void backward_checkpointed(const Tensor &output, Tensor &input)
+    {
+        const size_t last = layers.size() - 1;
+        size_t end = last;
+        while (true)
+        {
+            size_t start = 0;
+            for (size_t c : checkpoints)
+            {
+                if (c < end)
+                {
+                    start = c + 1;
+                }
+            }
+
+            Tensor &segment_input = start == 0 ? input : activations[start - 1];
+            // Выходы слоев start..end-1, последний - выход слоя end
+            std::vector<Tensor> recomputed(end - start + 1);
+            const Tensor *current = &segment_input;
+            for (size_t i = start; i <= end; ++i)
+            {
+                layers[i]->forward(*current, recomputed[i - start]);
+                recomputed[i - start].requires_grad = true;
+                current = &recomputed[i - start];
+            }
+
+            const Tensor *grad_source =
+                end == last ? &output : &activations[end];
+            for (size_t i = end + 1; i-- > start;)
+            {
+                Tensor *prev = i == start ? &segment_input
+                                          : &recomputed[i - start - 1];
+                layers[i]->backward(*grad_source, *prev);
+                run_backward_hooks(i);
+                grad_source = prev;
+            }
+
+            if (start == 0)
+            {
+                break;
+            }
+            end = start - 1;
+        }
+    }
+
+    // Оптимизация для инференса: переводит модель в eval и встраивает слои
+    // (например, BatchNorm1d после Linear) в предыдущие. Возвращает число
+    // удаленных слоев
+    size_t fuse_for_inference()
+    {
+        eval();
+        // Параметры встроенных слоев удаляются вместе со слоями
+        const bool flat = has_flat_parameters();
+        unflatten_parameters();
+        size_t fused = 0;
+        for (size_t i = 1; i < layers.size();)
+        {
+            if (layers[i]->fuse_into(*layers[i - 1]))
+            {
+                delete layers[i];
+                layers.erase(layers.begin() + i);
+                ++fused;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        release_plan();
+        activations.clear();
+        packed_activations.clear();
+        activations_saved = false;
+        if (flat)
+        {
+            flatten_parameters();
+        }
+        return fused;
+    }
+
+    // Заменяет слои Linear, в которых доля нулевых весов не меньше
+    // min_sparsity (например, после prune_by_magnitude), на SparseLinear.
+    // Наследники Linear с особым forward не меняются. Возвращает число
+    // замененных слоев
+    size_t sparsify(float min_sparsity = 0.8f)
+    {
+        const bool flat = has_flat_parameters();
+        unflatten_parameters();
+        size_t converted = 0;
+        for (Layer *&layer : layers)
+        {
+            if (typeid(*layer) != typeid(Linear))
+            {
+                continue;
+            }
+            Linear *linear = static_cast<Linear *>(layer);
+            const size_t zeros = static_cast<size_t>(
+                std::count(linear->weight.data.begin(),
+                           linear->weight.data.end(), 0.0f));
+            if (zeros < min_sparsity * linear->weight.data.size())
+            {
+                continue;
+            }
+            SparseLinear *sparse = new SparseLinear(*linear);
+            sparse->train(linear->training);
+            delete layer;
+            layer = sparse;
+            ++converted;
+        }
+        release_plan();
+        activations.clear();
+        packed_activations.clear();
+        activations_saved = false;
+        if (flat)
+        {
+            flatten_parameters();
+        }
+        return converted;
+    }
+
+    std::vector<Tensor *> parameters()
+    {
+        if (param_arena)
+        {
+            return param_arena->parameters();
+        }
+        std::vector<Tensor *> params;
+        for (Layer *layer : layers)
+        {
+            auto layer_params = layer->parameters();
+            params.insert(params.end(), layer_params.begin(),
+                          layer_params.end());
+        }
+        return params;
+    }
+
+    static void write_floats(std::ostream &out, const Storage<float> &values)
+    {
+        out.write(reinterpret_cast<const char *>(values.data()),
+                  values.size() * sizeof(float));
+    }
+
+    static void read_floats(std::istream &in, Storage<float> &values)
+    {
+        in.read(reinterpret_cast<char *>(values.data()),
+                values.size() * sizeof(float));
+    }
+
+    // Двоичный формат: число элементов (uint64_t), затем данные параметров
+    // в порядке parameters()
+    void save_parameters(std::ostream &out)
+    {
+        std::vector<Tensor *> params = parameters();
+        uint64_t count = 0;
+        for (Tensor *param : params)
+        {
+            count += param->data.size();
+        }
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        if (param_arena)
+        {
+            write_floats(out, param_arena->data());
+        }
+        else
+        {
+            for (Tensor *param : params)
+            {
+                write_floats(out, param->data);
+            }
+        }
+        if (!out)
+        {
+            throw std::runtime_error("Failed to write parameters");
+        }
+    }
+
+    void load_parameters(std::istream &in)
+    {
+        std::vector<Tensor *> params = parameters();
+        uint64_t expected = 0;
+        for (Tensor *param : params)
+        {
+            expected += param->data.size();
+        }
+        uint64_t count = 0;
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
+        if (!in || count != expected)
+        {
+            throw std::runtime_error("Parameter count mismatch: expected " +
+                                     std::to_string(expected));
+        }
+        if (param_arena)
+        {
+            read_floats(in, param_arena->data());
+        }
+        else
+        {
+            for (Tensor *param : params)
+            {
+                read_floats(in, param->data);
+            }
+        }
+        if (!in)
+        {
+            throw std::runtime_error("Failed to read parameters");
+        }
+        for (Layer *layer : layers)
+        {
+            layer->parameters_changed();
+        }
+    }
+
+    std::string to_string() const
+    {
+        std::stringstream ss;
+        for (Layer *layer : layers)
+        {
+            ss << layer->to_string() << "\n";
+        }
+        return ss.str();
+    }
+
+    ~Model()
+    {
+        if (param_arena)
+        {
+            param_arena->detach();
+        }
+        for (Layer *layer : layers)
+        {
+            delete layer;
+        }
+    }
+};
+
+// Способ выбора диапазона активаций при калибровке
+enum class Calibration
+{
+    MinMax,
+    Histogram
+};
+
+// Квантизация обученной модели в int8 после обучения. Пока объект жив,
+// forward-хук модели передает входы слоев Linear наблюдателям;
+// calibrate прогоняет калибровочный батч через Model::forward.
+// quantized_model строит новую модель, в которой Linear заменены на
+// QuantizedLinear, остальные слои скопированы. Наследники Linear с особым
+// forward (QATLinear, BinaryLinear) не квантуются, а копируются
+class Int8Quantizer
+{
+  public:
+    explicit Int8Quantizer(Model &model,
+                           Calibration calibration = Calibration::Histogram)
+        : model(model), calibration(calibration)
+    {
+        hook_id = model.add_forward_hook(
+            [this](size_t layer, const Tensor &input, const Tensor &) {
+                observe(layer, input);
+            });
+    }
+
+    Int8Quantizer(const Int8Quantizer &) = delete;
+    Int8Quantizer &operator=(const Int8Quantizer &) = delete;
+
+    ~Int8Quantizer() { model.remove_forward_hook(hook_id); }
+
+    // Forward в режиме eval без градиентов, режим модели восстанавливается
+    void calibrate(const Tensor &batch)
+    {
+        std::vector<bool> modes;
+        for (Layer *layer : model.layers)
+        {
+            modes.push_back(layer->training);
+            layer->train(false);
+        }
+        {
+            NoGradGuard no_grad;
+            Tensor output;
+            model.forward(batch, output);
+        }
+        for (size_t i = 0; i < model.layers.size(); ++i)
+        {
+            model.layers[i]->train(modes[i]);
+        }
+    }
+
+    // Калибровочный диапазон входа слоя layer
+    std::pair<float, float> input_range(size_t layer) const
+    {
+        if (layer >= observers.size() || !observers[layer])
+        {
+            throw std::logic_error("Layer " + std::to_string(layer) +
+                                   " was not calibrated");
+        }
+        return observers[layer]->range();
+    }
+
+    std::unique_ptr<Model> quantized_model() const
+    {
+        std::unique_ptr<Model> result(new Model());
+        for (size_t i = 0; i < model.layers.size(); ++i)
+        {
+            const Layer *layer = model.layers[i];
+            if (typeid(*layer) == typeid(Linear))
+            {
+                std::pair<float, float> range = input_range(i);
+                result->add_layer(new QuantizedLinear(
+                    *static_cast<const Linear *>(layer), range.first,
+                    range.second));
+                continue;
+            }
+            Layer *copy = layer->clone();
+            if (!copy)
+            {
+                throw std::logic_error("Layer " + layer->to_string() +
+                                       " cannot be copied for quantization");
+            }
+            result->add_layer(copy);
+        }
+        result->eval();
+        return result;
+    }
+
+  private:
+    void observe(size_t layer, const Tensor &input)
+    {
+        if (typeid(*model.layers[layer]) != typeid(Linear))
+        {
+            return;
+        }
+        if (observers.size() < model.layers.size())
+        {
+            observers.resize(model.layers.size());
+        }
+        if (!observers[layer])
+        {
+            if (calibration == Calibration::MinMax)
+            {
+                observers[layer].reset(new MinMaxObserver());
+            }
+            else
+            {
+                observers[layer].reset(new HistogramObserver());
+            }
+        }
+        if (input.dtype != DType::Float32)
+        {
+            Tensor converted = input.to(DType::Float32);
+            observers[layer]->observe(converted.data.data(), converted.size());
+            return;
+        }
+        observers[layer]->observe(input.data.data(), input.size());
+    }
+
+    Model &model;
+    Calibration calibration;
+    size_t hook_id = 0;
+    std::vector<std::unique_ptr<Observer>> observers;
+};
+
+// Сравнение квантизованной модели с исходной на одном входе
+struct QuantizationReport
+{
+    float max_abs_error = 0;
+    float mean_abs_error = 0;
+    // Норма ошибки, деленная на норму выхода исходной модели
+    float relative_error = 0;
+    size_t float_weight_bytes = 0;
+    size_t quantized_weight_bytes = 0;
+
+    std::string to_string() const
+    {
+        std::stringstream ss;
+        ss << "max_abs_error=" << max_abs_error
+           << ", mean_abs_error=" << mean_abs_error
+           << ", relative_error=" << relative_error
+           << ", weights: " << float_weight_bytes << " -> "
+           << quantized_weight_bytes << " bytes";
+        return ss.str();
+    }
+};
+
+inline QuantizationReport compare_models(Model &reference, Model &quantized,
+                                         const Tensor &input)
+{
+    NoGradGuard no_grad;
+    Tensor expected, actual;
+    reference.forward(input, expected);
+    quantized.forward(input, actual);
+    if (expected.shape != actual.shape)
+    {
+        throw std::invalid_argument("Models produce different output shapes");
+    }
+
+    QuantizationReport report;
+    double error_sum = 0, error_norm = 0, norm = 0;
+    for (size_t i = 0; i < expected.data.size(); ++i)
+    {
+        const double error = std::fabs(actual.data[i] - expected.data[i]);
+        report.max_abs_error =
+            std::max(report.max_abs_error, static_cast<float>(error));
+        error_sum += error;
+        error_norm += error * error;
+        norm += static_cast<double>(expected.data[i]) * expected.data[i];
+    }
+    report.mean_abs_error =
+        static_cast<float>(error_sum / std::max<size_t>(1, expected.data.size()));
+    report.relative_error =
+        norm > 0 ? static_cast<float>(std::sqrt(error_norm / norm)) : 0.0f;
+
+    for (Tensor *param : reference.parameters())
+    {
+        report.float_weight_bytes += param->size() * sizeof(float);
+    }
+    for (Layer *layer : quantized.layers)
+    {
+        if (QuantizedLinear *linear = dynamic_cast<QuantizedLinear *>(layer))
+        {
+            report.quantized_weight_bytes += linear->weight_bytes();
+        }
+        else
+        {
+            for (Tensor *param : layer->parameters())
+            {
+                report.quantized_weight_bytes += param->size() * sizeof(float);
+            }
+        }
+    }
+    return report;
+}
+
+// Модель для QAT: перед каждым Linear вставляется FakeQuantize, сам
+// Linear заменяется на QATLinear, остальные слои (в том числе наследники
+// Linear) копируются
+inline std::unique_ptr<Model> prepare_qat(const Model &model,
+                                          bool learnable_scales = false)
+{
+    std::unique_ptr<Model> result(new Model());
+    for (const Layer *layer : model.layers)
+    {
+        if (typeid(*layer) == typeid(Linear))
+        {
+            result->add_layer(new FakeQuantize(learnable_scales));
+            result->add_layer(new QATLinear(*static_cast<const Linear *>(layer)));
+            continue;
+        }
+        Layer *copy = layer->clone();
+        if (!copy)
+        {
+            throw std::logic_error("Layer " + layer->to_string() +
+                                   " cannot be copied for quantization");
+        }
+        result->add_layer(copy);
+    }
+    return result;
+}
+
+// Модель инференса в int8 из обученной QAT-модели: пара FakeQuantize +
+// QATLinear становится QuantizedLinear с сеткой входа FakeQuantize.
+// Оставшиеся FakeQuantize копируются и продолжают округлять выход
+inline std::unique_ptr<Model> convert_qat(const Model &model)
+{
+    std::unique_ptr<Model> result(new Model());
+    for (size_t i = 0; i < model.layers.size(); ++i)
+    {
+        const Layer *layer = model.layers[i];
+        const FakeQuantize *fake = dynamic_cast<const FakeQuantize *>(layer);
+        const QATLinear *linear =
+            i + 1 < model.layers.size()
+                ? dynamic_cast<const QATLinear *>(model.layers[i + 1])
+                : nullptr;
+        if (fake && linear)
+        {
+            if (!fake->initialized)
+            {
+                throw std::logic_error("FakeQuantize was not trained");
+            }
+            result->add_layer(
+                new QuantizedLinear(*linear, fake->quant_params(),
+                                    fake->unsigned_range));
+            ++i;
+            continue;
+        }
+        if (dynamic_cast<const QATLinear *>(layer))
+        {
+            throw std::logic_error("QATLinear must follow FakeQuantize");
+        }
+        Layer *copy = layer->clone();
+        if (!copy)
+        {
+            throw std::logic_error("Layer " + layer->to_string() +
+                                   " cannot be copied for quantization");
+        }
+        result->add_layer(copy);
+    }
+    result->eval();
+    return result;
+}
+
+// Data-parallel обучение на одном узле: батч делится по первой оси между
+// репликами модели, каждая реплика считает forward/backward своей части в
+// своем потоке пула. Реплика 0 - сама модель, остальные - копии слоев,
+// параметры которых являются представлениями параметров модели. После
+// backward градиенты реплик суммируются в parameters() модели.
+// Статистики BatchNorm считаются по части батча; running-статистики
+// модели обновляет реплика 0
+class DataParallel
+{
+  public:
+    // Размер блока all-reduce: 16 КиБ помещаются в L1 вместе с блоками
+    // реплик
+    static constexpr size_t kAllReduceChunk = 4096;
+
+    DataParallel(Model &model, size_t num_replicas) : model(model)
+    {
+        if (num_replicas == 0)
+        {
+            throw std::invalid_argument("DataParallel needs at least one replica");
+        }
+        for (size_t r = 1; r < num_replicas; ++r)
+        {
+            std::unique_ptr<Model> replica(new Model());
+            for (Layer *layer : model.layers)
+            {
+                Layer *copy = layer->clone();
+                if (!copy)
+                {
+                    throw std::invalid_argument("Layer " + layer->to_string() +
+                                                " does not support clone()");
+                }
+                replica->add_layer(copy);
+            }
+            // Градиенты реплики - одна арена для all-reduce одним проходом
+            for (Tensor *param : replica->parameters())
+            {
+                param->grad = Storage<float>();
+            }
+            replica_grads.emplace_back(
+                new ParameterArena(replica->parameters(), false));
+            replicas.push_back(std::move(replica));
+        }
+    }
+
+    size_t num_replicas() const { return replicas.size() + 1; }
+
+    void forward(const Tensor &input, Tensor &output)
+    {
+        if (input.shape.empty())
+        {
+            throw std::invalid_argument("Input must have a batch dimension");
+        }
+        sync_replicas();
+        split(input);
+
+        const bool grad_enabled = is_grad_enabled();
+        run_shards([&](size_t r, Model &replica) {
+            GradModeGuard grad_mode(grad_enabled);
+            replica.forward(shard_inputs[r], shard_outputs[r]);
+        });
+
+        // Сборка выходов по первой оси
+        output.shape = shard_outputs[0].shape;
+        output.shape[0] = input.shape[0];
+        output.memory_format = shard_outputs[0].memory_format;
+        output.resize();
+        size_t offset = 0;
+        for (size_t r = 0; r < shards; ++r)
+        {
+            const Storage<float> &part = shard_outputs[r].data;
+            std::copy(part.begin(), part.end(), output.data.begin() + offset);
+            offset += part.size();
+        }
+    }
+
+    void backward(const Tensor &output, Tensor &input)
+    {
+        if (shards == 0)
+        {
+            throw std::runtime_error(
+                "Forward pass must be called before backward pass");
+        }
+        size_t offset = 0;
+        for (size_t r = 0; r < shards; ++r)
+        {
+            Tensor &shard = shard_outputs[r];
+            shard.grad.assign(output.grad.begin() + offset,
+                              output.grad.begin() + offset + shard.data.size());
+            offset += shard.data.size();
+        }
+
+        // Градиенты модели окончательны только после all-reduce: хуки
+        // выключаются на время backward реплик и вызываются после него
+        std::vector<std::pair<size_t, Model::BackwardHook>> hooks;
+        hooks.swap(model.backward_hooks);
+        try
+        {
+            run_shards([&](size_t r, Model &replica) {
+                replica.backward(shard_outputs[r], shard_inputs[r]);
+            });
+        }
+        catch (...)
+        {
+            model.backward_hooks.swap(hooks);
+            throw;
+        }
+        model.backward_hooks.swap(hooks);
+
+        all_reduce();
+        for (size_t i = model.layers.size(); i-- > 0;)
+        {
+            model.run_backward_hooks(i);
+        }
+
+        if (input.requires_grad)
+        {
+            input.resize_grad();
+            offset = 0;
+            for (size_t r = 0; r < shards; ++r)
+            {
+                const Storage<float> &part = shard_inputs[r].grad;
+                std::copy(part.begin(), part.end(), input.grad.begin() + offset);
+                offset += part.size();
+            }
+        }
+    }
+
+  private:
+    Model &model;
+    std::vector<std::unique_ptr<Model>> replicas;
+    std::vector<std::unique_ptr<ParameterArena>> replica_grads;
+    std::vector<Tensor> shard_inputs;
+    std::vector<Tensor> shard_outputs;
+    size_t shards = 0;
+
+    Model &replica(size_t r) { return r == 0 ? model : *replicas[r - 1]; }
+
+    // Параметры реплик указывают на текущие буферы модели, режим
+    // train/eval и checkpointing совпадают с моделью
+    void sync_replicas()
+    {
+        std::vector<Tensor *> params = model.parameters();
+        for (const std::unique_ptr<Model> &copy : replicas)
+        {
+            std::vector<Tensor *> copy_params = copy->parameters();
+            for (size_t k = 0; k < params.size(); ++k)
+            {
+                if (copy_params[k]->data.data() != params[k]->data.data())
+                {
+                    copy_params[k]->data.rebind(params[k]->data.data(),
+                                                params[k]->data.size());
+                }
+            }
+            copy->checkpoints = model.checkpoints;
+            copy->activation_precision = model.activation_precision;
+            for (size_t i = 0; i < model.layers.size(); ++i)
+            {
+                if (copy->layers[i]->training != model.layers[i]->training)
+                {
+                    copy->layers[i]->train(model.layers[i]->training);
+                }
+            }
+        }
+    }
+
+    // Части батча - представления строк input без копирования
+    void split(const Tensor &input)
+    {
+        const size_t batch = input.shape[0];
+        const size_t row = input.data.size() / batch;
+        shards = std::min(num_replicas(), batch);
+        shard_inputs.resize(shards);
+        shard_outputs.resize(shards);
+        size_t begin = 0;
+        for (size_t r = 0; r < shards; ++r)
+        {
+            const size_t rows = batch / shards + (r < batch % shards ? 1 : 0);
+            Tensor &shard = shard_inputs[r];
+            shard.shape = input.shape;
+            shard.shape[0] = rows;
+            shard.memory_format = input.memory_format;
+            shard.requires_grad = input.requires_grad;
+            shard.data.rebind(
+                const_cast<float *>(input.data.data()) + begin * row, rows * row);
+            begin += rows;
+        }
+    }
+
+    void run_shards(const std::function<void(size_t, Model &)> &fn)
+    {
+        if (shards == 1)
+        {
+            fn(0, model);
+            return;
+        }
+        ThreadPool::instance().run(shards, [&](size_t r) { fn(r, replica(r)); });
+    }
+
+    // Градиенты реплик 1..shards-1 блоками по kAllReduceChunk прибавляются
+    // к градиентам модели в фиксированном порядке и обнуляются
+    void all_reduce()
+    {
+        if (model.has_flat_parameters())
+        {
+            all_reduce_flat();
+            return;
+        }
+        std::vector<Tensor *> params = model.parameters();
+        std::vector<std::vector<Tensor *>> copy_params;
+        for (size_t r = 1; r < shards; ++r)
+        {
+            copy_params.push_back(replicas[r - 1]->parameters());
+        }
+
+        std::vector<std::pair<size_t, size_t>> chunks;
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            if (!params[k]->requires_grad)
+            {
+                continue;
+            }
+            params[k]->resize_grad();
+            for (size_t offset = 0; offset < params[k]->grad.size();
+                 offset += kAllReduceChunk)
+            {
+                chunks.emplace_back(k, offset);
+            }
+        }
+
+        parallel_for(0, chunks.size(), parallel_grain(shards * kAllReduceChunk),
+                     [&](size_t first, size_t last) {
+            for (size_t c = first; c < last; ++c)
+            {
+                const size_t k = chunks[c].first;
+                const size_t begin = chunks[c].second;
+                const size_t end =
+                    std::min(params[k]->grad.size(), begin + kAllReduceChunk);
+                float *dst = params[k]->grad.data();
+                for (std::vector<Tensor *> &copy : copy_params)
+                {
+                    Storage<float> &src = copy[k]->grad;
+                    if (src.empty())
+                    {
+                        continue;
+                    }
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        dst[i] += src[i];
+                        src[i] = 0.0f;
+                    }
+                }
+            }
+        });
+    }
+
+    // Градиенты модели и реплик лежат в аренах с одинаковой раскладкой:
+    // один проход по арене без разбиения по параметрам
+    void all_reduce_flat()
+    {
+        float *dst = model.param_arena->grad().data();
+        std::vector<float *> srcs;
+        for (size_t r = 1; r < shards; ++r)
+        {
+            srcs.push_back(replica_grads[r - 1]->grad().data());
+        }
+        parallel_for(0, model.param_arena->size(), parallel_grain(shards),
+                     [&](size_t first, size_t last) {
+            for (size_t begin = first; begin < last; begin += kAllReduceChunk)
+            {
+                const size_t end = std::min(last, begin + kAllReduceChunk);
+                for (float *src : srcs)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        dst[i] += src[i];
+                        src[i] = 0.0f;
+                    }
+                }
+            }
+        });
+    }
+};
+
+// Конвейерное (pipeline) выполнение Model. Слои делятся на стадии -
+// непрерывные диапазоны, каждая стадия работает в своем потоке. Батч
+// делится по первой оси на микробатчи, которые проходят стадии
+// одновременно через очереди SpscQueue. Forward сохраняет только входы
+// стадий; backward выполняется по схеме GPipe: микробатчи идут в обратном
+// порядке, стадия пересчитывает свой forward от сохраненного входа и
+// сразу выполняет backward, градиенты параметров накапливаются по
+// микробатчам. Как и при checkpointing, слои с running-статистиками
+// обновляют их и при пересчете. При set_thread_pinning(true) стадия s
+// привязывается к CPU слота s; параллельным ядрам внутри стадий в этом
+// случае лучше оставить один поток (set_num_threads(1))
+class PipelineParallel
+{
+  public:
+    struct StageStats
+    {
+        size_t first_layer = 0;
+        size_t last_layer = 0; // не включая
+        double busy_ms = 0.0;
+        // Доля времени последнего прохода, занятая вычислениями стадии
+        double utilization = 0.0;
+    };
+
+    PipelineParallel(Model &model, size_t num_stages, size_t micro_batches)
+        : model(model), num_stages(num_stages), micro_batches(micro_batches)
+    {
+        if (num_stages == 0 || micro_batches == 0)
+        {
+            throw std::invalid_argument(
+                "Pipeline needs at least one stage and one micro-batch");
+        }
+        if (num_stages > model.layers.size())
+        {
+            throw std::invalid_argument("More pipeline stages than layers");
+        }
+        stats.resize(num_stages);
+        scratch.resize(num_stages);
+        for (size_t s = 0; s < num_stages; ++s)
+        {
+            forward_queues.emplace_back(new SpscQueue<size_t>(micro_batches));
+            backward_queues.emplace_back(new SpscQueue<size_t>(micro_batches));
+        }
+        for (size_t s = 0; s < num_stages; ++s)
+        {
+            threads.emplace_back([this, s]() { stage_loop(s); });
+        }
+    }
+
+    ~PipelineParallel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = Job::Stop;
+            ++generation;
+        }
+        start_cv.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    PipelineParallel(const PipelineParallel &) = delete;
+    PipelineParallel &operator=(const PipelineParallel &) = delete;
+
+    // Делит слои со стоимостями costs на num_stages непрерывных стадий,
+    // минимизируя стоимость самой дорогой. Стадия s - слои
+    // [bounds[s], bounds[s + 1])
+    static std::vector<size_t> partition_by_cost(const std::vector<size_t> &costs,
+                                                 size_t num_stages)
+    {
+        const size_t n = costs.size();
+        const size_t stages = std::min(num_stages, n);
+        std::vector<size_t> prefix(n + 1, 0);
+        for (size_t i = 0; i < n; ++i)
+        {
+            prefix[i + 1] = prefix[i] + costs[i];
+        }
+
+        // best[k][i] - лучшая максимальная стоимость для первых i слоев на
+        // k стадиях, cut[k][i] - начало последней из них
+        const size_t inf = static_cast<size_t>(-1);
+        std::vector<std::vector<size_t>> best(stages + 1,
+                                              std::vector<size_t>(n + 1, inf));
+        std::vector<std::vector<size_t>> cut(stages + 1,
+                                             std::vector<size_t>(n + 1, 0));
+        best[0][0] = 0;
+        for (size_t k = 1; k <= stages; ++k)
+        {
+            for (size_t i = k; i <= n; ++i)
+            {
+                for (size_t j = k - 1; j < i; ++j)
+                {
+                    if (best[k - 1][j] == inf)
+                    {
+                        continue;
+                    }
+                    const size_t cost =
+                        std::max(best[k - 1][j], prefix[i] - prefix[j]);
+                    if (cost < best[k][i])
+                    {
+                        best[k][i] = cost;
+                        cut[k][i] = j;
+                    }
+                }
+            }
+        }
+
+        std::vector<size_t> bounds(stages + 1, n);
+        for (size_t k = stages; k > 0; --k)
+        {
+            bounds[k - 1] = cut[k][bounds[k]];
+        }
+        return bounds;
+    }
+
+    // Разбиение по Layer::cost для входа микробатча формы input_shape
+    void partition(const std::vector<size_t> &input_shape)
+    {
+        std::vector<size_t> costs;
+        std::vector<size_t> shape = input_shape;
+        for (Layer *layer : model.layers)
+        {
+            costs.push_back(layer->cost(shape));
+            shape = layer->output_shape(shape);
+        }
+        set_boundaries(partition_by_cost(costs, num_stages));
+    }
+
+    void set_boundaries(const std::vector<size_t> &new_bounds)
+    {
+        if (new_bounds.size() != num_stages + 1 || new_bounds.front() != 0 ||
+            new_bounds.back() != model.layers.size())
+        {
+            throw std::invalid_argument("Invalid pipeline stage boundaries");
+        }
+        for (size_t s = 0; s < num_stages; ++s)
+        {
+            if (new_bounds[s] >= new_bounds[s + 1])
+            {
+                throw std::invalid_argument("Pipeline stages must not be empty");
+            }
+            stats[s].first_layer = new_bounds[s];
+            stats[s].last_layer = new_bounds[s + 1];
+        }
+        bounds = new_bounds;
+    }
+
+    const std::vector<size_t> &boundaries() const { return bounds; }
+
+    void forward(const Tensor &input, Tensor &output)
+    {
+        if (input.shape.empty())
+        {
+            throw std::invalid_argument("Input must have a batch dimension");
+        }
+        split(input);
+        if (bounds.empty())
+        {
+            partition(boundary[0][0].shape);
+        }
+        run_job(Job::Forward);
+
+        const std::vector<Tensor> &outputs = boundary[num_stages];
+        output.shape = outputs[0].shape;
+        output.shape[0] = input.shape[0];
+        output.memory_format = outputs[0].memory_format;
+        output.resize();
+        size_t offset = 0;
+        for (const Tensor &part : outputs)
+        {
+            std::copy(part.data.begin(), part.data.end(),
+                      output.data.begin() + offset);
+            offset += part.data.size();
+        }
+        forward_done = true;
+    }
+
+    void backward(const Tensor &output, Tensor &input)
+    {
+        if (!forward_done)
+        {
+            throw std::runtime_error(
+                "Forward pass must be called before backward pass");
+        }
+        size_t offset = 0;
+        for (Tensor &part : boundary[num_stages])
+        {
+            part.grad.assign(output.grad.begin() + offset,
+                             output.grad.begin() + offset + part.data.size());
+            offset += part.data.size();
+        }
+        run_job(Job::Backward);
+
+        if (input.requires_grad)
+        {
+            input.resize_grad();
+            offset = 0;
+            for (const Tensor &part : boundary[0])
+            {
+                std::copy(part.grad.begin(), part.grad.end(),
+                          input.grad.begin() + offset);
+                offset += part.grad.size();
+            }
+        }
+    }
+
+    const std::vector<StageStats> &stage_stats() const { return stats; }
+
+    std::string stats_to_string() const
+    {
+        std::stringstream ss;
+        for (size_t s = 0; s < stats.size(); ++s)
+        {
+            ss << "Stage " << s << ": layers [" << stats[s].first_layer << ", "
+               << stats[s].last_layer << "), busy " << stats[s].busy_ms
+               << " ms, utilization "
+               << static_cast<int>(stats[s].utilization * 100.0 + 0.5)
+               << "%\n";
+        }
+        return ss.str();
+    }
+
+  private:
+    enum class Job
+    {
+        None,
+        Forward,
+        Backward,
+        Stop
+    };
+
+    Model &model;
+    size_t num_stages;
+    size_t micro_batches;
+    std::vector<size_t> bounds;
+    std::vector<StageStats> stats;
+
+    // boundary[s][m] - вход стадии s для микробатча m, boundary[num_stages]
+    // - выходы последней стадии
+    std::vector<std::vector<Tensor>> boundary;
+    // Промежуточные выходы внутри стадии при forward
+    std::vector<std::array<Tensor, 2>> scratch;
+    bool forward_done = false;
+
+    std::vector<std::unique_ptr<SpscQueue<size_t>>> forward_queues;
+    std::vector<std::unique_ptr<SpscQueue<size_t>>> backward_queues;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    size_t generation = 0;
+    Job job = Job::None;
+    size_t running = 0;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+
+    // Микробатчи - представления строк input без копирования
+    void split(const Tensor &input)
+    {
+        const size_t batch = input.shape[0];
+        const size_t row = input.data.size() / batch;
+        const size_t count = std::min(micro_batches, batch);
+        if (boundary.size() != num_stages + 1 || boundary[0].size() != count)
+        {
+            boundary.assign(num_stages + 1, std::vector<Tensor>(count));
+        }
+        size_t begin = 0;
+        for (size_t m = 0; m < count; ++m)
+        {
+            const size_t rows = batch / count + (m < batch % count ? 1 : 0);
+            Tensor &part = boundary[0][m];
+            part.shape = input.shape;
+            part.shape[0] = rows;
+            part.memory_format = input.memory_format;
+            part.requires_grad = input.requires_grad;
+            part.data.rebind(
+                const_cast<float *>(input.data.data()) + begin * row, rows * row);
+            begin += rows;
+        }
+        for (size_t s = 1; s < num_stages; ++s)
+        {
+            for (Tensor &part : boundary[s])
+            {
+                part.requires_grad = true;
+            }
+        }
+        forward_done = false;
+    }
+
+    void run_job(Job next)
+    {
+        const size_t count = boundary[0].size();
+        failed = false;
+        error = nullptr;
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = next;
+            running = num_stages;
+            ++generation;
+        }
+        start_cv.notify_all();
+
+        // Вызывающий поток - производитель для первой очереди
+        for (size_t k = 0; k < count; ++k)
+        {
+            if (next == Job::Forward)
+            {
+                forward_queues[0]->push(k);
+            }
+            else
+            {
+                backward_queues[num_stages - 1]->push(count - 1 - k);
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [this]() { return running == 0; });
+        }
+        const double total_ms = std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+        for (StageStats &stage : stats)
+        {
+            stage.utilization = total_ms > 0.0 ? stage.busy_ms / total_ms : 0.0;
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void stage_loop(size_t s)
+    {
+        if (thread_pinning_enabled())
+        {
+            pin_current_thread({NumaTopology::instance().cpu_for_slot(s)});
+        }
+        size_t seen = 0;
+        while (true)
+        {
+            Job current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&]() { return generation != seen; });
+                seen = generation;
+                current = job;
+            }
+            if (current == Job::Stop)
+            {
+                return;
+            }
+
+            double busy_ms = 0.0;
+            const size_t count = boundary[0].size();
+            for (size_t k = 0; k < count; ++k)
+            {
+                const size_t m = current == Job::Forward
+                                     ? forward_queues[s]->pop()
+                                     : backward_queues[s]->pop();
+                // После ошибки микробатчи только передаются дальше, чтобы
+                // остальные стадии не ждали вечно
+                if (!failed)
+                {
+                    const auto start = std::chrono::steady_clock::now();
+                    try
+                    {
+                        if (current == Job::Forward)
+                        {
+                            forward_micro_batch(s, m);
+                        }
+                        else
+                        {
+                            backward_micro_batch(s, m);
+                        }
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (!error)
+                        {
+                            error = std::current_exception();
+                        }
+                        failed = true;
+                    }
+                    busy_ms += std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+                }
+                if (current == Job::Forward && s + 1 < num_stages)
+                {
+                    forward_queues[s + 1]->push(m);
+                }
+                if (current == Job::Backward && s > 0)
+                {
+                    backward_queues[s - 1]->push(m);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            stats[s].busy_ms = busy_ms;
+            if (--running == 0)
+            {
+                done_cv.notify_all();
+            }
+        }
+    }
+
+    // Состояние слоев для backward не сохраняется: backward пересчитывает
+    void forward_micro_batch(size_t s, size_t m)
+    {
+        NoGradGuard no_grad;
+        const Tensor *current = &boundary[s][m];
+        for (size_t i = bounds[s]; i < bounds[s + 1]; ++i)
+        {
+            Tensor *next = i + 1 == bounds[s + 1]
+                               ? &boundary[s + 1][m]
+                               : &scratch[s][(i - bounds[s]) % 2];
+            model.layers[i]->forward(*current, *next);
+            current = next;
+        }
+    }
+
+    void backward_micro_batch(size_t s, size_t m)
+    {
+        GradModeGuard grad_mode(true);
+        const size_t first = bounds[s];
+        const size_t count = bounds[s + 1] - first;
+
+        // Пересчет стадии с сохранением состояния слоев
+        std::vector<Tensor> outputs(count);
+        const Tensor *current = &boundary[s][m];
+        for (size_t j = 0; j < count; ++j)
+        {
+            model.layers[first + j]->forward(*current, outputs[j]);
+            outputs[j].requires_grad = true;
+            current = &outputs[j];
+        }
+        outputs.back().grad = std::move(boundary[s + 1][m].grad);
+
+        const Tensor *grad_source = &outputs.back();
+        for (size_t j = count; j-- > 0;)
+        {
+            Tensor *prev = j == 0 ? &boundary[s][m] : &outputs[j - 1];
+            model.layers[first + j]->backward(*grad_source, *prev);
+            grad_source = prev;
+        }
+    }
+};
+
+// Базовый класс оптимизаторов. Память параметров оптимизатору не
+// принадлежит: если параметры лежат подряд (Model::flatten_parameters или
+// своя ParameterArena), обновление, zero_grad и норма градиентов идут
+// одним проходом по общему буферу на пуле потоков, иначе - по каждому
+// тензору. Состояния (момент, моменты Adam) - общие буферы в порядке
+// parameters(). Параметры без градиента пропускаются
+class Optimizer
+{
+  public:
+    // Стоимость обновления одного элемента для модели стоимости
+    static constexpr size_t kUpdateCost = 8;
+
+    explicit Optimizer(const std::vector<Tensor *> &parameters)
+        : params(parameters)
+    {
+        for (Tensor *param : params)
+        {
+            offsets.push_back(total);
+            total += param->data.size();
+        }
+    }
+
+    virtual ~Optimizer() = default;
+
+    Optimizer(const Optimizer &) = delete;
+    Optimizer &operator=(const Optimizer &) = delete;
+
+    // Шаг по всем параметрам
+    void step()
+    {
+        begin_step();
+        for (const Span &span : spans())
+        {
+            parallel_for(0, span.size, parallel_grain(kUpdateCost),
+                         [&](size_t first, size_t last) {
+                update(span.data + first, span.grad + first,
+                       span.offset + first, last - first);
+            });
+        }
+    }
+
+    // Начало шага по частям: пересчет общих для шага коэффициентов.
+    // После него каждый параметр обновляется один раз step_parameter
+    virtual void begin_step() {}
+
+    // Обновляет только parameters()[k] в вызывающем потоке
+    void step_parameter(size_t k)
+    {
+        Tensor *param = params[k];
+        if (param->grad.size() == param->data.size())
+        {
+            update(param->data.data(), param->grad.data(), offsets[k],
+                   param->data.size());
+        }
+    }
+
+    void zero_grad()
+    {
+        for (const Span &span : spans())
+        {
+            float *g = span.grad;
+            parallel_for(0, span.size, parallel_grain(1),
+                         [&](size_t first, size_t last) {
+                std::fill(g + first, g + last, 0.0f);
+            });
+        }
+    }
+
+    // L2-норма всех градиентов (детерминированная, не зависит от числа
+    // потоков)
+    float grad_norm() const
+    {
+        float sum = 0.0f;
+        for (const Span &span : spans())
+        {
+            const float *g = span.grad;
+            sum += parallel_reduce(
+                0, span.size, parallel_grain(2), 0.0f,
+                [&](size_t first, size_t last) {
+                    float partial = 0.0f;
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        partial += g[i] * g[i];
+                    }
+                    return partial;
+                },
+                [](float a, float b) { return a + b; });
+        }
+        return std::sqrt(sum);
+    }
+
+    // Масштабирует градиенты так, чтобы их общая норма не превышала
+    // max_norm. Возвращает норму до обрезки
+    float clip_grad_norm(float max_norm)
+    {
+        const float norm = grad_norm();
+        if (norm > max_norm && norm > 0.0f)
+        {
+            scale_grads(max_norm / norm);
+        }
+        return norm;
+    }
+
+    void scale_grads(float factor)
+    {
+        for (const Span &span : spans())
+        {
+            float *g = span.grad;
+            parallel_for(0, span.size, parallel_grain(1),
+                         [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i)
+                {
+                    g[i] *= factor;
+                }
+            });
+        }
+    }
+
+    // Все градиенты конечны (нет inf и NaN)
+    bool grads_finite() const
+    {
+        for (const Span &span : spans())
+        {
+            const float *g = span.grad;
+            const size_t bad = parallel_reduce(
+                0, span.size, parallel_grain(1), size_t(0),
+                [&](size_t first, size_t last) {
+                    size_t count = 0;
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        count += std::isfinite(g[i]) ? 0 : 1;
+                    }
+                    return count;
+                },
+                [](size_t a, size_t b) { return a + b; });
+            if (bad > 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::vector<Tensor *> &parameters() const { return params; }
+
+    size_t num_elements() const { return total; }
+
+  protected:
+    std::vector<Tensor *> params;
+    // Начало каждого параметра в буферах состояний
+    std::vector<size_t> offsets;
+    size_t total = 0;
+
+    // Обновление n элементов: p и g - данные и градиенты, offset - их
+    // начало в буферах состояний
+    virtual void update(float *p, const float *g, size_t offset,
+                        size_t n) = 0;
+
+  private:
+    // Непрерывный отрезок параметров
+    struct Span
+    {
+        float *data;
+        float *grad;
+        size_t offset;
+        size_t size;
+    };
+
+    // Отрезки по текущей памяти параметров. Вычисляются при каждом вызове:
+    // память может смениться после создания оптимизатора (например,
+    // Model::flatten_parameters или add_layer модели с ареной)
+    std::vector<Span> spans() const
+    {
+        std::vector<Span> result;
+        if (ParameterArena::is_contiguous(params))
+        {
+            result.push_back(
+                {params[0]->data.data(), params[0]->grad.data(), 0, total});
+            return result;
+        }
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            Tensor *param = params[k];
+            if (!param->data.empty() &&
+                param->grad.size() == param->data.size())
+            {
+                result.push_back({param->data.data(), param->grad.data(),
+                                  offsets[k], param->data.size()});
+            }
+        }
+        return result;
+    }
+};
+
+// SGD с моментом и L2-регуляризацией:
+// v = momentum * v + (g + weight_decay * p), p -= lr * v
+class SGD : public Optimizer
+{
+  public:
+    float lr;
+    float momentum;
+    float weight_decay;
+
+    SGD(const std::vector<Tensor *> &parameters, float lr,
+        float momentum = 0.0f, float weight_decay = 0.0f)
+        : Optimizer(parameters), lr(lr), momentum(momentum),
+          weight_decay(weight_decay)
+    {
+        if (momentum != 0.0f)
+        {
+            velocity.resize(num_elements());
+        }
+    }
+
+  protected:
+    void update(float *p, const float *g, size_t offset, size_t n) override
+    {
+        const float lr = this->lr, mu = momentum, wd = weight_decay;
+        if (!velocity.empty())
+        {
+            float *v = velocity.data() + offset;
+            for (size_t i = 0; i < n; ++i)
+            {
+                v[i] = mu * v[i] + g[i] + wd * p[i];
+                p[i] -= lr * v[i];
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] -= lr * (g[i] + wd * p[i]);
+            }
+        }
+    }
+
+  private:
+    Storage<float> velocity;
+};
+
+// Adam. При decoupled_weight_decay (AdamW) затухание весов применяется к
+// параметрам напрямую, иначе добавляется к градиенту (L2)
+class Adam : public Optimizer
+{
+  public:
+    float lr;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    bool decoupled_weight_decay;
+
+    Adam(const std::vector<Tensor *> &parameters, float lr = 1e-3f,
+         float beta1 = 0.9f, float beta2 = 0.999f, float eps = 1e-8f,
+         float weight_decay = 0.0f, bool decoupled_weight_decay = false)
+        : Optimizer(parameters), lr(lr), beta1(beta1), beta2(beta2), eps(eps),
+          weight_decay(weight_decay),
+          decoupled_weight_decay(decoupled_weight_decay),
+          exp_avg(num_elements()), exp_avg_sq(num_elements())
+    {
+    }
+
+    size_t steps() const { return step_count; }
+
+    void begin_step() override
+    {
+        ++step_count;
+        const float t = static_cast<float>(step_count);
+        // Поправки смещения вносятся в шаг и в eps, чтобы цикл не делил на
+        // (1 - beta^t) для каждого элемента
+        const float bias1 = 1.0f - std::pow(beta1, t);
+        const float bias2 = 1.0f - std::pow(beta2, t);
+        step_size = lr * std::sqrt(bias2) / bias1;
+        eps_hat = eps * std::sqrt(bias2);
+    }
+
+  protected:
+    void update(float *p, const float *g, size_t offset, size_t n) override
+    {
+        float *m = exp_avg.data() + offset;
+        float *v = exp_avg_sq.data() + offset;
+        const float b1 = beta1, b2 = beta2;
+        const float step_size = this->step_size, eps_hat = this->eps_hat;
+        const float l2 = decoupled_weight_decay ? 0.0f : weight_decay;
+        const float decay = decoupled_weight_decay ? lr * weight_decay : 0.0f;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float grad = g[i] + l2 * p[i];
+            m[i] = b1 * m[i] + (1.0f - b1) * grad;
+            v[i] = b2 * v[i] + (1.0f - b2) * grad * grad;
+            p[i] -= decay * p[i] + step_size * m[i] / (std::sqrt(v[i]) + eps_hat);
+        }
+    }
+
+  private:
+    Storage<float> exp_avg;
+    Storage<float> exp_avg_sq;
+    size_t step_count = 0;
+    float step_size = 0.0f;
+    float eps_hat = 0.0f;
+};
+
+class AdamW : public Adam
+{
+  public:
+    AdamW(const std::vector<Tensor *> &parameters, float lr = 1e-3f,
+          float beta1 = 0.9f, float beta2 = 0.999f, float eps = 1e-8f,
+          float weight_decay = 1e-2f)
+        : Adam(parameters, lr, beta1, beta2, eps, weight_decay, true)
+    {
+    }
+};
+
+// Динамическое масштабирование функции потерь для обучения в fp16:
+// градиент выхода умножается на scale(), чтобы малые градиенты не
+// обнулялись при хранении в половинной точности, перед шагом оптимизатора
+// градиенты делятся обратно. Если среди градиентов есть inf/NaN, шаг
+// пропускается и масштаб уменьшается, после growth_interval успешных
+// шагов подряд масштаб растет
+class GradScaler
+{
+  public:
+    float growth_factor;
+    float backoff_factor;
+    size_t growth_interval;
+
+    explicit GradScaler(float init_scale = 65536.0f, float growth_factor = 2.0f,
+                        float backoff_factor = 0.5f,
+                        size_t growth_interval = 2000)
+        : growth_factor(growth_factor), backoff_factor(backoff_factor),
+          growth_interval(growth_interval), scale_(init_scale)
+    {
+    }
+
+    float scale() const { return scale_; }
+
+    // Вызывается перед backward
+    void scale_output_grad(Tensor &output) const
+    {
+        for (float &g : output.grad)
+        {
+            g *= scale_;
+        }
+    }
+
+    // Снимает масштаб с градиентов и делает шаг. Возвращает false, если
+    // шаг пропущен из-за переполнения
+    bool step(Optimizer &optimizer)
+    {
+        if (!optimizer.grads_finite())
+        {
+            scale_ *= backoff_factor;
+            good_steps = 0;
+            return false;
+        }
+        optimizer.scale_grads(1.0f / scale_);
+        optimizer.step();
+        if (++good_steps >= growth_interval)
+        {
+            scale_ *= growth_factor;
+            good_steps = 0;
+        }
+        return true;
+    }
+
+  private:
+    float scale_;
+    size_t good_steps = 0;
+};
+
+// Шаг оптимизатора, совмещенный с backward модели. Хук после backward
+// слоя отдает его параметры отдельному потоку, и тот обновляет их, пока
+// backward идет по предыдущим слоям. wait() дожидается обновлений и сам
+// обновляет параметры, не попавшие ни в один хук. Результат совпадает с
+// optimizer.step() после backward. clip_grad_norm с совмещением
+// несовместим: общая норма известна только после всего backward. Состав
+// слоев модели не должен меняться, пока объект жив
+class OverlappedStep
+{
+  public:
+    OverlappedStep(Model &model, Optimizer &optimizer)
+        : model(model), optimizer(optimizer)
+    {
+        const std::vector<Tensor *> &params = optimizer.parameters();
+        layer_params.resize(model.layers.size());
+        for (size_t i = 0; i < model.layers.size(); ++i)
+        {
+            for (Tensor *param : model.layers[i]->parameters())
+            {
+                auto it = std::find(params.begin(), params.end(), param);
+                if (it != params.end())
+                {
+                    layer_params[i].push_back(it - params.begin());
+                }
+            }
+        }
+        updated.assign(params.size(), false);
+        hook_id = model.add_backward_hook(
+            [this](size_t layer) { on_layer_ready(layer); });
+        worker = std::thread([this]() { worker_loop(); });
+    }
+
+    ~OverlappedStep()
+    {
+        model.remove_backward_hook(hook_id);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready_cv.notify_all();
+        worker.join();
+    }
+
+    OverlappedStep(const OverlappedStep &) = delete;
+    OverlappedStep &operator=(const OverlappedStep &) = delete;
+
+    // Завершает шаг: вызывается после backward, до следующего forward
+    void wait()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [this]() { return queue.empty() && !busy; });
+        }
+        for (size_t k = 0; k < updated.size(); ++k)
+        {
+            if (!updated[k])
+            {
+                start_step();
+                optimizer.step_parameter(k);
+            }
+        }
+        updated.assign(updated.size(), false);
+        step_started = false;
+        if (error)
+        {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+  private:
+    Model &model;
+    Optimizer &optimizer;
+    // Индексы параметров оптимизатора по слоям модели
+    std::vector<std::vector<size_t>> layer_params;
+    // Параметр уже обновлен (или поставлен в очередь) на текущем шаге
+    std::vector<bool> updated;
+    bool step_started = false;
+    size_t hook_id = 0;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable ready_cv;
+    std::condition_variable done_cv;
+    std::deque<size_t> queue;
+    bool busy = false;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void start_step()
+    {
+        if (!step_started)
+        {
+            optimizer.begin_step();
+            step_started = true;
+        }
+    }
+
+    // Вызывается в потоке backward
+    void on_layer_ready(size_t layer)
+    {
+        if (layer >= layer_params.size())
+        {
+            return;
+        }
+        bool any = false;
+        for (size_t k : layer_params[layer])
+        {
+            if (updated[k])
+            {
+                continue;
+            }
+            start_step();
+            updated[k] = true;
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(k);
+            any = true;
+        }
+        if (any)
+        {
+            ready_cv.notify_one();
+        }
+    }
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            ready_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            const size_t k = queue.front();
+            queue.pop_front();
+            busy = true;
+            lock.unlock();
+            std::exception_ptr failure;
+            try
+            {
+                optimizer.step_parameter(k);
+            }
+            catch (...)
+            {
+                failure = std::current_exception();
+            }
+            lock.lock();
+            if (failure && !error)
+            {
+                error = failure;
+            }
+            busy = false;
+            if (queue.empty())
+            {
+                done_cv.notify_all();
+            }
+        }
+    }
+};
+
+static Tensor softmax_for_mha(const Tensor &attention_score)
+{
+    // Применяем softmax по последнему измерению
+    Tensor attention;
+    attention.shape = attention_score.shape;
+    attention.resize();
+
+    const size_t last_dim = attention.shape.back();
+    const size_t num_elements = attention.data.size();
+
+    parallel_for(0, num_elements / last_dim,
+                 parallel_grain(last_dim * kTranscendentalCost),
+                 [&](size_t first, size_t last) {
+        for (size_t row = first; row < last; ++row)
+        {
+            const size_t i = row * last_dim;
+            // Находим максимум для численной стабильности
+            float max_val = attention_score.data[i];
+            for (size_t j = 1; j < last_dim; ++j)
+            {
+                max_val = std::max(max_val, attention_score.data[i + j]);
+            }
+
+            // Вычисляем экспоненты и их сумму
+            float sum_exp = 0.0f;
+            for (size_t j = 0; j < last_dim; ++j)
+            {
+                attention.data[i + j] = std::exp(attention_score.data[i + j] - max_val);
+                sum_exp += attention.data[i + j];
+            }
+
+            // Нормализуем для получения вероятностей
+            for (size_t j = 0; j < last_dim; ++j)
+            {
+                attention.data[i + j] /= sum_exp;
+            }
+        }
+    });
+    return attention;
+}
+
+struct ScaledDotProductAttention
+{
+    Tensor saved_q, saved_k, saved_v;
+    Tensor attn_scores, attention;
+    float scale = 0.0f;
+
+    void forward(const Tensor &q, const Tensor &k, const Tensor &v, Tensor &values)
+    {
+        if (q.shape.size() != k.shape.size() || q.shape.size() != v.shape.size())
+        {
+            throw std::runtime_error("All input tensors must have the same number of dimensions");
+        }
+        if (is_grad_enabled())
+        {
+            saved_q = q.copy();
+            saved_k = k.copy();
+            saved_v = v.copy();
+        }
+
+        const size_t d_k = k.shape.back();
+
+        attn_scores.shape = q.shape;
+        attn_scores.shape.back() = k.shape[k.shape.size() - 2];
+        attn_scores.resize();
+
+        attn_scores = matmul(q, k.transpose(k.shape.size() - 2, k.shape.size() - 1));
+
+        scale = 1.0f / std::sqrt(static_cast<float>(d_k));
+        for (size_t i = 0; i < attn_scores.data.size(); ++i)
+        {
+            attn_scores.data[i] *= scale;
+        }
+
+        attention = softmax_for_mha(attn_scores);
+
+        values = matmul(attention, v);
+    }
+
+    void backward(const Tensor &grad_output, Tensor &dq, Tensor &dk, Tensor &dv)
+    {
+
+        // Инициализация градиентов
+        dq.resize_grad();
+        dk.resize_grad();
+        dv.resize_grad();
+
+        // Вычисление градиента для dv (dV = Attention^T * grad_output)
+        Tensor attention_T = attention.transpose(attention.shape.size() - 2, attention.shape.size() - 1);
+        attention_T.resize_grad();
+        dv = matmul(attention_T, grad_output);
+        dv.resize_grad();
+        for (size_t i = 0; i < dv.grad.size(); ++i)
+        {
+            dv.grad[i] += grad_output.grad[i]; // Накопление градиентов
+        }
+
+        // Вычисление градиента для attention (dAttention = grad_output * V^T)
+        Tensor v_T = saved_v.transpose(saved_v.shape.size() - 2, saved_v.shape.size() - 1);
+        v_T.resize_grad();
         Tensor dAttention;
         dAttention = matmul(grad_output, v_T);
         dAttention.resize_grad();
@@ -663,18 +6702,20 @@ struct ScaledDotProductAttention
         dScores.resize_grad();
         const size_t BHT = attention.data.size() / attention.shape.back();
         const size_t T_k = attention.shape.back();
-        for (size_t i = 0; i < BHT; ++i)
-        {
-            float dot = 0.0f;
-            for (size_t j = 0; j < T_k; ++j)
+        parallel_for(0, BHT, parallel_grain(2 * T_k), [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
             {
-                dot += attention.data[i * T_k + j] * dAttention.grad[i * T_k + j];
-            }
-            for (size_t j = 0; j < T_k; ++j)
-            {
-                dScores.grad[i * T_k + j] = attention.data[i * T_k + j] * (dAttention.grad[i * T_k + j] - dot);
+                float dot = 0.0f;
+                for (size_t j = 0; j < T_k; ++j)
+                {
+                    dot += attention.data[i * T_k + j] * dAttention.grad[i * T_k + j];
+                }
+                for (size_t j = 0; j < T_k; ++j)
+                {
+                    dScores.grad[i * T_k + j] = attention.data[i * T_k + j] * (dAttention.grad[i * T_k + j] - dot);
+                }
             }
-        }
+        });
         for (float &val : dScores.grad)
         {
             val *= scale; // Масштабирование
@@ -782,7 +6823,10 @@ struct MultiHeadAttention
         out = out.view({batch * seq_len, d_model});
         w_concat.forward(out, out);
         out = out.view({batch, seq_len, d_model});
-        w_concat_in = out.copy();
+        if (is_grad_enabled())
+        {
+            w_concat_in = out.copy();
+        }
     }
 
     void backward(const Tensor &grad_output, Tensor &dq, Tensor &dk, Tensor &dv)
@@ -807,6 +6851,7 @@ struct MultiHeadAttention
         Tensor grad_concat_in;
         grad_concat_in.shape = {batch * seq_len, d_model};
         grad_concat_in.data = w_concat_in.data;
+        grad_concat_in.requires_grad = true;
         w_concat.backward(grad_out_reshaped, grad_concat_in);
 
         // Возврат к форме (batch, seq_len, d_model)
@@ -855,6 +6900,9 @@ struct MultiHeadAttention
         grad_q_in.data = q.data;
         grad_k_in.data = k.data;
         grad_v_in.data = v.data;
+        grad_q_in.requires_grad = true;
+        grad_k_in.requires_grad = true;
+        grad_v_in.requires_grad = true;
 
         w_q.backward(grad_q_reshaped, grad_q_in);
         w_k.backward(grad_k_reshaped, grad_k_in);
@@ -900,199 +6948,27 @@ Tensor mse_loss(const Tensor &pred, const Tensor &target)
     Tensor loss;
     loss.shape = {1};
     loss.resize();
-    loss.data[0] = 0.0f;
-
-    for (size_t i = 0; i < pred.data.size(); ++i)
-    {
-        float diff = pred.data[i] - target.data[i];
-        loss.data[0] += diff * diff;
-    }
+    loss.data[0] = parallel_reduce(
+        0, pred.data.size(), parallel_grain(2), 0.0f,
+        [&](size_t first, size_t last) {
+            float sum = 0.0f;
+            for (size_t i = first; i < last; ++i)
+            {
+                float diff = pred.data[i] - target.data[i];
+                sum += diff * diff;
+            }
+            return sum;
+        },
+        [](float a, float b) { return a + b; });
     loss.data[0] /= pred.data.size();
     return loss;
 }
 
-class BatchNorm1d : public Layer {
-private:
-    size_t num_features;
-    float eps;
-    float momentum;
-    bool affine;
-    bool track_running_stats;
-
-    Tensor gamma; 
-    Tensor beta; 
-    Tensor running_mean;
-    Tensor running_var;
-
-    std::vector<float> input_data; // сохраняем входные данные для backward
-    bool first_update = true;
-
-public:
-    BatchNorm1d(size_t num_features,
-                float eps = 1e-5,
-                float momentum = 0.1,
-                bool affine = true,
-                bool track_running_stats = true)
-        : num_features(num_features),
-            eps(eps),
-            momentum(momentum),
-            affine(affine),
-            track_running_stats(track_running_stats) {
-
-        if (affine) {
-            gamma.shape = {num_features};
-            gamma.resize();
-            gamma.resize_grad();
-            beta.shape = {num_features};
-            beta.resize();
-            beta.resize_grad();
-            std::random_device rd;
-            std::mt19937 gen(rd());
-            std::uniform_real_distribution<float> dis(0.9f, 1.1f);
-            for (size_t i = 0; i < num_features; ++i) {
-                gamma.data[i] = dis(gen);
-                beta.data[i] = 0.0f;
-            }
-        }
-
-        if (track_running_stats) {
-            running_mean.shape = {num_features};
-            running_mean.resize();
-            running_var.shape = {num_features};
-            running_var.resize();
-        }
-    }
-
-    void forward(const Tensor &input, Tensor &output) override {
-        if (input.shape.size() != 2 || input.shape[1] != num_features) {
-            throw std::invalid_argument("Входной тензор должен быть [batch_size, num_features]");
-        }
-
-        size_t batch_size = input.shape[0];
-        output.shape = {batch_size, num_features};
-        output.resize();
-
-        input_data = input.data;
-
-        for (size_t f = 0; f < num_features; ++f) {
-            float mean = 0.0f, var = 0.0f;
-
-            for (size_t b = 0; b < batch_size; ++b) {
-                mean += input.data[b * num_features + f];
-            }
-            mean /= batch_size;
-
-            for (size_t b = 0; b < batch_size; ++b) {
-                float diff = input.data[b * num_features + f] - mean;
-                var += diff * diff;
-            }
-            var /= batch_size;
-
-            if (track_running_stats) {
-                if (first_update) {
-                    running_mean.data[f] = mean;
-                    running_var.data[f] = var;
-                } else {
-                    running_mean.data[f] = (1 - momentum) * running_mean.data[f] + momentum * mean;
-                    running_var.data[f] = (1 - momentum) * running_var.data[f] + momentum * var;
-                }
-            }
-
-            float inv_std = 1.0f / std::sqrt(var + eps);
-
-            for (size_t b = 0; b < batch_size; ++b) {
-                float x_hat = (input.data[b * num_features + f] - mean) * inv_std;
-                output.data[b * num_features + f] = affine ? gamma.data[f] * x_hat + beta.data[f] : x_hat;
-            }
-        }
-
-        first_update = false;
-    }
-
-    void backward(const Tensor &grad_output, Tensor &grad_input) override {
-        if (grad_output.shape.size() != 2 || grad_output.shape[1] != num_features) {
-            throw std::invalid_argument("grad_output должен быть [batch_size, num_features]");
-        }
-        if (grad_output.grad.empty()) {
-            throw std::runtime_error("grad_output.grad пустой");
-        }
-        if (input_data.empty()) {
-            throw std::runtime_error("input_data пустой. Сначала вызовите forward()");
-        }
-        if (input_data.size() != grad_output.shape[0] * num_features) {
-            throw std::runtime_error("Размер input_data не соответствует ожидаемому");
-        }
-    
-        size_t batch_size = grad_output.shape[0];
-        grad_input.shape = {batch_size, num_features};
-        grad_input.resize();
-        grad_input.resize_grad();
-    
-        const size_t count = batch_size; // Перемещено и помечено как const
-        for (size_t f = 0; f < num_features; ++f) {
-            float mean = 0.0f, var = 0.0f;
-    
-            for (size_t b = 0; b < batch_size; ++b) {
-                mean += input_data[b * num_features + f];
-            }
-            mean /= count;
-    
-            for (size_t b = 0; b < batch_size; ++b) {
-                float diff = input_data[b * num_features + f] - mean;
-                var += diff * diff;
-            }
-            var /= count;
-    
-            float inv_std = 1.0f / std::sqrt(var + eps);
-    
-            std::vector<float> x_hat(count);
-            for (size_t b = 0; b < batch_size; ++b) {
-                x_hat[b] = (input_data[b * num_features + f] - mean) * inv_std;
-            }
-    
-            float sum_dy = 0.0f, sum_dy_x_hat = 0.0f;
-            for (size_t b = 0; b < batch_size; ++b) {
-                float dy = grad_output.grad[b * num_features + f];
-                sum_dy += dy;
-                sum_dy_x_hat += dy * x_hat[b];
-            }
-    
-            float factor = static_cast<float>(count);
-            float gamma_val = affine ? gamma.data[f] : 1.0f;
-    
-            for (size_t b = 0; b < batch_size; ++b) {
-                float dy = grad_output.grad[b * num_features + f];
-                float dx_hat = dy;
-                float term1 = dx_hat * inv_std * gamma_val;
-                float term2 = inv_std * sum_dy / factor * gamma_val;
-                float term3 = inv_std * x_hat[b] * sum_dy_x_hat / factor * gamma_val;
-    
-                grad_input.grad[b * num_features + f] = term1 - term2 - term3;
-    
-                if (affine) {
-                    beta.grad[f] += dy;
-                    gamma.grad[f] += dy * x_hat[b];
-                }
-            }
-        }
-    }
-
-    std::string to_string() const override {
-        std::stringstream ss;
-        ss << "BatchNorm1d(" << num_features << ")";
-        return ss.str();
-    }
-
-    std::vector<Tensor *> parameters() override {
-        if (affine) {
-            return {&gamma, &beta};
-        }
-        return {};
-    }
-};
-
-class BatchNorm2d : public Layer {
-private:
+// Общая часть BatchNorm1d/2d/3d. Вход имеет форму [N, C, *], статистики
+// считаются по всем осям, кроме оси каналов C.
+class BatchNorm : public Layer
+{
+  protected:
     size_t num_features;
     float eps;
     float momentum;
@@ -1104,501 +6980,621 @@ private:
     Tensor running_mean;
     Tensor running_var;
 
-    std::vector<float> input_data;
+    // Состояние для backward: статистики батча по каналам и x_hat при
+    // forward на месте. Иначе backward читает x из grad_input.data - по
+    // контракту Layer это и есть вход forward
+    bool reads_input = false;
+    std::vector<float> saved_x_hat;
+    std::vector<float> saved_mean;
+    std::vector<float> saved_inv_std;
+    std::vector<size_t> saved_shape;
+    MemoryFormat saved_format = MemoryFormat::Contiguous;
     bool first_update = true;
 
-public:
-    BatchNorm2d(size_t num_features,
-                float eps = 1e-5,
-                float momentum = 0.1,
-                bool affine = true,
-                bool track_running_stats = true)
-        : num_features(num_features),
-            eps(eps),
-            momentum(momentum),
-            affine(affine),
-            track_running_stats(track_running_stats) {
-
-        if (affine) {
+    // В режиме eval выход считается как y = x * eval_scale + eval_shift
+    std::vector<float> eval_scale;
+    std::vector<float> eval_shift;
+
+    BatchNorm(size_t num_features, float eps, float momentum, bool affine,
+              bool track_running_stats)
+        : num_features(num_features), eps(eps), momentum(momentum),
+          affine(affine), track_running_stats(track_running_stats)
+    {
+        if (affine)
+        {
             gamma.shape = {num_features};
+            gamma.requires_grad = true;
             gamma.resize();
-            gamma.resize_grad();
             beta.shape = {num_features};
+            beta.requires_grad = true;
             beta.resize();
-            beta.resize_grad();
             std::random_device rd;
             std::mt19937 gen(rd());
             std::uniform_real_distribution<float> dis(0.9f, 1.1f);
-            for (size_t i = 0; i < num_features; ++i) {
+            for (size_t i = 0; i < num_features; ++i)
+            {
                 gamma.data[i] = dis(gen);
                 beta.data[i] = 0.0f;
             }
         }
 
-        if (track_running_stats) {
+        if (track_running_stats)
+        {
             running_mean.shape = {num_features};
             running_mean.resize();
             running_var.shape = {num_features};
-            running_var.resize();
+            running_var.data.assign(num_features, 1.0f);
         }
     }
 
-    void forward(const Tensor &input, Tensor &output) override {
-        if (input.shape.size() != 4) {
-            throw std::invalid_argument("Входной тензор должен быть [N, C, H, W]");
-        }
-        if (input.shape[1] != num_features) {
-            throw std::invalid_argument("Количество каналов должно соответствовать num_features");
-        }
-        if (input.data.size() != input.size()) {
-            throw std::runtime_error("Размер входных данных не соответствует shape");
+    // Проверки формы, специфичные для размерности слоя
+    virtual void check_input(const Tensor &input) const = 0;
+    virtual void check_grad_output(const Tensor &grad_output) const = 0;
+
+    // Число элементов на канал в одном примере батча (D * H * W)
+    static size_t spatial_size(const std::vector<size_t> &shape)
+    {
+        size_t spatial = 1;
+        for (size_t i = 2; i < shape.size(); ++i)
+        {
+            spatial *= shape[i];
         }
-    
-        size_t N = input.shape[0];
-        size_t C = input.shape[1];
-        size_t H = input.shape[2];
-        size_t W = input.shape[3];
-    
-        output.shape = {N, C, H, W};
-        output.resize();
-    
-        input_data = input.data;
-    
-        for (size_t c = 0; c < C; ++c) {
-            float mean = 0.0f, var = 0.0f;
-            size_t count = N * H * W;
-    
-            // Вычисление среднего
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        mean += input.data[idx];
-                    }
-                }
-            }
-            mean /= count;
-    
-            // Вычисление дисперсии
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        float diff = input.data[idx] - mean;
-                        var += diff * diff;
-                    }
-                }
-            }
-            var /= count;
-    
-            // Обновление running_mean и running_var
-            if (track_running_stats) {
-                if (first_update) {
-                    running_mean.data[c] = mean;
-                    running_var.data[c] = var;
-                } else {
-                    running_mean.data[c] = (1 - momentum) * running_mean.data[c] + momentum * mean;
-                    running_var.data[c] = (1 - momentum) * running_var.data[c] + momentum * var;
-                }
-            }
-    
-            float inv_std = 1.0f / std::sqrt(var + eps);
-    
-            // Вычисление выхода с учетом affine за пределами вложенных циклов
-            if (affine) {
-                for (size_t n = 0; n < N; ++n) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * H * W + c * H * W + h * W + w;
-                            float x_hat = (input.data[idx] - mean) * inv_std;
-                            output.data[idx] = gamma.data[c] * x_hat + beta.data[c];
+        return spatial;
+    }
+
+    // Размеры задачи: N примеров, C каналов, S элементов на канал.
+    // В NCHW канал c примера n - непрерывный отрезок длины S, в
+    // channels-last каждая из N * S строк - непрерывный вектор длины C
+    struct Dims
+    {
+        size_t N, C, S;
+        bool channels_last;
+    };
+
+    // Редукции идут блоками по kReduceBlock элементов канала (или по
+    // kReduceBlock / C строк channels-last). Частичные суммы блоков
+    // складываются деревом. Разбиение зависит только от размеров тензора,
+    // поэтому результат побитово одинаков при любом числе потоков
+    static constexpr size_t kReduceBlock = 4096;
+
+    // Суммы по каналам для x_hat = (x - shift[c]) * scale[c]:
+    // при dy != nullptr sum_a = sum(dy), sum_b = sum(dy * x_hat),
+    // иначе sum_a = sum(x_hat), sum_b = sum(x_hat^2)
+    static void reduce_channels(const Dims &d, const float *x,
+                                const float *dy, const float *shift,
+                                const float *scale, float *sum_a,
+                                float *sum_b)
+    {
+        if (!d.channels_last)
+        {
+            // Блок k канала c - элементы [k * B, (k + 1) * B) в порядке
+            // (n, s). Параллелим по парам (c, k): при большом C это
+            // параллелизм по каналам, при малом - по блокам N * S
+            const size_t len = d.N * d.S;
+            const size_t K = (len + kReduceBlock - 1) / kReduceBlock;
+            std::vector<float> part_a(d.C * K), part_b(d.C * K);
+            parallel_for(
+                0, d.C * K, parallel_grain(std::min(len, kReduceBlock)),
+                [&](size_t begin, size_t end) {
+                    for (size_t item = begin; item < end; ++item)
+                    {
+                        const size_t c = item / K;
+                        const size_t i1 =
+                            std::min(len, (item % K + 1) * kReduceBlock);
+                        float a = 0.0f, b = 0.0f;
+                        for (size_t i = (item % K) * kReduceBlock; i < i1;)
+                        {
+                            const size_t n = i / d.S;
+                            const size_t s0 = i % d.S;
+                            const size_t s1 = std::min(d.S, s0 + (i1 - i));
+                            const size_t offset = (n * d.C + c) * d.S;
+                            for (size_t s = s0; s < s1; ++s)
+                            {
+                                float x_hat =
+                                    (x[offset + s] - shift[c]) * scale[c];
+                                float v = dy ? dy[offset + s] : x_hat;
+                                a += v;
+                                b += v * x_hat;
+                            }
+                            i += s1 - s0;
                         }
+                        part_a[c * K + item % K] = a;
+                        part_b[c * K + item % K] = b;
                     }
-                }
-            } else {
-                for (size_t n = 0; n < N; ++n) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * H * W + c * H * W + h * W + w;
-                            float x_hat = (input.data[idx] - mean) * inv_std;
-                            output.data[idx] = x_hat;
+                });
+            for (size_t c = 0; c < d.C; ++c)
+            {
+                tree_reduce(part_a.data() + c * K, K, 1);
+                tree_reduce(part_b.data() + c * K, K, 1);
+                sum_a[c] = part_a[c * K];
+                sum_b[c] = part_b[c * K];
+            }
+            return;
+        }
+
+        // Channels-last: каждый поток накапливает векторы сумм длины C по
+        // своим блокам строк, затем блоки объединяются
+        const size_t rows = d.N * d.S;
+        const size_t rows_per_block = std::max<size_t>(1, kReduceBlock / d.C);
+        const size_t K = (rows + rows_per_block - 1) / rows_per_block;
+        std::vector<float> part_a(K * d.C, 0.0f), part_b(K * d.C, 0.0f);
+        parallel_for(
+            0, K, parallel_grain(rows_per_block * d.C),
+            [&](size_t begin, size_t end) {
+                for (size_t k = begin; k < end; ++k)
+                {
+                    float *pa = part_a.data() + k * d.C;
+                    float *pb = part_b.data() + k * d.C;
+                    const size_t r1 = std::min(rows, (k + 1) * rows_per_block);
+                    for (size_t r = k * rows_per_block; r < r1; ++r)
+                    {
+                        const float *xr = x + r * d.C;
+                        const float *dyr = dy ? dy + r * d.C : nullptr;
+                        // Внутренний цикл идет по непрерывной оси каналов
+                        for (size_t c = 0; c < d.C; ++c)
+                        {
+                            float x_hat = (xr[c] - shift[c]) * scale[c];
+                            float v = dyr ? dyr[c] : x_hat;
+                            pa[c] += v;
+                            pb[c] += v * x_hat;
                         }
                     }
                 }
-            }
+            });
+        tree_reduce(part_a.data(), K, d.C);
+        tree_reduce(part_b.data(), K, d.C);
+        std::copy(part_a.begin(), part_a.begin() + d.C, sum_a);
+        std::copy(part_b.begin(), part_b.begin() + d.C, sum_b);
+    }
+
+    // out = in * scale[c] + shift[c], допускается in == out
+    static void scale_shift(const Dims &d, const float *in, float *out,
+                            const float *scale, const float *shift)
+    {
+        if (!d.channels_last)
+        {
+            parallel_for(0, d.N * d.C, parallel_grain(d.S),
+                         [&](size_t begin, size_t end) {
+                             for (size_t nc = begin; nc < end; ++nc)
+                             {
+                                 const size_t c = nc % d.C;
+                                 const size_t offset = nc * d.S;
+                                 for (size_t s = 0; s < d.S; ++s)
+                                 {
+                                     out[offset + s] =
+                                         in[offset + s] * scale[c] + shift[c];
+                                 }
+                             }
+                         });
+            return;
         }
-    
-        first_update = false;
+
+        parallel_for(0, d.N * d.S, parallel_grain(d.C),
+                     [&](size_t begin, size_t end) {
+                         for (size_t r = begin; r < end; ++r)
+                         {
+                             const float *in_r = in + r * d.C;
+                             float *out_r = out + r * d.C;
+                             for (size_t c = 0; c < d.C; ++c)
+                             {
+                                 out_r[c] = in_r[c] * scale[c] + shift[c];
+                             }
+                         }
+                     });
+    }
+
+    // dx = k[c] * (dy - mean_dy[c] - x_hat * mean_dy_x_hat[c]),
+    // x_hat = (x - shift[c]) * scale[c]
+    static void input_grad(const Dims &d, const float *x, const float *dy,
+                           float *dx, const float *shift, const float *scale,
+                           const float *k, const float *mean_dy,
+                           const float *mean_dy_x_hat)
+    {
+        const bool cl = d.channels_last;
+        const size_t outer = cl ? d.N * d.S : d.N * d.C;
+        const size_t inner = cl ? d.C : d.S;
+        parallel_for(0, outer, parallel_grain(inner),
+                     [&](size_t begin, size_t end) {
+                         for (size_t o = begin; o < end; ++o)
+                         {
+                             const size_t channel = o % d.C;
+                             for (size_t j = 0; j < inner; ++j)
+                             {
+                                 const size_t i = o * inner + j;
+                                 const size_t c = cl ? j : channel;
+                                 float x_hat = (x[i] - shift[c]) * scale[c];
+                                 dx[i] = k[c] * (dy[i] - mean_dy[c] -
+                                                 x_hat * mean_dy_x_hat[c]);
+                             }
+                         }
+                     });
+    }
+
+    Dims dims(const Tensor &t) const
+    {
+        return {t.shape[0], num_features, spatial_size(t.shape),
+                t.memory_format == MemoryFormat::ChannelsLast};
     }
 
-    void backward(const Tensor &grad_output, Tensor &grad_input) override {
-        if (input_data.empty()) {
-            throw std::runtime_error("input_data пустой. Сначала вызовите forward()");
+  public:
+    // Две редукции по каналам и нормализация
+    size_t cost(const std::vector<size_t> &input_shape) const override
+    {
+        return Layer::cost(input_shape) * 4;
+    }
+
+    // Пересчитывает eval_scale/eval_shift по running-статистикам:
+    // scale = gamma / sqrt(running_var + eps), shift = beta - mean * scale
+    void update_eval_params()
+    {
+        eval_scale.resize(num_features);
+        eval_shift.resize(num_features);
+        for (size_t c = 0; c < num_features; ++c)
+        {
+            float inv_std = 1.0f / std::sqrt(running_var.data[c] + eps);
+            float g = affine ? gamma.data[c] : 1.0f;
+            float b = affine ? beta.data[c] : 0.0f;
+            eval_scale[c] = g * inv_std;
+            eval_shift[c] = b - running_mean.data[c] * eval_scale[c];
         }
-        if (grad_output.shape.size() != 4 || grad_output.shape[1] != num_features) {
-            throw std::invalid_argument("grad_output должен быть [N, C, H, W]");
+    }
+
+    void forward(const Tensor &input, Tensor &output) override
+    {
+        check_input(input);
+
+        const Dims d = dims(input);
+        const size_t C = d.C;
+
+        if (!training && track_running_stats)
+        {
+            // Один проход x * scale + shift, допускается &input == &output
+            reads_input = false;
+            saved_shape.clear();
+            update_eval_params();
+            output.shape = input.shape;
+            output.memory_format = input.memory_format;
+            output.resize();
+            scale_shift(d, input.data.data(), output.data.data(),
+                        eval_scale.data(), eval_shift.data());
+            return;
         }
-        if (grad_output.grad.empty()) {
-            throw std::runtime_error("grad_output.grad пустой");
+
+        // Для backward нужны только x_hat и inv_std. Вход не копируется:
+        // backward получает его снова (в Model это тензор из activations).
+        // При forward на месте вход перезаписывается, поэтому храним x_hat.
+        // Без градиентов (NoGradGuard) состояние для backward не хранится
+        const bool save = is_grad_enabled();
+        const bool in_place = &input == &output;
+        reads_input = save && !in_place;
+        saved_shape = save ? input.shape : std::vector<size_t>();
+        saved_format = input.memory_format;
+        saved_mean.assign(C, 0.0f);
+        saved_inv_std.assign(C, 1.0f);
+
+        // Среднее, затем дисперсия как среднее (x - mean)^2
+        const float count = static_cast<float>(d.N * d.S);
+        std::vector<float> sum(C), sum_sq(C), ones(C, 1.0f), zeros(C, 0.0f);
+        reduce_channels(d, input.data.data(), nullptr, zeros.data(),
+                        ones.data(), sum.data(), sum_sq.data());
+        for (size_t c = 0; c < C; ++c)
+        {
+            saved_mean[c] = sum[c] / count;
         }
-        if (input_data.size() != grad_output.shape[0] * num_features * grad_output.shape[2] * grad_output.shape[3]) {
-            throw std::runtime_error("Размер input_data не соответствует ожидаемому");
-        }
-        if (affine && (gamma.grad.size() != num_features || beta.grad.size() != num_features)) {
-            throw std::runtime_error("Градиенты gamma или beta имеют неправильный размер");
-        }
-    
-        size_t N = grad_output.shape[0];
-        size_t C = grad_output.shape[1];
-        size_t H = grad_output.shape[2];
-        size_t W = grad_output.shape[3];
-    
-        grad_input.shape = {N, C, H, W};
-        grad_input.resize();
-        grad_input.resize_grad();
-    
-        const size_t count = N * H * W; 
-        for (size_t c = 0; c < C; ++c) {
-            float mean = 0.0f, var = 0.0f;
-    
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        mean += input_data[idx];
-                    }
+        reduce_channels(d, input.data.data(), nullptr, saved_mean.data(),
+                        ones.data(), sum.data(), sum_sq.data());
+
+        std::vector<float> scale(C), shift(C);
+        for (size_t c = 0; c < C; ++c)
+        {
+            const float mean = saved_mean[c];
+            const float var = sum_sq[c] / count;
+
+            if (training && track_running_stats)
+            {
+                if (first_update)
+                {
+                    running_mean.data[c] = mean;
+                    running_var.data[c] = var;
                 }
-            }
-            mean /= count;
-    
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        float diff = input_data[idx] - mean;
-                        var += diff * diff;
-                    }
+                else
+                {
+                    running_mean.data[c] =
+                        (1 - momentum) * running_mean.data[c] + momentum * mean;
+                    running_var.data[c] =
+                        (1 - momentum) * running_var.data[c] + momentum * var;
                 }
             }
-            var /= count;
-    
-            float inv_std = 1.0f / std::sqrt(var + eps);
-            float gamma_val = affine ? gamma.data[c] : 1.0f;
-    
-            float sum_dy = 0.0f, sum_dy_x_hat = 0.0f;
-            std::vector<float> x_hat(count);
-            size_t pos = 0;
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        x_hat[pos] = (input_data[idx] - mean) * inv_std;
-                        sum_dy += grad_output.grad[idx];
-                        sum_dy_x_hat += grad_output.grad[idx] * x_hat[pos];
-                        pos++;
-                    }
-                }
+
+            saved_inv_std[c] = 1.0f / std::sqrt(var + eps);
+            const float g = affine ? gamma.data[c] : 1.0f;
+            const float b = affine ? beta.data[c] : 0.0f;
+            scale[c] = g * saved_inv_std[c];
+            shift[c] = b - mean * scale[c];
+        }
+
+        if (in_place && save)
+        {
+            // x_hat = (x - mean) * inv_std, затем y = gamma * x_hat + beta
+            saved_x_hat.resize(input.data.size());
+            for (size_t c = 0; c < C; ++c)
+            {
+                shift[c] = -saved_mean[c] * saved_inv_std[c];
             }
-    
-            pos = 0;
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t h = 0; h < H; ++h) {
-                    for (size_t w = 0; w < W; ++w) {
-                        size_t idx = n * C * H * W + c * H * W + h * W + w;
-                        float dy = grad_output.grad[idx];
-                        float dx_hat = dy;
-                        float term1 = dx_hat * inv_std * gamma_val;
-                        float term2 = inv_std * sum_dy / count * gamma_val;
-                        float term3 = inv_std * x_hat[pos] * sum_dy_x_hat / count * gamma_val;
-                        grad_input.grad[idx] = term1 - term2 - term3;
-    
-                        if (affine) {
-                            beta.grad[c] += dy;
-                            gamma.grad[c] += dy * x_hat[pos];
-                        }
-                        pos++;
-                    }
-                }
+            scale_shift(d, input.data.data(), saved_x_hat.data(),
+                        saved_inv_std.data(), shift.data());
+            for (size_t c = 0; c < C; ++c)
+            {
+                scale[c] = affine ? gamma.data[c] : 1.0f;
+                shift[c] = affine ? beta.data[c] : 0.0f;
             }
+            scale_shift(d, saved_x_hat.data(), output.data.data(),
+                        scale.data(), shift.data());
+        }
+        else
+        {
+            saved_x_hat.clear();
+            saved_x_hat.shrink_to_fit();
+            output.shape = input.shape;
+            output.memory_format = input.memory_format;
+            output.resize();
+            scale_shift(d, input.data.data(), output.data.data(),
+                        scale.data(), shift.data());
+        }
+
+        if (training)
+        {
+            first_update = false;
         }
     }
 
-    std::string to_string() const override {
-        std::stringstream ss;
-        ss << "BatchNorm2d(" << num_features << ")";
-        return ss.str();
+    void backward(const Tensor &grad_output, Tensor &grad_input) override
+    {
+        if (saved_shape.empty())
+        {
+            throw std::runtime_error(
+                "input_data пустой. Сначала вызовите forward()");
+        }
+        check_grad_output(grad_output);
+        if (grad_output.grad.empty())
+        {
+            throw std::runtime_error("grad_output.grad пустой");
+        }
+        if (grad_output.memory_format != saved_format)
+        {
+            throw std::invalid_argument(
+                "Формат памяти grad_output не совпадает с форматом входа");
+        }
+        const size_t saved_size =
+            reads_input ? grad_input.data.size() : saved_x_hat.size();
+        if (saved_shape != grad_output.shape ||
+            saved_size != grad_output.size())
+        {
+            throw std::runtime_error(
+                "Размер input_data не соответствует ожидаемому");
+        }
+
+        const Dims d = dims(grad_output);
+        const size_t C = d.C;
+
+        // x_hat = (x - shift) * scale: по входу это (x - mean) * inv_std,
+        // по сохраненному x_hat - тождественное преобразование
+        const float *x = reads_input ? grad_input.data.data()
+                                     : saved_x_hat.data();
+        std::vector<float> zeros(C, 0.0f), ones(C, 1.0f);
+        const float *shift = reads_input ? saved_mean.data() : zeros.data();
+        const float *scale = reads_input ? saved_inv_std.data() : ones.data();
+
+        std::vector<float> sum_dy(C), sum_dy_x_hat(C);
+        reduce_channels(d, x, grad_output.grad.data(), shift, scale,
+                        sum_dy.data(), sum_dy_x_hat.data());
+
+        // dx = gamma * inv_std * (dy - mean(dy) - x_hat * mean(dy * x_hat))
+        const float count = static_cast<float>(d.N * d.S);
+        std::vector<float> k(C), mean_dy(C), mean_dy_x_hat(C);
+        for (size_t c = 0; c < C; ++c)
+        {
+            k[c] = (affine ? gamma.data[c] : 1.0f) * saved_inv_std[c];
+            mean_dy[c] = sum_dy[c] / count;
+            mean_dy_x_hat[c] = sum_dy_x_hat[c] / count;
+        }
+        if (grad_input.requires_grad)
+        {
+            // grad_input - вход forward: resize его данные не меняет, а x
+            // указывает в них же
+            grad_input.shape = grad_output.shape;
+            grad_input.memory_format = grad_output.memory_format;
+            grad_input.resize();
+            grad_input.resize_grad();
+            input_grad(d, x, grad_output.grad.data(), grad_input.grad.data(),
+                       shift, scale, k.data(), mean_dy.data(),
+                       mean_dy_x_hat.data());
+        }
+
+        if (affine)
+        {
+            gamma.resize_grad();
+            beta.resize_grad();
+            for (size_t c = 0; c < C; ++c)
+            {
+                beta.grad[c] += sum_dy[c];
+                gamma.grad[c] += sum_dy_x_hat[c];
+            }
+        }
     }
 
-    std::vector<Tensor *> parameters() override {
-        if (affine) {
+    std::vector<Tensor *> parameters() override
+    {
+        if (affine)
+        {
             return {&gamma, &beta};
         }
         return {};
     }
 };
 
-class BatchNorm3d : public Layer {
-private:
-    size_t num_features;
-    float eps;
-    float momentum;
-    bool affine;
-    bool track_running_stats;
+class BatchNorm1d : public BatchNorm
+{
+  protected:
+    void check_input(const Tensor &input) const override
+    {
+        if (input.shape.size() != 2 || input.shape[1] != num_features)
+        {
+            throw std::invalid_argument(
+                "Входной тензор должен быть [batch_size, num_features]");
+        }
+    }
 
-    Tensor gamma;
-    Tensor beta;
-    Tensor running_mean;
-    Tensor running_var;
+    void check_grad_output(const Tensor &grad_output) const override
+    {
+        if (grad_output.shape.size() != 2 ||
+            grad_output.shape[1] != num_features)
+        {
+            throw std::invalid_argument(
+                "grad_output должен быть [batch_size, num_features]");
+        }
+    }
 
-    std::vector<float> input_data;
-    bool first_update = true;
+  public:
+    BatchNorm1d(size_t num_features, float eps = 1e-5, float momentum = 0.1,
+                bool affine = true, bool track_running_stats = true)
+        : BatchNorm(num_features, eps, momentum, affine, track_running_stats)
+    {
+    }
 
-public:
-    BatchNorm3d(size_t num_features,
-                float eps = 1e-5,
-                float momentum = 0.1,
-                bool affine = true,
-                bool track_running_stats = true)
-        : num_features(num_features),
-            eps(eps),
-            momentum(momentum),
-            affine(affine),
-            track_running_stats(track_running_stats) {
-
-        if (affine) {
-            gamma.shape = {num_features};
-            gamma.resize();
-            gamma.resize_grad();
-            beta.shape = {num_features};
-            beta.resize();
-            beta.resize_grad();
-            std::random_device rd;
-            std::mt19937 gen(rd());
-            std::uniform_real_distribution<float> dis(0.9f, 1.1f);
-            for (size_t i = 0; i < num_features; ++i) {
-                gamma.data[i] = dis(gen);
-                beta.data[i] = 0.0f;
-            }
+    // Linear + BatchNorm1d: W'[k][j] = W[k][j] * scale[j],
+    // b'[j] = b[j] * scale[j] + shift[j]
+    bool fuse_into(Layer &previous) override
+    {
+        Linear *linear = dynamic_cast<Linear *>(&previous);
+        if (!linear || !track_running_stats ||
+            linear->weight.shape[1] != num_features)
+        {
+            return false;
         }
 
-        if (track_running_stats) {
-            running_mean.shape = {num_features};
-            running_mean.resize();
-            running_var.shape = {num_features};
-            running_var.resize();
+        update_eval_params();
+        linear->parameters_changed();
+        const size_t in_features = linear->weight.shape[0];
+        for (size_t k = 0; k < in_features; ++k)
+        {
+            for (size_t j = 0; j < num_features; ++j)
+            {
+                linear->weight.data[k * num_features + j] *= eval_scale[j];
+            }
+        }
+        for (size_t j = 0; j < num_features; ++j)
+        {
+            linear->bias.data[j] =
+                linear->bias.data[j] * eval_scale[j] + eval_shift[j];
         }
+        return true;
+    }
+
+    Layer *clone() const override { return new BatchNorm1d(*this); }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "BatchNorm1d(" << num_features << ")";
+        return ss.str();
     }
+};
 
-    void forward(const Tensor &input, Tensor &output) override {
-        if (input.shape.size() != 5) {
-            throw std::invalid_argument("Входной тензор должен быть [N, C, D, H, W]");
+class BatchNorm2d : public BatchNorm
+{
+  protected:
+    void check_input(const Tensor &input) const override
+    {
+        if (input.shape.size() != 4)
+        {
+            throw std::invalid_argument("Входной тензор должен быть [N, C, H, W]");
         }
-        if (input.shape[1] != num_features) {
-            throw std::invalid_argument("Количество каналов должно соответствовать num_features");
+        if (input.shape[1] != num_features)
+        {
+            throw std::invalid_argument(
+                "Количество каналов должно соответствовать num_features");
         }
-        if (input.data.size() != input.size()) {
-            throw std::runtime_error("Размер входных данных не соответствует shape");
+        if (input.data.size() != input.size())
+        {
+            throw std::runtime_error(
+                "Размер входных данных не соответствует shape");
         }
-    
-        size_t N = input.shape[0];
-        size_t C = input.shape[1];
-        size_t D = input.shape[2];
-        size_t H = input.shape[3];
-        size_t W = input.shape[4];
-    
-        output.shape = {N, C, D, H, W};
-        output.resize();
-    
-        input_data = input.data;
-    
-        for (size_t c = 0; c < C; ++c) {
-            float mean = 0.0f, var = 0.0f;
-            size_t count = N * D * H * W;
-    
-            // Вычисление среднего
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            mean += input.data[idx];
-                        }
-                    }
-                }
-            }
-            mean /= count;
-    
-            // Вычисление дисперсии
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            float diff = input.data[idx] - mean;
-                            var += diff * diff;
-                        }
-                    }
-                }
-            }
-            var /= count;
-    
-            // Обновление running_mean и running_var
-            if (track_running_stats) {
-                if (first_update) {
-                    running_mean.data[c] = mean;
-                    running_var.data[c] = var;
-                } else {
-                    running_mean.data[c] = (1 - momentum) * running_mean.data[c] + momentum * mean;
-                    running_var.data[c] = (1 - momentum) * running_var.data[c] + momentum * var;
-                }
-            }
-    
-            float inv_std = 1.0f / std::sqrt(var + eps);
-    
-            // Вычисление выхода с учетом affine за пределами вложенных циклов
-            if (affine) {
-                for (size_t n = 0; n < N; ++n) {
-                    for (size_t d = 0; d < D; ++d) {
-                        for (size_t h = 0; h < H; ++h) {
-                            for (size_t w = 0; w < W; ++w) {
-                                size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                                float x_hat = (input.data[idx] - mean) * inv_std;
-                                output.data[idx] = gamma.data[c] * x_hat + beta.data[c];
-                            }
-                        }
-                    }
-                }
-            } else {
-                for (size_t n = 0; n < N; ++n) {
-                    for (size_t d = 0; d < D; ++d) {
-                        for (size_t h = 0; h < H; ++h) {
-                            for (size_t w = 0; w < W; ++w) {
-                                size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                                float x_hat = (input.data[idx] - mean) * inv_std;
-                                output.data[idx] = x_hat;
-                            }
-                        }
-                    }
-                }
-            }
+    }
+
+    void check_grad_output(const Tensor &grad_output) const override
+    {
+        if (grad_output.shape.size() != 4 ||
+            grad_output.shape[1] != num_features)
+        {
+            throw std::invalid_argument("grad_output должен быть [N, C, H, W]");
         }
-    
-        first_update = false;
     }
 
-    void backward(const Tensor &grad_output, Tensor &grad_input) override {
-        if (input_data.empty()) {
-            throw std::runtime_error("input_data пустой. Сначала вызовите forward()");
+  public:
+    BatchNorm2d(size_t num_features, float eps = 1e-5, float momentum = 0.1,
+                bool affine = true, bool track_running_stats = true)
+        : BatchNorm(num_features, eps, momentum, affine, track_running_stats)
+    {
+    }
+
+    Layer *clone() const override { return new BatchNorm2d(*this); }
+
+    std::string to_string() const override
+    {
+        std::stringstream ss;
+        ss << "BatchNorm2d(" << num_features << ")";
+        return ss.str();
+    }
+};
+
+class BatchNorm3d : public BatchNorm
+{
+  protected:
+    void check_input(const Tensor &input) const override
+    {
+        if (input.shape.size() != 5)
+        {
+            throw std::invalid_argument(
+                "Входной тензор должен быть [N, C, D, H, W]");
         }
-        if (grad_output.shape.size() != 5 || grad_output.shape[1] != num_features) {
-            throw std::invalid_argument("grad_output должен быть [N, C, D, H, W]");
+        if (input.shape[1] != num_features)
+        {
+            throw std::invalid_argument(
+                "Количество каналов должно соответствовать num_features");
         }
-        if (grad_output.grad.empty()) {
-            throw std::runtime_error("grad_output.grad пустой");
+        if (input.data.size() != input.size())
+        {
+            throw std::runtime_error(
+                "Размер входных данных не соответствует shape");
         }
-        if (input_data.size() != grad_output.shape[0] * num_features * grad_output.shape[2] * grad_output.shape[3] * grad_output.shape[4]) {
-            throw std::runtime_error("Размер input_data не соответствует ожидаемому");
-        }
-        if (affine && (gamma.grad.size() != num_features || beta.grad.size() != num_features)) {
-            throw std::runtime_error("Градиенты gamma или beta имеют неправильный размер");
-        }
-    
-        size_t N = grad_output.shape[0];
-        size_t C = grad_output.shape[1];
-        size_t D = grad_output.shape[2];
-        size_t H = grad_output.shape[3];
-        size_t W = grad_output.shape[4];
-    
-        grad_input.shape = {N, C, D, H, W};
-        grad_input.resize();
-        grad_input.resize_grad();
-    
-        const size_t count = N * D * H * W; // Перемещено и помечено как const
-        for (size_t c = 0; c < C; ++c) {
-            float mean = 0.0f, var = 0.0f;
-    
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            mean += input_data[idx];
-                        }
-                    }
-                }
-            }
-            mean /= count;
-    
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            float diff = input_data[idx] - mean;
-                            var += diff * diff;
-                        }
-                    }
-                }
-            }
-            var /= count;
-    
-            float inv_std = 1.0f / std::sqrt(var + eps);
-            float gamma_val = affine ? gamma.data[c] : 1.0f;
-    
-            float sum_dy = 0.0f, sum_dy_x_hat = 0.0f;
-            std::vector<float> x_hat(count);
-            size_t pos = 0;
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            x_hat[pos] = (input_data[idx] - mean) * inv_std;
-                            sum_dy += grad_output.grad[idx];
-                            sum_dy_x_hat += grad_output.grad[idx] * x_hat[pos];
-                            pos++;
-                        }
-                    }
-                }
-            }
-    
-            pos = 0;
-            for (size_t n = 0; n < N; ++n) {
-                for (size_t d = 0; d < D; ++d) {
-                    for (size_t h = 0; h < H; ++h) {
-                        for (size_t w = 0; w < W; ++w) {
-                            size_t idx = n * C * D * H * W + c * D * H * W + d * H * W + h * W + w;
-                            float dy = grad_output.grad[idx];
-                            float dx_hat = dy;
-                            float term1 = dx_hat * inv_std * gamma_val;
-                            float term2 = inv_std * sum_dy / count * gamma_val;
-                            float term3 = inv_std * x_hat[pos] * sum_dy_x_hat / count * gamma_val;
-                            grad_input.grad[idx] = term1 - term2 - term3;
-    
-                            if (affine) {
-                                beta.grad[c] += dy;
-                                gamma.grad[c] += dy * x_hat[pos];
-                            }
-                            pos++;
-                        }
-                    }
-                }
-            }
+    }
+
+    void check_grad_output(const Tensor &grad_output) const override
+    {
+        if (grad_output.shape.size() != 5 ||
+            grad_output.shape[1] != num_features)
+        {
+            throw std::invalid_argument(
+                "grad_output должен быть [N, C, D, H, W]");
         }
     }
 
-    std::string to_string() const override {
+  public:
+    BatchNorm3d(size_t num_features, float eps = 1e-5, float momentum = 0.1,
+                bool affine = true, bool track_running_stats = true)
+        : BatchNorm(num_features, eps, momentum, affine, track_running_stats)
+    {
+    }
+
+    Layer *clone() const override { return new BatchNorm3d(*this); }
+
+    std::string to_string() const override
+    {
         std::stringstream ss;
         ss << "BatchNorm3d(" << num_features << ")";
         return ss.str();
     }
-
-    std::vector<Tensor *> parameters() override {
-        if (affine) {
-            return {&gamma, &beta};
-        }
-        return {};
-    }
 };
 
 } // namespace ttie
@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 #include <random>
 #include <cmath>
+#include <memory>
 
 using namespace ttie;
 
@@ -57,6 +58,237 @@ TEST(TensorTest, GradientOperations)
     }
 }
 
+TEST(TensorTest, StorageView)
+{
+    std::vector<float> buffer(6, 0.0f);
+    Storage<float> view = Storage<float>::view(buffer.data(), 4);
+    EXPECT_TRUE(view.is_view());
+
+    // Запись того же размера идет в чужой буфер
+    view = {1.0f, 2.0f, 3.0f, 4.0f};
+    EXPECT_FLOAT_EQ(buffer[2], 3.0f);
+    view.resize(4);
+    EXPECT_TRUE(view.is_view());
+
+    // Перемещение и rebind меняют привязку, не записывая в старый буфер
+    Storage<float> moved = Storage<float>::view(buffer.data(), 4);
+    moved = Storage<float>::view(buffer.data() + 2, 4);
+    EXPECT_EQ(moved.data(), buffer.data() + 2);
+    EXPECT_FLOAT_EQ(buffer[0], 1.0f);
+    moved = Storage<float>(4, 5.0f);
+    EXPECT_FALSE(moved.is_view());
+    EXPECT_FLOAT_EQ(buffer[2], 3.0f);
+    moved.rebind(buffer.data(), 2);
+    EXPECT_TRUE(moved.is_view());
+    EXPECT_EQ(moved.size(), 2);
+    moved[1] = 8.0f;
+    EXPECT_FLOAT_EQ(buffer[1], 8.0f);
+    buffer[1] = 2.0f;
+
+    // Изменение размера переводит на собственную память
+    view.resize(5, 7.0f);
+    EXPECT_FALSE(view.is_view());
+    EXPECT_EQ(view, std::vector<float>({1.0f, 2.0f, 3.0f, 4.0f, 7.0f}));
+    view[0] = 10.0f;
+    EXPECT_FLOAT_EQ(buffer[0], 1.0f);
+}
+
+TEST(TensorTest, CachingAllocatorSizeClasses)
+{
+    EXPECT_EQ(CachingAllocator::class_bytes(CachingAllocator::size_class(1)), 64);
+    EXPECT_EQ(CachingAllocator::class_bytes(CachingAllocator::size_class(65)), 80);
+    EXPECT_EQ(CachingAllocator::class_bytes(CachingAllocator::size_class(128)), 128);
+    EXPECT_EQ(CachingAllocator::class_bytes(CachingAllocator::size_class(129)), 160);
+    for (size_t bytes = 1; bytes < 100000; bytes += 37)
+    {
+        size_t rounded = CachingAllocator::class_bytes(CachingAllocator::size_class(bytes));
+        EXPECT_GE(rounded, bytes);
+        EXPECT_LE(rounded, std::max<size_t>(64, bytes + bytes / 4));
+    }
+}
+
+TEST(TensorTest, StorageAlignment)
+{
+    for (Allocator *allocator :
+         {static_cast<Allocator *>(&system_allocator()),
+          static_cast<Allocator *>(&CachingAllocator::instance())})
+    {
+        set_allocator(allocator);
+        for (size_t n : {1, 3, 17, 1000, 4097})
+        {
+            Tensor t;
+            t.shape = {n};
+            t.resize();
+            t.resize_grad();
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(t.data.data()) % kTensorAlignment, 0);
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(t.grad.data()) % kTensorAlignment, 0);
+        }
+    }
+    set_allocator(nullptr);
+    CachingAllocator::instance().release_cached();
+
+    set_huge_pages(true);
+    {
+        Tensor big;
+        big.shape = {kHugePageSize / sizeof(float) + 1};
+        big.resize();
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(big.data.data()) % kHugePageSize, 0);
+        big.data.back() = 1.0f;
+    }
+    set_huge_pages(false);
+}
+
+TEST(TensorTest, ChannelsLastRoundTrip)
+{
+    Tensor t;
+    t.shape = {2, 3, 2, 2};
+    t.resize();
+    std::iota(t.data.begin(), t.data.end(), 0.0f);
+
+    Tensor nhwc = t.to_memory_format(MemoryFormat::ChannelsLast);
+    EXPECT_EQ(nhwc.shape, t.shape);
+    EXPECT_EQ(nhwc.memory_format, MemoryFormat::ChannelsLast);
+    // Элемент (n=0, c=1, h=0, w=1): NCHW-индекс 5, NHWC-индекс 4
+    EXPECT_FLOAT_EQ(nhwc.data[4], t.data[5]);
+    EXPECT_THROW(nhwc.view({2, 12}), std::invalid_argument);
+
+    Tensor back = nhwc.contiguous();
+    EXPECT_EQ(back.memory_format, MemoryFormat::Contiguous);
+    EXPECT_EQ(back.data, t.data);
+}
+
+TEST(ParallelTest, ThreadPoolCoversRangeOnce)
+{
+    for (size_t threads : {1, 3})
+    {
+        set_num_threads(threads);
+        EXPECT_EQ(ThreadPool::instance().size(), threads);
+
+        std::vector<std::atomic<int>> hits(100000);
+        parallel_for(0, hits.size(), 1000, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                hits[i]++;
+            }
+        });
+        for (const std::atomic<int> &hit : hits)
+        {
+            EXPECT_EQ(hit.load(), 1);
+        }
+
+        // Вложенный parallel_for выполняется на том же пуле
+        std::atomic<size_t> total{0};
+        parallel_for(0, 8, 1, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+            {
+                parallel_for(0, 1000, 10, [&](size_t b, size_t e) {
+                    total += e - b;
+                });
+            }
+        });
+        EXPECT_EQ(total.load(), 8000);
+
+        // Несколько потоков вне пула отправляют задачи одновременно
+        std::atomic<size_t> covered{0};
+        std::vector<std::thread> submitters;
+        for (int t = 0; t < 4; ++t)
+        {
+            submitters.emplace_back([&]() {
+                for (int rep = 0; rep < 50; ++rep)
+                {
+                    parallel_for(0, 1000, 10, [&](size_t b, size_t e) {
+                        covered += e - b;
+                    });
+                }
+            });
+        }
+        for (std::thread &submitter : submitters)
+        {
+            submitter.join();
+        }
+        EXPECT_EQ(covered.load(), 4 * 50 * 1000);
+
+        EXPECT_THROW(parallel_for(0, 100, 1,
+                                  [](size_t, size_t last) {
+                                      if (last > 50)
+                                      {
+                                          throw std::runtime_error("task");
+                                      }
+                                  }),
+                     std::runtime_error);
+    }
+    set_num_threads(default_num_threads());
+}
+
+TEST(ParallelTest, ReduceIsDeterministic)
+{
+    std::vector<float> values(300000);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        values[i] = std::sin(0.01f * i) * 1e3f;
+    }
+    auto sum = [&]() {
+        return parallel_reduce(
+            0, values.size(), 1000, 0.0f,
+            [&](size_t first, size_t last) {
+                float s = 0.0f;
+                for (size_t i = first; i < last; ++i)
+                {
+                    s += values[i];
+                }
+                return s;
+            },
+            [](float a, float b) { return a + b; });
+    };
+
+    set_num_threads(1);
+    const float reference = sum();
+    for (size_t threads : {2, 4})
+    {
+        set_num_threads(threads);
+        EXPECT_EQ(sum(), reference);
+    }
+    set_num_threads(default_num_threads());
+
+    // Маленький диапазон считается одним отрезком
+    EXPECT_FLOAT_EQ(parallel_reduce(
+                        0, 10, parallel_grain(1), 0.0f,
+                        [](size_t first, size_t last) {
+                            return static_cast<float>(last - first);
+                        },
+                        [](float a, float b) { return a + b; }),
+                    10.0f);
+}
+
+TEST(ParallelTest, NumaTopologyAndPinning)
+{
+    EXPECT_EQ(parse_cpu_list("0-3,8,10-11\n"),
+              (std::vector<size_t>{0, 1, 2, 3, 8, 10, 11}));
+    EXPECT_TRUE(parse_cpu_list("").empty());
+
+    const NumaTopology &topology = NumaTopology::instance();
+    ASSERT_GE(topology.num_nodes(), 1);
+    for (size_t node = 0; node < topology.num_nodes(); ++node)
+    {
+        ASSERT_FALSE(topology.node_cpus[node].empty());
+        for (size_t cpu : topology.node_cpus[node])
+        {
+            EXPECT_EQ(topology.node_of_cpu(cpu), node);
+        }
+    }
+    EXPECT_LT(current_numa_node(), topology.num_nodes());
+
+    // Пул с привязкой потоков и заполнение большого буфера на нем
+    set_num_threads(3);
+    set_thread_pinning(true);
+    EXPECT_TRUE(thread_pinning_enabled());
+    Storage<float> big(kFirstTouchBytes, 2.0f);
+    EXPECT_TRUE(std::all_of(big.begin(), big.end(),
+                            [](float v) { return v == 2.0f; }));
+    set_thread_pinning(false);
+    set_num_threads(default_num_threads());
+}
+
 TEST(LayerTest, ReLU)
 {
     ReLU relu;
@@ -84,6 +316,7 @@ TEST(LayerTest, ReLU)
         output.grad[i] = 1.0f;
     }
 
+    input.requires_grad = true;
     relu.backward(output, input);
 
     for (size_t i = 0; i < input.grad.size(); ++i)
@@ -107,6 +340,7 @@ TEST(LayerTest, Sigmoid)
     EXPECT_NEAR(output.data[1], 0.73105858f, 1e-5f); // σ(1) ≈ 0.731
 
     output.grad = {1.0f, 1.0f};
+    input.requires_grad = true;
     sigmoid.backward(output, input);
 
     EXPECT_NEAR(input.grad[0], 0.25f, 1e-5f);       // σ'(0) = 0.25
@@ -128,6 +362,7 @@ TEST(LayerTest, Tanh)
     EXPECT_NEAR(output.data[1], 0.76159416f, 1e-5f); // tanh(1) ≈ 0.761
 
     output.grad = {1.0f, 1.0f};
+    input.requires_grad = true;
     tanh.backward(output, input);
 
     EXPECT_NEAR(input.grad[0], 1.0f, 1e-5f);        // tanh'(0) = 1
@@ -168,6 +403,7 @@ TEST(LayerTest, Linear)
         output.grad[i] = 1.0f;
     }
 
+    input.requires_grad = true;
     input.resize_grad();
     input.zero_grad();
 
@@ -247,6 +483,7 @@ TEST(LayerTest, LinearVSTorch)
     input.shape = {2, 3};
     input.resize();
     input.data = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f};
+    input.requires_grad = true;
     input.resize_grad();
 
     // Forward pass
@@ -292,6 +529,29 @@ TEST(LayerTest, LinearVSTorch)
     EXPECT_NEAR(linear.bias.grad[1], 2.0f, 1e-5f);
 }
 
+// Модель из слоев layers; модель владеет слоями
+static Model *make_model(std::initializer_list<Layer *> layers)
+{
+    Model *model = new Model();
+    for (Layer *layer : layers)
+    {
+        model->add_layer(layer);
+    }
+    return model;
+}
+
+// Копирует значения параметров from в to; архитектуры моделей совпадают
+static void copy_parameters(Model &from, Model &to)
+{
+    std::vector<Tensor *> from_params = from.parameters();
+    std::vector<Tensor *> to_params = to.parameters();
+    ASSERT_EQ(from_params.size(), to_params.size());
+    for (size_t k = 0; k < to_params.size(); ++k)
+    {
+        to_params[k]->data = from_params[k]->data;
+    }
+}
+
 TEST(ModelTest, ForwardAndBackwardVSTorch)
 {
     /* Pytorch reference
@@ -348,70 +608,1721 @@ TEST(ModelTest, ForwardAndBackwardVSTorch)
     model.add_layer(new ReLU());
     model.add_layer(new Linear(2, 1));
 
-    // Initialize with the same values as in PyTorch reference
-    Linear *layer1 = static_cast<Linear *>(model.layers[0]);
-    layer1->weight.data = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f};
-    layer1->bias.data = {0.1f, 0.2f};
+    // Initialize with the same values as in PyTorch reference
+    Linear *layer1 = static_cast<Linear *>(model.layers[0]);
+    layer1->weight.data = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f};
+    layer1->bias.data = {0.1f, 0.2f};
+
+    Linear *layer2 = static_cast<Linear *>(model.layers[2]);
+    layer2->weight.data = {0.7f, 0.8f};
+    layer2->bias.data = {0.3f};
+
+    // Prepare input
+    Tensor input;
+    input.shape = {2, 3};
+    input.resize();
+    input.data = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f};
+    input.requires_grad = true;
+    input.resize_grad();
+
+    // Forward pass
+    Tensor output;
+    model.forward(input, output);
+
+    // Verify final output shape and values
+    ASSERT_EQ(output.shape.size(), 2);
+    ASSERT_EQ(output.shape[0], 2);
+    ASSERT_EQ(output.shape[1], 1);
+    EXPECT_NEAR(output.data[0], 0.9080f, 1e-4f);
+    EXPECT_NEAR(output.data[1], 1.3850f, 1e-4f);
+
+    // Backward pass
+    output.resize_grad();
+    output.grad = {1.0f, 1.0f};
+
+    model.backward(output, input);
+
+    // Check input gradients
+    ASSERT_EQ(input.grad.size(), 6);
+    EXPECT_NEAR(input.grad[0], 0.2300f, 1e-4f);
+    EXPECT_NEAR(input.grad[1], 0.5300f, 1e-4f);
+    EXPECT_NEAR(input.grad[2], 0.8300f, 1e-4f);
+    EXPECT_NEAR(input.grad[3], 0.2300f, 1e-4f);
+    EXPECT_NEAR(input.grad[4], 0.5300f, 1e-4f);
+    EXPECT_NEAR(input.grad[5], 0.8300f, 1e-4f);
+
+    // Check layer1 weight gradients
+    ASSERT_EQ(layer1->weight.grad.size(), 6);
+    EXPECT_NEAR(layer1->weight.grad[0], 0.3500f, 1e-4f);
+    EXPECT_NEAR(layer1->weight.grad[1], 0.4000f, 1e-4f);
+    EXPECT_NEAR(layer1->weight.grad[2], 0.4900f, 1e-4f);
+    EXPECT_NEAR(layer1->weight.grad[3], 0.5600f, 1e-4f);
+    EXPECT_NEAR(layer1->weight.grad[4], 0.6300f, 1e-4f);
+    EXPECT_NEAR(layer1->weight.grad[5], 0.7200f, 1e-4f);
+
+    // Check layer1 bias gradients
+    ASSERT_EQ(layer1->bias.grad.size(), 2);
+    EXPECT_NEAR(layer1->bias.grad[0], 1.4000f, 1e-4f);
+    EXPECT_NEAR(layer1->bias.grad[1], 1.6000f, 1e-4f);
+
+    // Check layer2 weight gradients
+    ASSERT_EQ(layer2->weight.grad.size(), 2);
+    EXPECT_NEAR(layer2->weight.grad[0], 0.9100f, 1e-4f);
+    EXPECT_NEAR(layer2->weight.grad[1], 1.3200f, 1e-4f);
+
+    // Check layer2 bias gradients
+    ASSERT_EQ(layer2->bias.grad.size(), 1);
+    EXPECT_NEAR(layer2->bias.grad[0], 2.0000f, 1e-4f);
+}
+
+TEST(ModelTest, MemoryPlanReusesActivationBuffers)
+{
+    Model model;
+    model.add_layer(new Linear(8, 64));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(64, 32));
+    model.add_layer(new Sigmoid());
+    model.add_layer(new Linear(32, 4));
+
+    MemoryPlan plan = model.plan_memory({5, 8});
+    ASSERT_EQ(plan.shapes.size(), 4);
+    EXPECT_EQ(plan.shapes[0], (std::vector<size_t>{5, 64}));
+    EXPECT_EQ(plan.shapes[3], (std::vector<size_t>{5, 32}));
+    EXPECT_EQ(plan.naive_size, 5 * (64 + 64 + 32 + 32));
+    // Цепочка укладывается в два буфера (ping-pong)
+    EXPECT_EQ(plan.arena_size, 5 * 64 + 5 * 64);
+    EXPECT_LT(plan.peak_bytes(), plan.naive_bytes());
+    for (size_t i = 0; i + 1 < plan.offsets.size(); ++i)
+    {
+        bool disjoint = plan.offsets[i] + plan.sizes[i] <= plan.offsets[i + 1] ||
+                        plan.offsets[i + 1] + plan.sizes[i + 1] <= plan.offsets[i];
+        EXPECT_TRUE(disjoint);
+    }
+    EXPECT_EQ(plan.to_string(), "MemoryPlan(activations=4, peak_bytes=2560, "
+                                "naive_bytes=3840)");
+
+    Tensor input;
+    input.shape = {5, 8};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.5f * i);
+    }
+
+    model.eval();
+    Tensor expected;
+    model.forward(input, expected);
+
+    model.plan_inference(input.shape);
+    Tensor output;
+    model.forward(input, output);
+    model.forward(input, output);
+    ASSERT_EQ(output.shape, expected.shape);
+    EXPECT_EQ(output.data, expected.data);
+    EXPECT_TRUE(model.activations[0].data.is_view());
+    EXPECT_THROW(model.backward(output, input), std::runtime_error);
+
+    // Другая форма входа или train() отключают план
+    model.train();
+    EXPECT_FALSE(model.planned);
+    model.forward(input, output);
+    output.resize_grad();
+    model.backward(output, input);
+    EXPECT_FALSE(model.activations[0].data.is_view());
+}
+
+TEST(ModelTest, NoGradForwardKeepsNoActivations)
+{
+    Model model;
+    model.add_layer(new Linear(4, 16));
+    model.add_layer(new BatchNorm1d(16));
+    model.add_layer(new Tanh());
+    model.add_layer(new Linear(16, 3));
+
+    Tensor input;
+    input.shape = {6, 4};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::cos(0.3f * i);
+    }
+
+    Tensor expected;
+    model.forward(input, expected);
+    EXPECT_EQ(model.activations.size(), 3);
+
+    Tensor output;
+    {
+        NoGradGuard no_grad;
+        EXPECT_FALSE(is_grad_enabled());
+        model.forward(input, output);
+        EXPECT_TRUE(model.activations.empty());
+        for (Layer *layer : model.layers)
+        {
+            for (Tensor *param : layer->parameters())
+            {
+                EXPECT_TRUE(param->grad.empty() ||
+                            std::all_of(param->grad.begin(), param->grad.end(),
+                                        [](float g) { return g == 0.0f; }));
+            }
+        }
+    }
+    EXPECT_TRUE(is_grad_enabled());
+    ASSERT_EQ(output.shape, expected.shape);
+    for (size_t i = 0; i < expected.data.size(); ++i)
+    {
+        EXPECT_NEAR(output.data[i], expected.data[i], 1e-5f);
+    }
+
+    // После forward без градиентов backward недоступен
+    output.resize_grad();
+    EXPECT_THROW(model.backward(output, input), std::runtime_error);
+
+    model.forward(input, output);
+    output.resize_grad();
+    EXPECT_NO_THROW(model.backward(output, input));
+}
+
+TEST(ModelTest, CheckpointingGivesSameGradients)
+{
+    auto build = []() {
+        return make_model({new Linear(5, 12), new ReLU(), new Linear(12, 12),
+                           new BatchNorm1d(12), new Tanh(), new Linear(12, 8),
+                           new Sigmoid(), new Linear(8, 2)});
+    };
+    std::unique_ptr<Model> reference(build());
+    std::unique_ptr<Model> checkpointed(build());
+    copy_parameters(*reference, *checkpointed);
+    std::vector<Tensor *> ref_params = reference->parameters();
+    std::vector<Tensor *> ckpt_params = checkpointed->parameters();
+
+    Tensor input;
+    input.shape = {7, 5};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(1.3f * i);
+    }
+    Tensor ckpt_input = input.copy();
+    input.requires_grad = true;
+    input.resize_grad();
+    ckpt_input.requires_grad = true;
+    ckpt_input.resize_grad();
+
+    Tensor ref_output, ckpt_output;
+    reference->forward(input, ref_output);
+    ref_output.resize_grad();
+    std::fill(ref_output.grad.begin(), ref_output.grad.end(), 1.0f);
+    reference->backward(ref_output, input);
+
+    checkpointed->checkpoint_every(3);
+    EXPECT_EQ(checkpointed->checkpoints, (std::vector<size_t>{2, 5}));
+    checkpointed->forward(ckpt_input, ckpt_output);
+    EXPECT_EQ(ckpt_output.data, ref_output.data);
+    EXPECT_LT(checkpointed->activation_bytes(), reference->activation_bytes());
+    ckpt_output.resize_grad();
+    std::fill(ckpt_output.grad.begin(), ckpt_output.grad.end(), 1.0f);
+    checkpointed->backward(ckpt_output, ckpt_input);
+
+    EXPECT_EQ(ckpt_input.grad, input.grad);
+    for (size_t i = 0; i < ref_params.size(); ++i)
+    {
+        EXPECT_EQ(ckpt_params[i]->grad, ref_params[i]->grad);
+    }
+}
+
+TEST(ModelTest, InputWithoutRequiresGradGetsNoGrad)
+{
+    Model model;
+    model.add_layer(new Linear(3, 5));
+    model.add_layer(new BatchNorm1d(5));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(5, 2));
+
+    Tensor input;
+    input.shape = {4, 3};
+    input.resize();
+    std::iota(input.data.begin(), input.data.end(), 0.0f);
+
+    // Параметры получают градиент только после backward
+    for (Tensor *param : model.parameters())
+    {
+        EXPECT_TRUE(param->requires_grad);
+        EXPECT_TRUE(param->grad.empty());
+    }
+
+    Tensor output;
+    model.forward(input, output);
+    output.resize_grad();
+    std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+    model.backward(output, input);
+
+    EXPECT_TRUE(input.grad.empty());
+    for (Tensor *param : model.parameters())
+    {
+        EXPECT_EQ(param->grad.size(), param->size());
+    }
+
+    // view() и copy() не копируют градиент
+    output.requires_grad = true;
+    Tensor copied = output.copy();
+    Tensor viewed = output.view({8});
+    EXPECT_TRUE(copied.grad.empty());
+    EXPECT_TRUE(viewed.grad.empty());
+    EXPECT_TRUE(copied.requires_grad);
+    EXPECT_TRUE(viewed.requires_grad);
+}
+
+TEST(ModelTest, NumaReplicatedWeightsGiveSameOutput)
+{
+    Model model;
+    model.add_layer(new Linear(16, 32));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(32, 4));
+
+    Tensor input;
+    input.shape = {8, 16};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::cos(0.2f * i);
+    }
+
+    model.eval();
+    Tensor expected;
+    model.forward(input, expected);
+
+    model.replicate_for_numa();
+    Linear *first = static_cast<Linear *>(model.layers[0]);
+    const size_t nodes = NumaTopology::instance().num_nodes();
+    EXPECT_EQ(first->weight_replicas.size(), nodes > 1 ? nodes : 0);
+    for (const Tensor &replica : first->weight_replicas)
+    {
+        EXPECT_EQ(replica.data, first->weight.data);
+    }
+
+    Tensor output;
+    model.forward(input, output);
+    EXPECT_EQ(output.data, expected.data);
+
+    // Обучение сбрасывает копии
+    model.train();
+    EXPECT_TRUE(first->weight_replicas.empty());
+}
+
+TEST(ModelTest, DataParallelMatchesSingleReplica)
+{
+    auto build = []() {
+        return make_model({new Linear(6, 12), new Tanh(), new Linear(12, 12),
+                           new ReLU(), new Linear(12, 3)});
+    };
+    std::unique_ptr<Model> reference(build());
+    std::unique_ptr<Model> model(build());
+    copy_parameters(*reference, *model);
+    std::vector<Tensor *> ref_params = reference->parameters();
+    std::vector<Tensor *> params = model->parameters();
+
+    Tensor input;
+    input.shape = {10, 6};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.7f * i);
+    }
+    input.requires_grad = true;
+    Tensor dp_input = input.copy();
+
+    Tensor ref_output;
+    reference->forward(input, ref_output);
+    ref_output.resize_grad();
+    for (size_t i = 0; i < ref_output.grad.size(); ++i)
+    {
+        ref_output.grad[i] = std::cos(0.3f * i);
+    }
+    reference->backward(ref_output, input);
+
+    set_num_threads(3);
+    // Батч из 10 строк делится на части 3, 3, 2, 2
+    DataParallel parallel(*model, 4);
+    EXPECT_EQ(parallel.num_replicas(), 4);
+    for (int step = 0; step < 2; ++step)
+    {
+        for (Tensor *param : params)
+        {
+            param->zero_grad();
+        }
+        Tensor output;
+        parallel.forward(dp_input, output);
+        ASSERT_EQ(output.shape, ref_output.shape);
+        EXPECT_EQ(output.data, ref_output.data);
+
+        output.grad = ref_output.grad;
+        parallel.backward(output, dp_input);
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            ASSERT_EQ(params[k]->grad.size(), ref_params[k]->grad.size());
+            for (size_t i = 0; i < params[k]->grad.size(); ++i)
+            {
+                EXPECT_NEAR(params[k]->grad[i], ref_params[k]->grad[i], 1e-5f);
+            }
+        }
+        for (size_t i = 0; i < input.grad.size(); ++i)
+        {
+            EXPECT_NEAR(dp_input.grad[i], input.grad[i], 1e-6f);
+        }
+    }
+    set_num_threads(default_num_threads());
+}
+
+TEST(ModelTest, FlatParameterArena)
+{
+    auto build = []() {
+        return make_model({new Linear(4, 8), new Tanh(), new Linear(8, 3)});
+    };
+    std::unique_ptr<Model> reference(build());
+    std::unique_ptr<Model> model(build());
+    copy_parameters(*reference, *model);
+    std::vector<Tensor *> ref_params = reference->parameters();
+    std::vector<Tensor *> params = model->parameters();
+
+    model->flatten_parameters();
+    EXPECT_TRUE(model->has_flat_parameters());
+    EXPECT_EQ(model->parameters(), params);
+    EXPECT_TRUE(ParameterArena::is_contiguous(params));
+    for (size_t k = 0; k < params.size(); ++k)
+    {
+        EXPECT_EQ(params[k]->data, ref_params[k]->data);
+    }
+
+    Tensor input;
+    input.shape = {6, 4};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.9f * i);
+    }
+    auto run = [&](Model &m) {
+        Tensor output;
+        m.forward(input, output);
+        output.resize_grad();
+        for (size_t i = 0; i < output.grad.size(); ++i)
+        {
+            output.grad[i] = std::cos(0.4f * i);
+        }
+        m.backward(output, input);
+        return output;
+    };
+    EXPECT_EQ(run(*model).data, run(*reference).data);
+    for (size_t k = 0; k < params.size(); ++k)
+    {
+        EXPECT_EQ(params[k]->grad, ref_params[k]->grad);
+    }
+
+    // Оптимизатор работает прямо в арене модели
+    const float *arena_data = params[0]->data.data();
+    {
+        SGD sgd(params, 0.1f);
+        EXPECT_EQ(params[0]->data.data(), arena_data);
+        sgd.step();
+    }
+    EXPECT_EQ(params[0]->data.data(), arena_data);
+    model->zero_grad();
+    for (Tensor *param : params)
+    {
+        for (float g : param->grad)
+        {
+            EXPECT_EQ(g, 0.0f);
+        }
+    }
+
+    std::stringstream stream;
+    model->save_parameters(stream);
+    std::stringstream ref_stream;
+    reference->save_parameters(ref_stream);
+    reference->load_parameters(stream);
+    for (size_t k = 0; k < params.size(); ++k)
+    {
+        EXPECT_EQ(ref_params[k]->data, params[k]->data);
+    }
+    model->load_parameters(ref_stream);
+    EXPECT_NE(ref_params[0]->data, params[0]->data);
+    std::stringstream truncated("abc");
+    EXPECT_THROW(model->load_parameters(truncated), std::runtime_error);
+
+    // All-reduce DataParallel по арене дает те же градиенты
+    std::stringstream current;
+    model->save_parameters(current);
+    reference->load_parameters(current);
+    model->zero_grad();
+    reference->zero_grad();
+    set_num_threads(2);
+    {
+        DataParallel parallel(*model, 3);
+        Tensor output;
+        parallel.forward(input, output);
+        output.grad = run(*reference).grad;
+        parallel.backward(output, input);
+    }
+    set_num_threads(default_num_threads());
+    for (size_t k = 0; k < params.size(); ++k)
+    {
+        for (size_t i = 0; i < params[k]->grad.size(); ++i)
+        {
+            EXPECT_NEAR(params[k]->grad[i], ref_params[k]->grad[i], 1e-5f);
+        }
+    }
+
+    model->unflatten_parameters();
+    EXPECT_FALSE(model->has_flat_parameters());
+    EXPECT_FALSE(params[0]->data.is_view());
+    EXPECT_FALSE(params[0]->grad.is_view());
+    EXPECT_EQ(params[0]->data, ref_params[0]->data);
+}
+
+TEST(ModelTest, FlattenKeepsOptimizerInSync)
+{
+    Model model;
+    model.add_layer(new Linear(4, 8));
+    model.add_layer(new Tanh());
+    model.add_layer(new Linear(8, 3));
+    std::vector<Tensor *> params = model.parameters();
+    SGD sgd(params, 0.1f);
+
+    Tensor input;
+    input.shape = {5, 4};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.3f * i);
+    }
+    auto run = [&]() {
+        Tensor output;
+        model.forward(input, output);
+        output.resize_grad();
+        std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+        model.backward(output, input);
+    };
+    auto check_step = [&]() {
+        std::vector<std::vector<float>> expected;
+        for (Tensor *param : params)
+        {
+            std::vector<float> values = param->data;
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                values[i] -= 0.1f * param->grad[i];
+            }
+            expected.push_back(values);
+        }
+        sgd.step();
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            EXPECT_EQ(params[k]->data, expected[k]);
+        }
+    };
+
+    // Арена создана после оптимизатора: шаг обновляет параметры в ней
+    model.flatten_parameters();
+    run();
+    EXPECT_GT(sgd.grad_norm(), 0.0f);
+    check_step();
+
+    // add_layer пересобирает арену: старые буферы освобождены
+    model.add_layer(new Linear(3, 3));
+    sgd.zero_grad();
+    EXPECT_EQ(sgd.grad_norm(), 0.0f);
+    run();
+    check_step();
+
+    model.unflatten_parameters();
+    run();
+    check_step();
+}
+
+TEST(ModelTest, MixedPrecisionMatchesFloat)
+{
+    // Параметры задаются детерминированно: при случайных весах ReLU и
+    // BatchNorm по батчу из 8 строк изредка усиливают ошибку округления
+    // сверх допуска
+    struct Case
+    {
+        std::function<Model *()> make_model;
+        float bf16_tolerance;
+        float fp16_tolerance;
+    };
+    const Case cases[] = {
+        {[]() {
+             return make_model({new Linear(6, 24), new Sigmoid(),
+                                new Linear(24, 24), new Tanh(),
+                                new Linear(24, 3)});
+         },
+         2e-2f, 4e-3f},
+        // BatchNorm делит на std по батчу и усиливает ошибку входа
+        {[]() {
+             return make_model({new Linear(6, 24), new BatchNorm1d(24),
+                                new Sigmoid(), new Linear(24, 24), new ReLU(),
+                                new Linear(24, 3)});
+         },
+         5e-2f, 1e-2f},
+    };
+
+    Tensor input;
+    input.shape = {8, 6};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.7f * i);
+    }
+
+    for (const Case &c : cases)
+    {
+        std::unique_ptr<Model> reference(c.make_model());
+        std::vector<Tensor *> ref_params = reference->parameters();
+        for (size_t k = 0; k < ref_params.size(); ++k)
+        {
+            for (size_t i = 0; i < ref_params[k]->data.size(); ++i)
+            {
+                ref_params[k]->data[i] = 0.5f * std::sin(1.3f * i + 0.9f * k);
+            }
+        }
+        Tensor ref_output;
+        reference->forward(input, ref_output);
+        ref_output.resize_grad();
+        for (size_t i = 0; i < ref_output.grad.size(); ++i)
+        {
+            ref_output.grad[i] = std::cos(0.2f * i);
+        }
+        reference->backward(ref_output, input);
+        const size_t float_bytes = reference->activation_bytes();
+
+        for (Precision precision : {Precision::BFloat16, Precision::Float16})
+        {
+            const float tolerance = precision == Precision::BFloat16
+                                        ? c.bf16_tolerance
+                                        : c.fp16_tolerance;
+            std::unique_ptr<Model> model(c.make_model());
+            copy_parameters(*reference, *model);
+            std::vector<Tensor *> params = model->parameters();
+            model->set_precision(precision);
+
+            Tensor output;
+            model->forward(input, output);
+            EXPECT_EQ(model->activation_bytes(), float_bytes / 2);
+            for (size_t i = 0; i < output.data.size(); ++i)
+            {
+                EXPECT_NEAR(output.data[i], ref_output.data[i], tolerance);
+            }
+
+            output.grad = ref_output.grad;
+            model->backward(output, input);
+            for (size_t k = 0; k < params.size(); ++k)
+            {
+                ASSERT_EQ(params[k]->grad.size(), ref_params[k]->grad.size());
+                for (size_t i = 0; i < params[k]->grad.size(); ++i)
+                {
+                    EXPECT_NEAR(params[k]->grad[i], ref_params[k]->grad[i],
+                                tolerance * (1.0f + std::abs(ref_params[k]->grad[i])));
+                }
+            }
+            // Основные веса остаются во float
+            EXPECT_EQ(params[0]->data, ref_params[0]->data);
+        }
+    }
+}
+
+TEST(ModelTest, HalfWeightsRefreshedAfterTraining)
+{
+    // Копия весов в bf16 не должна пережить шаг оптимизатора при
+    // переходе в eval
+    Linear linear(4, 3);
+    linear.set_precision(Precision::BFloat16);
+    Tensor input;
+    input.shape = {2, 4};
+    input.data = {0.5f, -1.0f, 2.0f, 0.25f, 1.0f, 0.0f, -0.5f, 3.0f};
+    Tensor output;
+    linear.forward(input, output);
+
+    for (float &w : linear.weight.data)
+    {
+        w += 1.0f;
+    }
+    linear.train(false);
+    linear.forward(input, output);
+
+    Linear reference = linear;
+    reference.set_precision(Precision::Float32);
+    Tensor expected;
+    reference.forward(input, expected);
+    for (size_t i = 0; i < output.data.size(); ++i)
+    {
+        EXPECT_NEAR(output.data[i], expected.data[i],
+                    2e-2f * (1.0f + std::abs(expected.data[i])));
+    }
+}
+
+TEST(ModelTest, InPlaceParameterChangesRefreshWeightCaches)
+{
+    auto build = []() {
+        Model *model = make_model({new Linear(4, 6), new Tanh(),
+                                   new Linear(6, 2)});
+        model->set_precision(Precision::BFloat16);
+        model->eval();
+        return model;
+    };
+    std::unique_ptr<Model> model(build());
+    std::unique_ptr<Model> source(build());
+    Tensor input;
+    input.shape = {3, 4};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.5f * i);
+    }
+    NoGradGuard no_grad;
+    Tensor output, expected;
+    model->forward(input, output);
+
+    // Загрузка в eval: копии весов в bf16 строятся заново
+    std::stringstream stream;
+    source->save_parameters(stream);
+    model->load_parameters(stream);
+    model->forward(input, output);
+    source->forward(input, expected);
+    EXPECT_EQ(output.data, expected.data);
+
+    // Прунинг в eval
+    Linear *linear = static_cast<Linear *>(model->layers[0]);
+    Linear reference = *linear;
+    prune_by_magnitude(*linear, 0.5f);
+    reference.weight.data = linear->weight.data;
+    reference.weight_half.clear();
+    linear->forward(input, output);
+    reference.forward(input, expected);
+    EXPECT_EQ(output.data, expected.data);
+}
+
+TEST(ModelTest, PipelineMatchesSequentialModel)
+{
+    auto build = []() {
+        return make_model({new Linear(5, 16), new ReLU(), new Linear(16, 16),
+                           new Sigmoid(), new Linear(16, 16), new Tanh(),
+                           new Linear(16, 2)});
+    };
+    std::unique_ptr<Model> reference(build());
+    std::unique_ptr<Model> model(build());
+    copy_parameters(*reference, *model);
+    std::vector<Tensor *> ref_params = reference->parameters();
+    std::vector<Tensor *> params = model->parameters();
+
+    Tensor input;
+    input.shape = {10, 5};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.9f * i);
+    }
+    input.requires_grad = true;
+    Tensor pipe_input = input.copy();
+
+    Tensor ref_output;
+    reference->forward(input, ref_output);
+    ref_output.resize_grad();
+    for (size_t i = 0; i < ref_output.grad.size(); ++i)
+    {
+        ref_output.grad[i] = std::cos(0.4f * i);
+    }
+    reference->backward(ref_output, input);
+
+    PipelineParallel pipeline(*model, 3, 4);
+    for (int step = 0; step < 2; ++step)
+    {
+        for (Tensor *param : params)
+        {
+            param->zero_grad();
+        }
+        Tensor output;
+        pipeline.forward(pipe_input, output);
+        ASSERT_EQ(output.shape, ref_output.shape);
+        EXPECT_EQ(output.data, ref_output.data);
+
+        output.grad = ref_output.grad;
+        pipeline.backward(output, pipe_input);
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            ASSERT_EQ(params[k]->grad.size(), ref_params[k]->grad.size());
+            for (size_t i = 0; i < params[k]->grad.size(); ++i)
+            {
+                EXPECT_NEAR(params[k]->grad[i], ref_params[k]->grad[i], 1e-5f);
+            }
+        }
+        for (size_t i = 0; i < input.grad.size(); ++i)
+        {
+            EXPECT_NEAR(pipe_input.grad[i], input.grad[i], 1e-6f);
+        }
+    }
+
+    // Стадии - непрерывные диапазоны, покрывающие все слои
+    const std::vector<size_t> &bounds = pipeline.boundaries();
+    ASSERT_EQ(bounds.size(), 4);
+    EXPECT_EQ(bounds.front(), 0);
+    EXPECT_EQ(bounds.back(), model->layers.size());
+    for (const PipelineParallel::StageStats &stage : pipeline.stage_stats())
+    {
+        EXPECT_LT(stage.first_layer, stage.last_layer);
+        EXPECT_GE(stage.utilization, 0.0);
+        EXPECT_LE(stage.utilization, 1.01);
+    }
+    EXPECT_NE(pipeline.stats_to_string().find("Stage 2"), std::string::npos);
+}
+
+TEST(ModelTest, PipelinePartitionByCost)
+{
+    EXPECT_EQ(PipelineParallel::partition_by_cost({4, 4, 4, 4}, 2),
+              (std::vector<size_t>{0, 2, 4}));
+    EXPECT_EQ(PipelineParallel::partition_by_cost({1, 1, 10, 1, 1}, 3),
+              (std::vector<size_t>{0, 2, 3, 5}));
+    EXPECT_EQ(PipelineParallel::partition_by_cost({1, 2}, 5),
+              (std::vector<size_t>{0, 1, 2}));
+}
+
+TEST(ModelTest, CachingAllocatorSteadyState)
+{
+    CachingAllocator &allocator = CachingAllocator::instance();
+    set_allocator(&allocator);
+    {
+        Model model;
+        model.add_layer(new Linear(6, 10));
+        model.add_layer(new BatchNorm1d(10));
+        model.add_layer(new ReLU());
+        model.add_layer(new Linear(10, 3));
+
+        Tensor input;
+        input.shape = {4, 6};
+        input.resize();
+        std::iota(input.data.begin(), input.data.end(), 0.0f);
+
+        size_t warm_misses = 0;
+        for (int step = 0; step < 5; ++step)
+        {
+            Tensor output;
+            model.forward(input, output);
+            output.resize_grad();
+            std::fill(output.grad.begin(), output.grad.end(), 0.1f);
+            Tensor grad_input = input.copy();
+            grad_input.requires_grad = true;
+            model.backward(output, grad_input);
+            if (step == 1)
+            {
+                warm_misses = allocator.stats().misses;
+            }
+        }
+        // После прогрева новые системные выделения не нужны
+        EXPECT_EQ(allocator.stats().misses, warm_misses);
+        EXPECT_GT(allocator.stats().hits, 0);
+        EXPECT_GT(allocator.stats().bytes_cached, 0);
+    }
+    set_allocator(nullptr);
+    allocator.release_cached();
+    EXPECT_EQ(get_allocator(), &system_allocator());
+}
+
+TEST(OptimizerTest, UsesParameterStorageInPlace)
+{
+    Model model;
+    model.add_layer(new Linear(3, 4));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(4, 2));
+    std::vector<Tensor *> params = model.parameters();
+
+    Tensor input;
+    input.shape = {5, 3};
+    input.resize();
+    std::iota(input.data.begin(), input.data.end(), 0.0f);
+    auto run = [&]() {
+        Tensor output;
+        model.forward(input, output);
+        output.resize_grad();
+        std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+        model.backward(output, input);
+    };
+
+    // Параметры в своей памяти: оптимизатор обходит тензоры по одному и
+    // не переносит их
+    std::unique_ptr<SGD> sgd(new SGD(params, 0.1f));
+    EXPECT_EQ(sgd->num_elements(), 3 * 4 + 4 + 4 * 2 + 2);
+    EXPECT_FALSE(params[0]->data.is_view());
+    EXPECT_EQ(sgd->grad_norm(), 0.0f);
+    run();
+    EXPECT_GT(sgd->grad_norm(), 0.0f);
+    // Смещение выхода получает градиент при любых весах (за ReLU
+    // градиент первого слоя может быть нулевым)
+    Tensor *bias = params.back();
+    std::vector<float> before = bias->data;
+    sgd->step();
+    EXPECT_NE(bias->data, before);
+    sgd->zero_grad();
+    EXPECT_EQ(sgd->grad_norm(), 0.0f);
+
+    // В арене модели - один проход по общему буферу
+    model.flatten_parameters();
+    const float *base = params[0]->data.data();
+    run();
+    before = bias->data;
+    {
+        Adam adam(params);
+        EXPECT_GT(adam.grad_norm(), 0.0f);
+        adam.step();
+        EXPECT_EQ(params[0]->data.data(), base);
+        EXPECT_NE(bias->data, before);
+    }
+    EXPECT_EQ(params[0]->data.data(), base);
+    EXPECT_TRUE(params[0]->data.is_view());
+}
+
+TEST(OptimizerTest, OutlivesModel)
+{
+    std::unique_ptr<SGD> sgd;
+    {
+        Model model;
+        model.add_layer(new Linear(3, 4));
+        model.add_layer(new Linear(4, 2));
+        sgd.reset(new SGD(model.parameters(), 0.1f, 0.9f));
+    }
+    // Память параметров принадлежит модели: уничтожение оптимизатора после
+    // модели не трогает ее тензоры
+    sgd.reset();
+}
+
+TEST(OptimizerTest, ClipGradNorm)
+{
+    Tensor a, b;
+    a.shape = {1};
+    a.data = {1.0f};
+    a.grad = {3.0f};
+    b.shape = {1};
+    b.data = {2.0f};
+    b.grad = {4.0f};
+
+    SGD sgd({&a, &b}, 1.0f);
+    EXPECT_FLOAT_EQ(sgd.clip_grad_norm(10.0f), 5.0f);
+    EXPECT_FLOAT_EQ(a.grad[0], 3.0f);
+    EXPECT_FLOAT_EQ(sgd.clip_grad_norm(1.0f), 5.0f);
+    EXPECT_FLOAT_EQ(a.grad[0], 0.6f);
+    EXPECT_FLOAT_EQ(b.grad[0], 0.8f);
+
+    sgd.step();
+    EXPECT_FLOAT_EQ(a.data[0], 0.4f);
+    EXPECT_FLOAT_EQ(b.data[0], 1.2f);
+}
+
+TEST(OptimizerTest, UpdatesMatchReference)
+{
+    const std::vector<float> init = {0.5f, -1.0f, 2.0f, 0.0f};
+    auto grad_at = [](int step, size_t i) {
+        return std::sin(0.7f * (step + 1) + static_cast<float>(i));
+    };
+
+    // SGD с моментом и weight decay
+    {
+        Tensor w;
+        w.shape = {init.size()};
+        w.data = init;
+        w.resize_grad();
+        SGD sgd({&w}, 0.1f, 0.9f, 0.01f);
+        std::vector<float> p = init, v(init.size(), 0.0f);
+        for (int step = 0; step < 3; ++step)
+        {
+            for (size_t i = 0; i < p.size(); ++i)
+            {
+                w.grad[i] = grad_at(step, i);
+                v[i] = 0.9f * v[i] + grad_at(step, i) + 0.01f * p[i];
+                p[i] -= 0.1f * v[i];
+            }
+            sgd.step();
+        }
+        for (size_t i = 0; i < p.size(); ++i)
+        {
+            EXPECT_NEAR(w.data[i], p[i], 1e-6f);
+        }
+    }
+
+    // Adam (L2) и AdamW (decoupled) по формулам из статей
+    for (bool decoupled : {false, true})
+    {
+        Tensor w;
+        w.shape = {init.size()};
+        w.data = init;
+        w.resize_grad();
+        const float lr = 0.01f, b1 = 0.9f, b2 = 0.999f, eps = 1e-8f, wd = 0.1f;
+        std::unique_ptr<Adam> adam(
+            decoupled ? new AdamW({&w}, lr, b1, b2, eps, wd)
+                      : new Adam({&w}, lr, b1, b2, eps, wd));
+        std::vector<float> p = init, m(init.size(), 0.0f), v(init.size(), 0.0f);
+        for (int step = 0; step < 5; ++step)
+        {
+            const float t = static_cast<float>(step + 1);
+            for (size_t i = 0; i < p.size(); ++i)
+            {
+                w.grad[i] = grad_at(step, i);
+                float g = grad_at(step, i);
+                if (decoupled)
+                {
+                    p[i] -= lr * wd * p[i];
+                }
+                else
+                {
+                    g += wd * p[i];
+                }
+                m[i] = b1 * m[i] + (1 - b1) * g;
+                v[i] = b2 * v[i] + (1 - b2) * g * g;
+                const float m_hat = m[i] / (1 - std::pow(b1, t));
+                const float v_hat = v[i] / (1 - std::pow(b2, t));
+                p[i] -= lr * m_hat / (std::sqrt(v_hat) + eps);
+            }
+            adam->step();
+        }
+        EXPECT_EQ(adam->steps(), 5);
+        for (size_t i = 0; i < p.size(); ++i)
+        {
+            EXPECT_NEAR(w.data[i], p[i], 1e-5f);
+        }
+    }
+}
+
+TEST(OptimizerTest, OverlappedStepMatchesStep)
+{
+    auto build = []() {
+        return make_model({new Linear(5, 16), new Tanh(), new Linear(16, 16),
+                           new ReLU(), new Linear(16, 3)});
+    };
+    std::unique_ptr<Model> reference(build());
+    std::unique_ptr<Model> model(build());
+    copy_parameters(*reference, *model);
+    std::vector<Tensor *> ref_params = reference->parameters();
+    std::vector<Tensor *> params = model->parameters();
+
+    std::vector<size_t> order;
+    const size_t id =
+        model->add_backward_hook([&](size_t layer) { order.push_back(layer); });
+
+    Tensor input;
+    input.shape = {7, 5};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.3f * i);
+    }
+    auto run = [&](Model &m) {
+        Tensor output;
+        m.forward(input, output);
+        output.resize_grad();
+        for (size_t i = 0; i < output.grad.size(); ++i)
+        {
+            output.grad[i] = output.data[i] - 0.5f;
+        }
+        m.backward(output, input);
+    };
+
+    AdamW ref_adam(ref_params, 1e-2f);
+    AdamW adam(params, 1e-2f);
+    {
+        OverlappedStep overlapped(*model, adam);
+        for (int step = 0; step < 3; ++step)
+        {
+            ref_adam.zero_grad();
+            run(*reference);
+            ref_adam.step();
+
+            adam.zero_grad();
+            run(*model);
+            overlapped.wait();
+            for (size_t k = 0; k < params.size(); ++k)
+            {
+                EXPECT_EQ(params[k]->data, ref_params[k]->data);
+            }
+        }
+    }
+    EXPECT_EQ(adam.steps(), 3);
+    EXPECT_EQ(order, std::vector<size_t>({4, 3, 2, 1, 0, 4, 3, 2, 1, 0, 4,
+                                          3, 2, 1, 0}));
+    model->remove_backward_hook(id);
+    EXPECT_TRUE(model->backward_hooks.empty());
+}
+
+TEST(OptimizerTest, GradScalerSkipsOverflow)
+{
+    Tensor param;
+    param.shape = {2};
+    param.data = {1.0f, 2.0f};
+    param.grad = {0.0f, 0.0f};
+    SGD sgd({&param}, 1.0f);
+    GradScaler scaler(8.0f, 2.0f, 0.5f, 2);
+
+    Tensor output;
+    output.shape = {2};
+    output.grad = {0.5f, 0.25f};
+    scaler.scale_output_grad(output);
+    EXPECT_EQ(output.grad, std::vector<float>({4.0f, 2.0f}));
+
+    // Градиенты со снятым масштабом: 0.5 и 0.25
+    param.grad = output.grad;
+    EXPECT_TRUE(scaler.step(sgd));
+    EXPECT_EQ(param.data, std::vector<float>({0.5f, 1.75f}));
+    EXPECT_EQ(scaler.scale(), 8.0f);
+
+    param.grad = {std::numeric_limits<float>::infinity(), 1.0f};
+    EXPECT_FALSE(scaler.step(sgd));
+    EXPECT_EQ(param.data, std::vector<float>({0.5f, 1.75f}));
+    EXPECT_EQ(scaler.scale(), 4.0f);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        param.grad = {0.0f, 0.0f};
+        EXPECT_TRUE(scaler.step(sgd));
+    }
+    EXPECT_EQ(scaler.scale(), 8.0f);
+}
+
+TEST(PrecisionTest, ScalarConversions)
+{
+    EXPECT_EQ(float_to_bf16(1.0f), 0x3f80);
+    EXPECT_EQ(float_to_bf16(-2.0f), 0xc000);
+    // Середина между соседними bf16 округляется к четному
+    EXPECT_EQ(float_to_bf16(1.0f + std::ldexp(1.0f, -8)), 0x3f80);
+    EXPECT_EQ(float_to_bf16(1.0f + 3 * std::ldexp(1.0f, -8)), 0x3f82);
+    EXPECT_EQ(bf16_to_float(0x3fc0), 1.5f);
+    EXPECT_TRUE(std::isnan(bf16_to_float(float_to_bf16(NAN))));
+
+    EXPECT_EQ(float_to_fp16(1.0f), 0x3c00);
+    EXPECT_EQ(float_to_fp16(-0.0f), 0x8000);
+    EXPECT_EQ(float_to_fp16(65504.0f), 0x7bff);
+    EXPECT_EQ(float_to_fp16(65520.0f), 0x7c00);
+    EXPECT_EQ(float_to_fp16(INFINITY), 0x7c00);
+    EXPECT_TRUE(std::isnan(fp16_to_float(float_to_fp16(NAN))));
+    // Денормалы fp16
+    EXPECT_EQ(float_to_fp16(std::ldexp(1.0f, -24)), 0x0001);
+    EXPECT_EQ(fp16_to_float(0x0003), 3 * std::ldexp(1.0f, -24));
+    EXPECT_EQ(fp16_to_float(0xc000), -2.0f);
+    EXPECT_EQ(fp16_to_float(0x7c00), INFINITY);
+}
+
+TEST(PrecisionTest, BulkConversionMatchesScalar)
+{
+    std::vector<float> values(1003);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        values[i] = 300.0f * std::sin(1.3f * i) * std::exp(-0.01f * i);
+    }
+    std::vector<uint16_t> half(values.size());
+    std::vector<float> back(values.size());
+
+    convert_to_half(values.data(), half.data(), values.size(),
+                    Precision::BFloat16);
+    convert_from_half(half.data(), back.data(), half.size(),
+                      Precision::BFloat16);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        EXPECT_EQ(half[i], float_to_bf16(values[i]));
+        EXPECT_EQ(back[i], bf16_to_float(half[i]));
+    }
+
+    convert_to_half(values.data(), half.data(), values.size(),
+                    Precision::Float16);
+    convert_from_half(half.data(), back.data(), half.size(),
+                      Precision::Float16);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        EXPECT_EQ(half[i], float_to_fp16(values[i]));
+        EXPECT_EQ(back[i], fp16_to_float(half[i]));
+        EXPECT_NEAR(back[i], values[i], std::abs(values[i]) * 1e-3f + 1e-4f);
+    }
+}
+
+TEST(TensorDTypeTest, ConversionsAndAccessors)
+{
+    Tensor t;
+    t.shape = {5};
+    t.data = {1.4f, -2.6f, 300.0f, -300.0f, 2.5f};
+    EXPECT_EQ(t.dtype, DType::Float32);
+    EXPECT_THROW(t.data_as<int8_t>(), std::invalid_argument);
+
+    Tensor i8 = t.to(DType::Int8);
+    EXPECT_EQ(i8.dtype, DType::Int8);
+    EXPECT_TRUE(i8.data.empty());
+    EXPECT_EQ(i8.bytes.size(), 5);
+    const int8_t *q = i8.data_as<int8_t>();
+    EXPECT_EQ(std::vector<int>(q, q + 5), std::vector<int>({1, -3, 127, -128, 2}));
+
+    Tensor i32 = t.to(DType::Int32);
+    const int32_t *w = i32.data_as<int32_t>();
+    EXPECT_EQ(std::vector<int32_t>(w, w + 5),
+              std::vector<int32_t>({1, -3, 300, -300, 2}));
+    EXPECT_EQ(i32.to(DType::Int8).data_as<int8_t>()[2], 127);
+
+    Tensor f64 = t.to(DType::Float64);
+    EXPECT_EQ(f64.bytes.size(), 5 * sizeof(double));
+    EXPECT_EQ(f64.data_as<double>()[0], static_cast<double>(1.4f));
+    EXPECT_EQ(f64.to(DType::Float32).data, t.data);
+
+    for (DType half : {DType::BFloat16, DType::Float16})
+    {
+        Tensor h = t.to(half);
+        EXPECT_EQ(h.bytes.size(), 5 * 2);
+        Tensor back = h.to(DType::Float32);
+        for (size_t i = 0; i < t.data.size(); ++i)
+        {
+            EXPECT_NEAR(back.data[i], t.data[i], std::abs(t.data[i]) * 1e-2f);
+        }
+    }
+
+    Tensor v = i8.view({5, 1});
+    EXPECT_EQ(v.dtype, DType::Int8);
+    EXPECT_EQ(v.data_as<int8_t>()[1], -3);
+    EXPECT_THROW(i8.transpose(0, 0), std::invalid_argument);
+    EXPECT_EQ(Tensor::empty({2, 3}, DType::Int32).bytes.size(),
+              6 * sizeof(int32_t));
+}
+
+TEST(TensorDTypeTest, MatmulDispatch)
+{
+    Tensor a = Tensor::empty({2, 3}, DType::Int8);
+    Tensor b = Tensor::empty({3, 2}, DType::Int8);
+    const int8_t a_values[] = {100, -100, 127, 1, 2, 3};
+    const int8_t b_values[] = {127, -128, 127, 127, 1, 0};
+    std::copy(a_values, a_values + 6, a.data_as<int8_t>());
+    std::copy(b_values, b_values + 6, b.data_as<int8_t>());
+
+    Tensor c = matmul(a, b);
+    EXPECT_EQ(c.dtype, DType::Int32);
+    EXPECT_EQ(c.shape, std::vector<size_t>({2, 2}));
+    const int32_t *r = c.data_as<int32_t>();
+    // Без переполнения int8: накопление в int32
+    EXPECT_EQ(r[0], 100 * 127 - 100 * 127 + 127);
+    EXPECT_EQ(r[1], 100 * -128 - 100 * 127);
+    EXPECT_EQ(r[2], 127 + 2 * 127 + 3);
+    EXPECT_EQ(r[3], -128 + 2 * 127);
+
+    Tensor fa, fb;
+    fa.shape = {2, 4, 3};
+    fa.resize();
+    fb.shape = {2, 3, 5};
+    fb.resize();
+    for (size_t i = 0; i < fa.data.size(); ++i)
+    {
+        fa.data[i] = std::sin(0.5f * i);
+    }
+    for (size_t i = 0; i < fb.data.size(); ++i)
+    {
+        fb.data[i] = std::cos(0.3f * i);
+    }
+    // bf16 x float32 -> float32, значения bf16 точно представимы во float
+    Tensor ha = fa.to(DType::BFloat16);
+    Tensor mixed = matmul(ha, fb);
+    Tensor reference = matmul(ha.to(DType::Float32), fb);
+    EXPECT_EQ(mixed.dtype, DType::Float32);
+    for (size_t i = 0; i < mixed.data.size(); ++i)
+    {
+        EXPECT_NEAR(mixed.data[i], reference.data[i], 1e-5f);
+    }
+
+    Tensor d = matmul(fa.to(DType::Float64), fb.to(DType::Float64));
+    EXPECT_EQ(d.dtype, DType::Float64);
+    Tensor f = matmul(fa, fb);
+    for (size_t i = 0; i < f.data.size(); ++i)
+    {
+        EXPECT_NEAR(d.data_as<double>()[i], f.data[i], 1e-5);
+    }
+
+    EXPECT_THROW(matmul(a, fb.to(DType::Int32)), std::invalid_argument);
+}
+
+TEST(TensorDTypeTest, LinearConvertsInput)
+{
+    Linear linear(4, 3);
+    Tensor input;
+    input.shape = {2, 4};
+    input.data = {0.5f, -1.0f, 2.0f, 0.25f, 1.0f, 0.0f, -0.5f, 3.0f};
+    Tensor expected, output;
+    linear.forward(input, expected);
+    linear.forward(input.to(DType::Float64), output);
+    EXPECT_EQ(output.dtype, DType::Float32);
+    EXPECT_EQ(output.data, expected.data);
+}
+
+TEST(QuantizationTest, ObserversAndParams)
+{
+    std::vector<float> values(10000);
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        values[i] = static_cast<float>(i) / values.size();
+    }
+    values[0] = -50.0f; // выброс
+
+    MinMaxObserver min_max;
+    min_max.observe(values.data(), values.size());
+    EXPECT_FLOAT_EQ(min_max.range().first, -50.0f);
+    EXPECT_FLOAT_EQ(min_max.range().second, values.back());
+
+    // Два батча с расширением диапазона: выброс отсекается
+    HistogramObserver histogram(2048, 1e-3);
+    histogram.observe(values.data() + 1, values.size() - 1);
+    histogram.observe(values.data(), 1);
+    EXPECT_GT(histogram.range().first, -1.0f);
+    EXPECT_NEAR(histogram.range().second, 1.0f, 0.05f);
+
+    QuantParams params = choose_qparams(0.5f, 2.0f, 0, 255);
+    EXPECT_EQ(params.zero_point, 0);
+    EXPECT_FLOAT_EQ(params.scale, 2.0f / 255);
+    params = choose_qparams(-1.0f, 1.0f, -128, 127);
+    EXPECT_LE(std::abs(params.zero_point), 1);
+    params = choose_qparams(-2.0f, 1.0f, 0, 255);
+    EXPECT_EQ(params.zero_point, 170);
+}
+
+TEST(QuantizationTest, QuantizedModelMatchesFloat)
+{
+    Model model;
+    model.add_layer(new Linear(32, 64));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(64, 48));
+    model.add_layer(new Tanh());
+    model.add_layer(new Linear(48, 16));
+
+    std::mt19937 gen(7);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    Tensor input;
+    input.shape = {64, 32};
+    input.resize();
+    for (float &value : input.data)
+    {
+        value = dist(gen);
+    }
+
+    for (Calibration calibration : {Calibration::MinMax, Calibration::Histogram})
+    {
+        std::unique_ptr<Model> quantized;
+        {
+            Int8Quantizer quantizer(model, calibration);
+            quantizer.calibrate(input);
+            quantized = quantizer.quantized_model();
+        }
+        EXPECT_TRUE(model.forward_hooks.empty());
+        EXPECT_TRUE(model.layers[0]->training);
+
+        QuantizedLinear *first = dynamic_cast<QuantizedLinear *>(quantized->layers[0]);
+        QuantizedLinear *second = dynamic_cast<QuantizedLinear *>(quantized->layers[2]);
+        ASSERT_NE(first, nullptr);
+        ASSERT_NE(second, nullptr);
+        EXPECT_FALSE(first->unsigned_input);
+        EXPECT_TRUE(second->unsigned_input); // вход после ReLU
+        EXPECT_NE(dynamic_cast<Tanh *>(quantized->layers[3]), nullptr);
+
+        QuantizationReport report = compare_models(model, *quantized, input);
+        EXPECT_LT(report.relative_error, 0.05f) << report.to_string();
+        EXPECT_GE(report.float_weight_bytes, 3 * report.quantized_weight_bytes);
+    }
+}
+
+TEST(QuantizationTest, QuantizedLinearMatchesLinear)
+{
+    Linear linear(8, 5);
+    Tensor input;
+    input.shape = {3, 8};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(static_cast<float>(i));
+    }
+    QuantizedLinear quantized(linear, -1.0f, 1.0f);
+    Tensor expected, output;
+    linear.forward(input, expected);
+    quantized.forward(input, output);
+    ASSERT_EQ(output.shape, expected.shape);
+    for (size_t i = 0; i < output.data.size(); ++i)
+    {
+        EXPECT_NEAR(output.data[i], expected.data[i], 0.02f);
+    }
+
+    Tensor grad;
+    output.grad = output.data;
+    EXPECT_THROW(quantized.backward(output, grad), std::logic_error);
+    EXPECT_TRUE(quantized.parameters().empty());
+}
+
+TEST(QuantizationTest, FakeQuantizeStraightThrough)
+{
+    FakeQuantize fake;
+    Tensor input;
+    input.shape = {1, 4};
+    input.data = {-1.0f, 0.3f, 1.0f, 0.0f};
+    input.requires_grad = true;
+    Tensor output;
+    fake.forward(input, output);
+    EXPECT_FALSE(fake.unsigned_range);
+    EXPECT_NEAR(fake.params.scale, 2.0f / 255, 1e-7f);
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        EXPECT_NEAR(output.data[i], input.data[i], fake.params.scale / 2 + 1e-6f);
+    }
+
+    // Диапазон заморожен: значения вне сетки насыщаются, градиент их
+    // не проходит
+    fake.observer_enabled = false;
+    input.data = {-3.0f, 0.3f, 3.0f, 0.0f};
+    fake.forward(input, output);
+    EXPECT_NEAR(output.data[0], fake.range().first, 1e-6f);
+    EXPECT_NEAR(output.data[2], fake.range().second, 1e-6f);
+    output.grad = {1.0f, 2.0f, 3.0f, 4.0f};
+    fake.backward(output, input);
+    EXPECT_EQ(input.grad, std::vector<float>({0.0f, 2.0f, 0.0f, 4.0f}));
+
+    // Обучаемая шкала получает градиент
+    FakeQuantize learnable(true);
+    ASSERT_EQ(learnable.parameters().size(), 1u);
+    learnable.forward(input, output);
+    output.grad = {1.0f, 1.0f, 1.0f, 1.0f};
+    learnable.backward(output, input);
+    EXPECT_NE(learnable.scale.grad[0], 0.0f);
+}
+
+TEST(QuantizationTest, QATConvertsToInt8Model)
+{
+    Model model;
+    model.add_layer(new Linear(8, 16));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(16, 4));
+
+    Tensor input, target;
+    input.shape = {32, 8};
+    input.resize();
+    target.shape = {32, 4};
+    target.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.37f * static_cast<float>(i));
+    }
+    for (size_t i = 0; i < target.data.size(); ++i)
+    {
+        target.data[i] = 0.5f * std::cos(0.11f * static_cast<float>(i));
+    }
+
+    for (bool learnable : {false, true})
+    {
+        std::unique_ptr<Model> qat = prepare_qat(model, learnable);
+        ASSERT_EQ(qat->layers.size(), 5u);
+        EXPECT_NE(dynamic_cast<FakeQuantize *>(qat->layers[0]), nullptr);
+        EXPECT_NE(dynamic_cast<QATLinear *>(qat->layers[1]), nullptr);
+
+        SGD sgd(qat->parameters(), 0.05f);
+        float first_loss = 0, loss = 0;
+        for (int step = 0; step < 30; ++step)
+        {
+            Tensor output;
+            qat->forward(input, output);
+            output.resize_grad();
+            loss = 0;
+            for (size_t i = 0; i < output.data.size(); ++i)
+            {
+                const float diff = output.data[i] - target.data[i];
+                loss += diff * diff / output.data.size();
+                output.grad[i] = 2 * diff / output.data.size();
+            }
+            first_loss = step == 0 ? loss : first_loss;
+            sgd.zero_grad();
+            qat->backward(output, input);
+            sgd.step();
+        }
+        EXPECT_LT(loss, first_loss);
+
+        // Модель int8 повторяет QAT-модель в eval с точностью до редких
+        // расхождений округления входа второго слоя
+        qat->eval();
+        std::unique_ptr<Model> quantized = convert_qat(*qat);
+        ASSERT_EQ(quantized->layers.size(), 3u);
+        EXPECT_NE(dynamic_cast<QuantizedLinear *>(quantized->layers[0]), nullptr);
+        EXPECT_TRUE(dynamic_cast<QuantizedLinear *>(quantized->layers[2])
+                        ->unsigned_input);
+        QuantizationReport report = compare_models(*qat, *quantized, input);
+        EXPECT_LT(report.relative_error, 1e-2f) << report.to_string();
+    }
+}
+
+TEST(QuantizationTest, Int4LinearMatchesDequantized)
+{
+    // Нечетное число выходов и неполная последняя группа
+    Linear linear(70, 77);
+    for (size_t group_size : {32, 64, 128})
+    {
+        Int4Linear packed(linear, group_size);
+        EXPECT_EQ(packed.num_groups(), (70 + group_size - 1) / group_size);
+        EXPECT_EQ(packed.weight_packed.size(), 70u * 39);
 
-    Linear *layer2 = static_cast<Linear *>(model.layers[2]);
-    layer2->weight.data = {0.7f, 0.8f};
-    layer2->bias.data = {0.3f};
+        Tensor weight = packed.dequantized_weight();
+        for (size_t i = 0; i < weight.data.size(); ++i)
+        {
+            // Ошибка не больше половины шага: диапазон 0.2 на 15 шагов
+            EXPECT_NEAR(weight.data[i], linear.weight.data[i], 0.2f / 30 + 1e-6f);
+        }
 
-    // Prepare input
-    Tensor input;
-    input.shape = {2, 3};
+        Linear reference = linear;
+        reference.weight.data = weight.data;
+        for (size_t batch : {1, 5})
+        {
+            Tensor input;
+            input.shape = {batch, 70};
+            input.resize();
+            for (size_t i = 0; i < input.data.size(); ++i)
+            {
+                input.data[i] = std::cos(0.3f * static_cast<float>(i));
+            }
+            Tensor expected, output;
+            reference.forward(input, expected);
+            packed.forward(input, output);
+            ASSERT_EQ(output.shape, expected.shape);
+            for (size_t i = 0; i < output.data.size(); ++i)
+            {
+                EXPECT_NEAR(output.data[i], expected.data[i], 1e-4f);
+            }
+        }
+    }
+
+    Int4Linear packed(linear, 32);
+    EXPECT_LT(packed.weight_bytes() * 4, linear.weight.size() * sizeof(float));
+    Tensor input, output;
+    input.shape = {1, 70};
     input.resize();
-    input.data = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f};
-    input.resize_grad();
+    packed.forward(input, output);
+    output.grad = output.data;
+    EXPECT_THROW(packed.backward(output, input), std::logic_error);
+}
 
-    // Forward pass
-    Tensor output;
-    model.forward(input, output);
+TEST(QuantizationTest, PackedBinaryLinearMatchesBinaryLinear)
+{
+    // Вход не кратен 64: проверка хвоста последнего слова
+    for (bool ternary : {false, true})
+    {
+        BinaryLinear linear(100, 37, ternary);
+        linear.eval();
+        PackedBinaryLinear packed(linear);
+        EXPECT_EQ(packed.words, 2u);
+
+        Tensor input;
+        input.shape = {3, 100};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = std::sin(0.7f * static_cast<float>(i));
+        }
+        Tensor expected, output;
+        linear.forward(input, expected);
+        packed.forward(input, output);
+        ASSERT_EQ(output.shape, expected.shape);
+        for (size_t i = 0; i < output.data.size(); ++i)
+        {
+            EXPECT_NEAR(output.data[i], expected.data[i], 1e-4f);
+        }
+        if (ternary)
+        {
+            EXPECT_LT(packed.nonzero[0], 100);
+        }
+        else
+        {
+            EXPECT_EQ(packed.nonzero[0], 100);
+        }
+        EXPECT_THROW(packed.backward(output, input), std::logic_error);
+    }
+}
 
-    // Verify final output shape and values
-    ASSERT_EQ(output.shape.size(), 2);
-    ASSERT_EQ(output.shape[0], 2);
-    ASSERT_EQ(output.shape[1], 1);
-    EXPECT_NEAR(output.data[0], 0.9080f, 1e-4f);
-    EXPECT_NEAR(output.data[1], 1.3850f, 1e-4f);
+TEST(QuantizationTest, BinaryLinearStraightThrough)
+{
+    BinaryLinear linear(4, 2);
+    Tensor input;
+    input.shape = {1, 4};
+    input.data = {0.5f, -2.0f, 0.25f, -0.75f};
+    input.requires_grad = true;
+    Tensor output;
+    linear.forward(input, output);
 
-    // Backward pass
-    output.resize_grad();
+    // Градиент во вход отсекается при |x| > 1, веса получают градиент
+    // по бинаризованному входу
     output.grad = {1.0f, 1.0f};
+    linear.backward(output, input);
+    EXPECT_EQ(input.grad[1], 0.0f);
+    EXPECT_NE(input.grad[0], 0.0f);
+    const float scale = (0.5f + 2.0f + 0.25f + 0.75f) / 4;
+    EXPECT_FLOAT_EQ(linear.weight.grad[0], scale);
+    EXPECT_FLOAT_EQ(linear.weight.grad[2], -scale);
 
-    model.backward(output, input);
+    // Обучение меняет знаки весов и уменьшает ошибку
+    Model model;
+    model.add_layer(new BinaryLinear(16, 8));
+    Tensor x, target;
+    x.shape = {16, 16};
+    x.resize();
+    target.shape = {16, 8};
+    target.resize();
+    for (size_t i = 0; i < x.data.size(); ++i)
+    {
+        x.data[i] = std::sin(0.9f * static_cast<float>(i));
+    }
+    for (size_t i = 0; i < target.data.size(); ++i)
+    {
+        target.data[i] = std::cos(0.4f * static_cast<float>(i));
+    }
+    SGD sgd(model.parameters(), 0.05f);
+    float first_loss = 0, loss = 0;
+    for (int step = 0; step < 50; ++step)
+    {
+        Tensor y;
+        model.forward(x, y);
+        y.resize_grad();
+        loss = 0;
+        for (size_t i = 0; i < y.data.size(); ++i)
+        {
+            const float diff = y.data[i] - target.data[i];
+            loss += diff * diff / y.data.size();
+            y.grad[i] = 2 * diff / y.data.size();
+        }
+        first_loss = step == 0 ? loss : first_loss;
+        sgd.zero_grad();
+        model.backward(y, x);
+        sgd.step();
+    }
+    EXPECT_LT(loss, first_loss);
+}
 
-    // Check input gradients
-    ASSERT_EQ(input.grad.size(), 6);
-    EXPECT_NEAR(input.grad[0], 0.2300f, 1e-4f);
-    EXPECT_NEAR(input.grad[1], 0.5300f, 1e-4f);
-    EXPECT_NEAR(input.grad[2], 0.8300f, 1e-4f);
-    EXPECT_NEAR(input.grad[3], 0.2300f, 1e-4f);
-    EXPECT_NEAR(input.grad[4], 0.5300f, 1e-4f);
-    EXPECT_NEAR(input.grad[5], 0.8300f, 1e-4f);
+TEST(QuantizationTest, LinearSubclassesAreNotQuantized)
+{
+    Model model;
+    model.add_layer(new Linear(8, 8));
+    model.add_layer(new BinaryLinear(8, 4));
+    Tensor input;
+    input.shape = {4, 8};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::sin(0.8f * i);
+    }
 
-    // Check layer1 weight gradients
-    ASSERT_EQ(layer1->weight.grad.size(), 6);
-    EXPECT_NEAR(layer1->weight.grad[0], 0.3500f, 1e-4f);
-    EXPECT_NEAR(layer1->weight.grad[1], 0.4000f, 1e-4f);
-    EXPECT_NEAR(layer1->weight.grad[2], 0.4900f, 1e-4f);
-    EXPECT_NEAR(layer1->weight.grad[3], 0.5600f, 1e-4f);
-    EXPECT_NEAR(layer1->weight.grad[4], 0.6300f, 1e-4f);
-    EXPECT_NEAR(layer1->weight.grad[5], 0.7200f, 1e-4f);
+    std::unique_ptr<Model> quantized;
+    {
+        Int8Quantizer quantizer(model);
+        quantizer.calibrate(input);
+        EXPECT_THROW(quantizer.input_range(1), std::logic_error);
+        quantized = quantizer.quantized_model();
+    }
+    EXPECT_NE(dynamic_cast<QuantizedLinear *>(quantized->layers[0]), nullptr);
+    EXPECT_NE(dynamic_cast<BinaryLinear *>(quantized->layers[1]), nullptr);
 
-    // Check layer1 bias gradients
-    ASSERT_EQ(layer1->bias.grad.size(), 2);
-    EXPECT_NEAR(layer1->bias.grad[0], 1.4000f, 1e-4f);
-    EXPECT_NEAR(layer1->bias.grad[1], 1.6000f, 1e-4f);
+    std::unique_ptr<Model> qat = prepare_qat(model);
+    ASSERT_EQ(qat->layers.size(), 3u);
+    EXPECT_NE(dynamic_cast<QATLinear *>(qat->layers[1]), nullptr);
+    EXPECT_EQ(dynamic_cast<QATLinear *>(qat->layers[2]), nullptr);
+    EXPECT_NE(dynamic_cast<BinaryLinear *>(qat->layers[2]), nullptr);
+}
 
-    // Check layer2 weight gradients
-    ASSERT_EQ(layer2->weight.grad.size(), 2);
-    EXPECT_NEAR(layer2->weight.grad[0], 0.9100f, 1e-4f);
-    EXPECT_NEAR(layer2->weight.grad[1], 1.3200f, 1e-4f);
+TEST(SparseLinearTest, MatchesPrunedLinear)
+{
+    Linear linear(37, 21);
+    EXPECT_EQ(prune_by_magnitude(linear, 0.9f), 699u); // 0.9 * 777
+    SparseLinear sparse(linear);
+    EXPECT_EQ(sparse.nnz(), 37u * 21 - 699);
+    EXPECT_NEAR(sparse.sparsity(), 0.9f, 1e-3f);
+    EXPECT_EQ(sparse.dense_weight().data, linear.weight.data);
+
+    for (size_t batch : {1, 6})
+    {
+        Tensor input;
+        input.shape = {batch, 37};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i)
+        {
+            input.data[i] = std::sin(0.45f * static_cast<float>(i));
+        }
+        input.requires_grad = true;
+        Tensor sparse_input = input;
+
+        Tensor expected, output;
+        linear.forward(input, expected);
+        sparse.forward(sparse_input, output);
+        ASSERT_EQ(output.shape, expected.shape);
+        for (size_t i = 0; i < output.data.size(); ++i)
+        {
+            EXPECT_NEAR(output.data[i], expected.data[i], 1e-5f);
+        }
 
-    // Check layer2 bias gradients
-    ASSERT_EQ(layer2->bias.grad.size(), 1);
-    EXPECT_NEAR(layer2->bias.grad[0], 2.0000f, 1e-4f);
+        expected.resize_grad();
+        output.resize_grad();
+        for (size_t i = 0; i < expected.grad.size(); ++i)
+        {
+            expected.grad[i] = std::cos(0.3f * static_cast<float>(i));
+            output.grad[i] = expected.grad[i];
+        }
+        linear.weight.zero_grad();
+        linear.bias.zero_grad();
+        sparse.values.zero_grad();
+        sparse.bias.zero_grad();
+        linear.backward(expected, input);
+        sparse.backward(output, sparse_input);
+        for (size_t i = 0; i < input.grad.size(); ++i)
+        {
+            EXPECT_NEAR(sparse_input.grad[i], input.grad[i], 1e-5f);
+        }
+        for (size_t j = 0; j < 21; ++j)
+        {
+            EXPECT_NEAR(sparse.bias.grad[j], linear.bias.grad[j], 1e-5f);
+            for (size_t p = sparse.row_offsets[j]; p < sparse.row_offsets[j + 1]; ++p)
+            {
+                EXPECT_NEAR(sparse.values.grad[p],
+                            linear.weight.grad[sparse.columns[p] * 21 + j], 1e-5f);
+            }
+        }
+    }
+}
+
+TEST(SparseLinearTest, ModelSparsifyConvertsPrunedLayers)
+{
+    Model model;
+    model.add_layer(new Linear(16, 32));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(32, 8));
+    model.add_layer(new QATLinear(8, 4));
+    prune_by_magnitude(*static_cast<Linear *>(model.layers[0]), 0.85f);
+    prune_by_magnitude(*static_cast<Linear *>(model.layers[2]), 0.5f);
+    prune_by_magnitude(*static_cast<Linear *>(model.layers[3]), 0.9f);
+    model.flatten_parameters();
+
+    Tensor input, expected, output;
+    input.shape = {4, 16};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i)
+    {
+        input.data[i] = std::cos(0.2f * static_cast<float>(i));
+    }
+    model.forward(input, expected);
+
+    EXPECT_EQ(model.sparsify(0.8f), 1u);
+    EXPECT_NE(dynamic_cast<SparseLinear *>(model.layers[0]), nullptr);
+    EXPECT_NE(dynamic_cast<Linear *>(model.layers[2]), nullptr);
+    EXPECT_NE(dynamic_cast<QATLinear *>(model.layers[3]), nullptr);
+    EXPECT_TRUE(model.has_flat_parameters());
+
+    model.forward(input, output);
+    for (size_t i = 0; i < output.data.size(); ++i)
+    {
+        EXPECT_NEAR(output.data[i], expected.data[i], 1e-5f);
+    }
+
+    // Разреженный слой обучается: меняются только ненулевые веса
+    SGD sgd(model.parameters(), 0.1f);
+    output.resize_grad();
+    std::fill(output.grad.begin(), output.grad.end(), 1.0f);
+    sgd.zero_grad();
+    model.backward(output, input);
+    sgd.step();
+    SparseLinear *sparse = static_cast<SparseLinear *>(model.layers[0]);
+    Tensor weight = sparse->dense_weight();
+    EXPECT_GE(std::count(weight.data.begin(), weight.data.end(), 0.0f),
+              static_cast<long>(0.85f * 16 * 32));
 }
 
 TEST(TensorTransposeTest, BasicTransposition)
@@ -1187,7 +3098,9 @@ TEST(BatchNorm1dTest, BackwardValidInput) {
     grad_output.resize();
     grad_output.resize_grad();
     grad_output.grad = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
-    Tensor grad_input;
+    // backward получает вход forward
+    Tensor grad_input = input;
+    grad_input.requires_grad = true;
     bn.backward(grad_output, grad_input);
     EXPECT_EQ(grad_input.shape, (std::vector<size_t>{4, 2}));
     EXPECT_FALSE(grad_input.grad.empty());
@@ -1195,6 +3108,41 @@ TEST(BatchNorm1dTest, BackwardValidInput) {
     EXPECT_FALSE(bn.parameters()[1]->grad.empty());
 }
 
+TEST(BatchNorm1dTest, BackwardReadsInputArgument) {
+    // Вход forward - временный тензор: backward читает x из своего
+    // аргумента, а не из сохраненной ссылки
+    Tensor input;
+    input.shape = {4, 3};
+    input.data = {1.0f, -2.0f, 0.5f, 3.0f, 4.0f, -1.0f,
+                  0.0f, 2.5f, 1.5f, -3.0f, 1.0f, 2.0f};
+    Tensor grad_output;
+    grad_output.shape = {4, 3};
+    grad_output.resize();
+    grad_output.grad = {0.1f, 0.2f, -0.3f, 0.4f, -0.5f, 0.6f,
+                        0.7f, -0.8f, 0.9f, 1.0f, 0.0f, -1.0f};
+
+    BatchNorm1d reference(3);
+    BatchNorm1d bn(3);
+    for (size_t k = 0; k < bn.parameters().size(); ++k) {
+        bn.parameters()[k]->data = reference.parameters()[k]->data;
+    }
+    Tensor output;
+    reference.forward(input, output);
+    Tensor expected = input;
+    expected.requires_grad = true;
+    reference.backward(grad_output, expected);
+
+    {
+        Tensor temporary = input;
+        bn.forward(temporary, output);
+    }
+    Tensor grad_input = input;
+    grad_input.requires_grad = true;
+    bn.backward(grad_output, grad_input);
+    EXPECT_EQ(grad_input.grad, expected.grad);
+    EXPECT_EQ(bn.parameters()[0]->grad, reference.parameters()[0]->grad);
+}
+
 TEST(BatchNorm1dTest, BackwardWithoutForward) {
     BatchNorm1d bn(2);
     Tensor grad_output;
@@ -1203,6 +3151,7 @@ TEST(BatchNorm1dTest, BackwardWithoutForward) {
     grad_output.resize_grad();
     grad_output.grad = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
     Tensor grad_input;
+    grad_input.requires_grad = true;
     EXPECT_THROW(bn.backward(grad_output, grad_input), std::runtime_error);
 }
 
@@ -1242,7 +3191,9 @@ TEST(BatchNorm1dTest, BackwardGradientDescent) {
             grad_output.grad[i] = 2.0f * (output.data[i] - target.data[i]) / output.data.size();
         }
 
-        Tensor grad_input;
+        // backward получает вход forward
+        Tensor grad_input = input;
+        grad_input.requires_grad = true;
         bn.backward(grad_output, grad_input);
 
         // Обновляем параметры
@@ -1262,6 +3213,107 @@ TEST(BatchNorm1dTest, BackwardGradientDescent) {
 }
 
 
+TEST(BatchNorm1dTest, EvalUsesRunningStats) {
+    BatchNorm1d bn(2, 1e-5, 0.1, true, true);
+    Tensor input;
+    input.shape = {4, 2};
+    input.resize();
+    input.data = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f};
+
+    // Первый forward в train копирует статистики батча в running-статистики
+    Tensor train_output;
+    bn.forward(input, train_output);
+
+    bn.eval();
+    EXPECT_FALSE(bn.training);
+    Tensor eval_output;
+    bn.forward(input, eval_output);
+    ASSERT_EQ(eval_output.shape, input.shape);
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        EXPECT_NEAR(eval_output.data[i], train_output.data[i], 1e-5f);
+    }
+
+    // Один пример не зависит от остального батча, статистики не меняются
+    Tensor sample;
+    sample.shape = {1, 2};
+    sample.resize();
+    sample.data = {5.0f, 6.0f};
+    Tensor sample_output;
+    bn.forward(sample, sample_output);
+    bn.forward(sample, sample_output);
+    EXPECT_NEAR(sample_output.data[0], train_output.data[4], 1e-5f);
+    EXPECT_NEAR(sample_output.data[1], train_output.data[5], 1e-5f);
+}
+
+TEST(BatchNorm1dTest, EvalInPlace) {
+    BatchNorm1d bn(2);
+    Tensor input;
+    input.shape = {4, 2};
+    input.resize();
+    input.data = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f};
+    Tensor output;
+    bn.forward(input, output);
+
+    bn.eval();
+    Tensor expected;
+    bn.forward(input, expected);
+    bn.forward(input, input);
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        EXPECT_FLOAT_EQ(input.data[i], expected.data[i]);
+    }
+
+    bn.train();
+    EXPECT_TRUE(bn.training);
+}
+
+
+TEST(BatchNorm1dTest, FuseIntoLinear) {
+    Model model;
+    model.add_layer(new Linear(3, 4));
+    model.add_layer(new BatchNorm1d(4));
+    model.add_layer(new ReLU());
+    model.add_layer(new Linear(4, 2));
+    model.add_layer(new BatchNorm1d(2));
+    // Параметры задаются детерминированно, чтобы ошибка округления не
+    // зависела от случайной инициализации Linear
+    std::vector<Tensor *> params = model.parameters();
+    for (size_t k = 0; k < params.size(); ++k) {
+        for (size_t i = 0; i < params[k]->data.size(); ++i) {
+            params[k]->data[i] = 0.5f * std::sin(1.3f * i + 0.9f * k);
+        }
+    }
+
+    Tensor input;
+    input.shape = {5, 3};
+    input.resize();
+    std::iota(input.data.begin(), input.data.end(), -2.0f);
+
+    // Накапливаем running-статистики на нескольких батчах
+    Tensor output;
+    for (int iter = 0; iter < 3; ++iter) {
+        for (float &x : input.data) x *= 0.9f;
+        model.forward(input, output);
+    }
+
+    model.eval();
+    Tensor expected;
+    model.forward(input, expected);
+
+    EXPECT_EQ(model.fuse_for_inference(), 2);
+    ASSERT_EQ(model.layers.size(), 3);
+    EXPECT_EQ(model.to_string(),
+              "Linear(in_features=3, out_features=4)\nReLU()\n"
+              "Linear(in_features=4, out_features=2)\n");
+
+    Tensor fused;
+    model.forward(input, fused);
+    ASSERT_EQ(fused.shape, expected.shape);
+    for (size_t i = 0; i < expected.data.size(); ++i) {
+        EXPECT_NEAR(fused.data[i], expected.data[i],
+                    1e-5f * (1.0f + std::abs(expected.data[i])));
+    }
+}
+
 // Тесты для BatchNorm2d
 TEST(BatchNorm2dTest, Initialization) {
     BatchNorm2d bn(32, 1e-5, 0.1, true, true);
@@ -1364,7 +3416,9 @@ TEST(BatchNorm2dTest, BackwardValidInput) {
     grad_output.resize();
     grad_output.resize_grad();
     grad_output.grad = std::vector<float>(grad_output.size(), 1.0f);
-    Tensor grad_input;
+    // backward получает вход forward
+    Tensor grad_input = input;
+    grad_input.requires_grad = true;
     bn.backward(grad_output, grad_input);
     EXPECT_EQ(grad_input.shape, (std::vector<size_t>{2, 2, 3, 3}));
     EXPECT_FALSE(grad_input.grad.empty());
@@ -1385,10 +3439,179 @@ TEST(BatchNorm2dTest, BackwardInvalidGradOutput) {
     grad_output.resize();
     grad_output.resize_grad();
     Tensor grad_input;
+    grad_input.requires_grad = true;
     EXPECT_THROW(bn.backward(grad_output, grad_input), std::invalid_argument);
 }
 
 
+TEST(BatchNorm2dTest, EvalMatchesTrainOnSameBatch) {
+    BatchNorm2d bn(2);
+    Tensor input;
+    input.shape = {2, 2, 3, 3};
+    input.resize();
+    std::iota(input.data.begin(), input.data.end(), 0.5f);
+
+    Model model;
+    model.add_layer(new BatchNorm2d(2));
+    Tensor train_output;
+    bn.forward(input, train_output);
+
+    bn.eval();
+    Tensor eval_output;
+    bn.forward(input, eval_output);
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        EXPECT_NEAR(eval_output.data[i], train_output.data[i], 1e-4f);
+    }
+
+    // Model::eval переключает все слои
+    model.eval();
+    EXPECT_FALSE(model.layers[0]->training);
+    model.train();
+    EXPECT_TRUE(model.layers[0]->training);
+}
+
+TEST(BatchNorm2dTest, BackwardInPlaceMatchesSavedInput) {
+    Tensor input;
+    input.shape = {2, 2, 2, 3};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        input.data[i] = std::sin(0.7f * i) * 2.0f;
+    }
+
+    BatchNorm2d bn(2);
+    Tensor output;
+    bn.forward(input, output);
+
+    Tensor grad_output;
+    grad_output.shape = output.shape;
+    grad_output.resize_grad();
+    for (size_t i = 0; i < grad_output.grad.size(); ++i) {
+        grad_output.grad[i] = std::cos(0.3f * i);
+    }
+    Tensor grad_input = input.copy();
+    grad_input.requires_grad = true;
+    bn.backward(grad_output, grad_input);
+
+    // Численная проверка градиента для L = sum(dy * y)
+    const float h = 1e-2f;
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        Tensor plus = input.copy(), minus = input.copy(), y;
+        plus.data[i] += h;
+        minus.data[i] -= h;
+        float l_plus = 0.0f, l_minus = 0.0f;
+        bn.forward(plus, y);
+        for (size_t j = 0; j < y.data.size(); ++j) l_plus += grad_output.grad[j] * y.data[j];
+        bn.forward(minus, y);
+        for (size_t j = 0; j < y.data.size(); ++j) l_minus += grad_output.grad[j] * y.data[j];
+        EXPECT_NEAR(grad_input.grad[i], (l_plus - l_minus) / (2 * h), 1e-2f);
+    }
+
+    // Forward на месте сохраняет x_hat и дает те же градиенты
+    Tensor in_place = input.copy();
+    bn.forward(in_place, in_place);
+    for (size_t i = 0; i < output.data.size(); ++i) {
+        EXPECT_NEAR(in_place.data[i], output.data[i], 1e-5f);
+    }
+    Tensor grad_in_place;
+    grad_in_place.requires_grad = true;
+    bn.backward(grad_output, grad_in_place);
+    for (size_t i = 0; i < grad_input.grad.size(); ++i) {
+        EXPECT_NEAR(grad_in_place.grad[i], grad_input.grad[i], 1e-5f);
+    }
+}
+
+TEST(BatchNorm2dTest, ChannelsLastMatchesNCHW) {
+    Tensor input;
+    input.shape = {3, 4, 5, 7};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        input.data[i] = std::sin(0.37f * i) * 3.0f + 1.0f;
+    }
+    Tensor grad_output;
+    grad_output.shape = input.shape;
+    grad_output.resize_grad();
+    for (size_t i = 0; i < grad_output.grad.size(); ++i) {
+        grad_output.grad[i] = std::cos(0.11f * i);
+    }
+
+    BatchNorm2d bn(4);
+    Tensor output, grad_input = input.copy();
+    grad_input.requires_grad = true;
+    bn.forward(input, output);
+    bn.backward(grad_output, grad_input);
+    std::vector<float> gamma_grad = bn.parameters()[0]->grad;
+    std::vector<float> beta_grad = bn.parameters()[1]->grad;
+    for (Tensor *param : bn.parameters()) param->zero_grad();
+
+    Tensor input_cl = input.to_memory_format(MemoryFormat::ChannelsLast);
+    Tensor grad_output_cl = grad_output.to_memory_format(MemoryFormat::ChannelsLast);
+    Tensor output_cl, grad_input_cl = input_cl.copy();
+    grad_input_cl.requires_grad = true;
+    bn.forward(input_cl, output_cl);
+    EXPECT_EQ(output_cl.memory_format, MemoryFormat::ChannelsLast);
+    bn.backward(grad_output_cl, grad_input_cl);
+
+    Tensor output_back = output_cl.contiguous();
+    Tensor grad_back = grad_input_cl.contiguous();
+    for (size_t i = 0; i < output.data.size(); ++i) {
+        EXPECT_NEAR(output_back.data[i], output.data[i], 1e-5f);
+        EXPECT_NEAR(grad_back.grad[i], grad_input.grad[i], 1e-5f);
+    }
+    for (size_t c = 0; c < 4; ++c) {
+        EXPECT_NEAR(bn.parameters()[0]->grad[c], gamma_grad[c], 1e-3f);
+        EXPECT_NEAR(bn.parameters()[1]->grad[c], beta_grad[c], 1e-3f);
+    }
+
+    bn.eval();
+    Tensor eval_output, eval_output_cl;
+    bn.forward(input, eval_output);
+    bn.forward(input_cl, eval_output_cl);
+    Tensor eval_back = eval_output_cl.contiguous();
+    for (size_t i = 0; i < eval_output.data.size(); ++i) {
+        EXPECT_NEAR(eval_back.data[i], eval_output.data[i], 1e-5f);
+    }
+}
+
+TEST(BatchNorm2dTest, ParallelIsDeterministic) {
+    for (MemoryFormat format : {MemoryFormat::Contiguous, MemoryFormat::ChannelsLast}) {
+        Tensor input;
+        input.shape = {4, 3, 48, 50};
+        input.resize();
+        for (size_t i = 0; i < input.data.size(); ++i) {
+            input.data[i] = std::sin(0.013f * i) * 5.0f + 0.001f * (i % 97);
+        }
+        input = input.to_memory_format(format);
+        Tensor grad_output;
+        grad_output.shape = input.shape;
+        grad_output.memory_format = format;
+        grad_output.resize_grad();
+        for (size_t i = 0; i < grad_output.grad.size(); ++i) {
+            grad_output.grad[i] = std::cos(0.007f * i);
+        }
+
+        std::vector<float> ref_output, ref_grad, ref_gamma_grad;
+        for (size_t threads : {1, 2, 3, 4}) {
+            set_num_threads(threads);
+            BatchNorm2d bn(3);
+            bn.parameters()[0]->data = {1.0f, 0.5f, 2.0f};
+            Tensor output, grad_input = input.copy();
+            grad_input.requires_grad = true;
+            bn.forward(input, output);
+            bn.backward(grad_output, grad_input);
+            if (threads == 1) {
+                ref_output = output.data;
+                ref_grad = grad_input.grad;
+                ref_gamma_grad = bn.parameters()[0]->grad;
+            } else {
+                EXPECT_EQ(output.data, ref_output);
+                EXPECT_EQ(grad_input.grad, ref_grad);
+                EXPECT_EQ(bn.parameters()[0]->grad, ref_gamma_grad);
+            }
+        }
+    }
+    set_num_threads(default_num_threads());
+}
+
 TEST(BatchNorm2dTest, BackwardGradientDescent) {
     BatchNorm2d bn(2, 1e-5, 0.1, true, true);
     Tensor input;
@@ -1423,7 +3646,9 @@ TEST(BatchNorm2dTest, BackwardGradientDescent) {
             grad_output.grad[i] = 2.0f * (output.data[i] - target.data[i]) / output.data.size();
         }
 
-        Tensor grad_input;
+        // backward получает вход forward
+        Tensor grad_input = input;
+        grad_input.requires_grad = true;
         bn.backward(grad_output, grad_input);
 
         update_parameters(bn.parameters(), learning_rate);
@@ -1549,7 +3774,9 @@ TEST(BatchNorm3dTest, BackwardValidInput) {
     grad_output.resize();
     grad_output.resize_grad();
     grad_output.grad = std::vector<float>(grad_output.size(), 1.0f);
-    Tensor grad_input;
+    // backward получает вход forward
+    Tensor grad_input = input;
+    grad_input.requires_grad = true;
     bn.backward(grad_output, grad_input);
     EXPECT_EQ(grad_input.shape, (std::vector<size_t>{2, 2, 3, 3, 3}));
     EXPECT_FALSE(grad_input.grad.empty());
@@ -1565,11 +3792,30 @@ TEST(BatchNorm3dTest, BackwardWithoutForward) {
     grad_output.resize_grad();
     grad_output.grad = std::vector<float>(grad_output.size(), 1.0f);
     Tensor grad_input;
+    grad_input.requires_grad = true;
     EXPECT_THROW(bn.backward(grad_output, grad_input), std::runtime_error);
 }
 
 
 
+TEST(BatchNorm3dTest, ChannelsLastMatchesNCDHW) {
+    Tensor input;
+    input.shape = {2, 3, 2, 3, 4};
+    input.resize();
+    for (size_t i = 0; i < input.data.size(); ++i) {
+        input.data[i] = std::sin(0.53f * i) + 0.1f * i;
+    }
+
+    BatchNorm3d bn(3);
+    Tensor output, output_cl;
+    bn.forward(input, output);
+    bn.forward(input.to_memory_format(MemoryFormat::ChannelsLast), output_cl);
+    Tensor output_back = output_cl.contiguous();
+    for (size_t i = 0; i < output.data.size(); ++i) {
+        EXPECT_NEAR(output_back.data[i], output.data[i], 1e-4f);
+    }
+}
+
 TEST(BatchNorm3dTest, BackwardGradientDescent) {
     BatchNorm3d bn(2, 1e-5, 0.1, true, true);
     Tensor input;
@@ -1604,7 +3850,9 @@ TEST(BatchNorm3dTest, BackwardGradientDescent) {
             grad_output.grad[i] = 2.0f * (output.data[i] - target.data[i]) / output.data.size();
         }
 
-        Tensor grad_input;
+        // backward получает вход forward
+        Tensor grad_input = input;
+        grad_input.requires_grad = true;
         bn.backward(grad_output, grad_input);
 
         update_parameters(bn.parameters(), learning_rate);